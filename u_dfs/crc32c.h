@@ -0,0 +1,190 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+//CRC32C (Castagnoli) shared by u_dfs and u_dfc, the per-chunk checksum that follows a chunk from the client's put
+//to the server's disk and back to the client's get
+//x86 machines with SSE4.2 and ARMv8 builds with the CRC extension compute it with the crc32 instructions,
+//8 bytes at a time, everything else uses slicing-by-8 tables
+//on x86 three streams run at once to hide the instruction's latency, and their crcs are joined with tables
+//that shift a crc past a fixed number of zero bytes (the same trick as Mark Adler's crc32c.c)
+//like the content hash it can be fed its input in pieces, crc32c(crc32c(0, a), b) is the crc of a followed by b
+//call crc32c_init once before anything else
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+//the lengths the interleaved streams run for, long ones for big buffers and short ones for what's left
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static uint32_t (*crc32c_fn)(uint32_t, const unsigned char*, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+//the running value here is inverted, crc32c() takes care of that
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len) {
+	while(len > 0 && ((uintptr_t) p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	for(; len >= 8; p += 8, len -= 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo = le32toh(lo) ^ crc;
+		hi = le32toh(hi);
+		crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+	}
+	while(len-- > 0)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+//multiply the 32x32 bit matrix mat by vec over GF(2)
+static uint32_t crc32c_gf2_times(const uint32_t *mat, uint32_t vec) {
+	uint32_t sum = 0;
+	for(; vec; vec >>= 1, mat++)
+		if(vec & 1) sum ^= *mat;
+	return sum;
+}
+
+static void crc32c_gf2_square(uint32_t *square, const uint32_t *mat) {
+	for(int n = 0; n < 32; n++)
+		square[n] = crc32c_gf2_times(mat, mat[n]);
+}
+
+//tables that take a crc to what it would be after len more zero bytes
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+	uint32_t odd[32], even[32], *op = odd;
+
+	//odd is the operator for one zero bit, squaring it doubles the number of bits
+	odd[0] = CRC32C_POLY;
+	for(int n = 1; n < 32; n++) odd[n] = 1U << (n - 1);
+	crc32c_gf2_square(even, odd);
+	crc32c_gf2_square(odd, even);
+
+	//odd is now a zero byte, square it up through the bits of len
+	while(len) {
+		crc32c_gf2_square(even, odd);
+		op = even;
+		len >>= 1;
+		if(len == 0) break;
+		crc32c_gf2_square(odd, even);
+		op = odd;
+		len >>= 1;
+	}
+
+	for(int n = 0; n < 256; n++)
+		for(int b = 0; b < 4; b++)
+			zeros[b][n] = crc32c_gf2_times(op, (uint32_t) n << (8*b));
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+#ifdef CRC32C_X86
+//three stretches of block bytes at once, returns the crc of all three after crc
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_sse42_3way(uint32_t crc, const unsigned char *p, size_t block, uint32_t zeros[4][256]) {
+	uint64_t c0 = crc, c1 = 0, c2 = 0;
+
+	for(const unsigned char *end = p + block; p < end; p += 8) {
+		uint64_t v0, v1, v2;
+		memcpy(&v0, p, 8);
+		memcpy(&v1, p + block, 8);
+		memcpy(&v2, p + 2*block, 8);
+		c0 = _mm_crc32_u64(c0, v0);
+		c1 = _mm_crc32_u64(c1, v1);
+		c2 = _mm_crc32_u64(c2, v2);
+	}
+	crc = crc32c_shift(zeros, c0) ^ c1;
+	return crc32c_shift(zeros, crc) ^ c2;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	while(len > 0 && ((uintptr_t) p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	for(; len >= 3*CRC32C_LONG; p += 3*CRC32C_LONG, len -= 3*CRC32C_LONG)
+		crc = crc32c_sse42_3way(crc, p, CRC32C_LONG, crc32c_long);
+	for(; len >= 3*CRC32C_SHORT; p += 3*CRC32C_SHORT, len -= 3*CRC32C_SHORT)
+		crc = crc32c_sse42_3way(crc, p, CRC32C_SHORT, crc32c_short);
+
+	uint64_t c = crc;
+	for(; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+	while(len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32c_arm(uint32_t crc, const unsigned char *p, size_t len) {
+	for(; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+	while(len-- > 0)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+static void crc32c_setup(void) {
+	for(int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for(int b = 0; b < 8; b++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for(int i = 0; i < 256; i++)
+		for(int t = 1; t < 8; t++)
+			crc32c_table[t][i] = crc32c_table[0][crc32c_table[t-1][i] & 0xff] ^ (crc32c_table[t-1][i] >> 8);
+	crc32c_zeros(crc32c_long, CRC32C_LONG);
+	crc32c_zeros(crc32c_short, CRC32C_SHORT);
+
+	crc32c_fn = crc32c_soft;
+#if defined(CRC32C_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")) crc32c_fn = crc32c_sse42;
+#elif defined(CRC32C_ARM)
+	crc32c_fn = crc32c_arm;
+#endif
+}
+
+static inline void crc32c_init(void) {
+	pthread_once(&crc32c_once, crc32c_setup);
+}
+
+//the crc of len more bytes after whatever crc covers, start from 0
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	return ~crc32c_fn(~crc, buf, len);
+}
+
+#endif
@@ -0,0 +1,2788 @@
+//client library behind dfc.h, everything u_dfc does with the servers happens here
+//connections come out of per-server pools, so a long-running program (like u_dfc agent) only connects once
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "frame.h"
+#include "proto.h"
+#include "hash.h"
+#include "rs.h"
+#include "lz.h"
+#include "dfc.h"
+
+#define BUFSIZE 4096
+
+//used when dfc.conf doesn't say otherwise
+#define DEFAULT_REPLICAS 2
+
+//files smaller than this (in bytes) are stored whole instead of striped, unless dfc.conf says otherwise
+#define DEFAULT_SMALL 65536
+
+//striped replicated files are cut into blocks no bigger than this (in bytes), unless dfc.conf says otherwise
+#define DEFAULT_BLOCK (4 << 20)
+
+//how much of a file put prepares and sends before starting on the next part of it
+#define PUT_WINDOW (256 << 20)
+
+//most files a batched put sends a server in one request
+#define BATCH_FILES 1024
+
+//writev's limit on buffers per call, in case limits.h doesn't tell us
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//files stored before the server recorded chunk counts were always split 4 ways
+#define LEGACY_CHUNKS 4
+
+//how many files list asks a server for at a time, which bounds how much the server has to buffer
+#define LIST_PAGE 65536
+
+//how many requests we let build up on one connection before waiting for a reply
+#define PIPELINE_DEPTH 64
+
+//how often (in seconds) scrub asks the servers whether they're done
+//and the longest stats report we'll take from a server
+#define SCRUB_POLL 1
+#define STATS_MAX (1 << 20)
+
+//idle connections kept per server, and how often (in seconds) the idle ones are checked on
+#define POOL_MAX_IDLE 8
+#define POOL_CHECK_INTERVAL 5
+
+//an open v2 connection to one server
+//next_id is the id the next request on it gets
+typedef struct pconn {
+	int sock;
+	rbuf in;
+	uint32_t next_id;
+	struct pconn *next;
+} pconn;
+
+//one server from dfc.conf and its idle connections
+//a server that refused us is marked down, and only the checker tries it again, so calls don't keep waiting on it
+typedef struct {
+	char *name;
+	char *host;
+	pthread_mutex_t lock;
+	pconn *idle;
+	int num_idle;
+	int down;
+} server_pool;
+
+//the servers from dfc.conf and how files are spread over them
+//files under small bytes are kept as a single chunk
+//replicated files are striped over chunks chunks, or blocks of block bytes if that makes more of them
+//with parity set, striped files are stripes of chunks data shards plus parity Reed-Solomon shards, one copy each, instead of replicas
+//with dedup set, striped chunks whose contents a server already holds aren't sent to it again
+//with compress set, chunks that compress well are sent and stored compressed (lz.h), and decompressed again by get
+struct dfc {
+	int num_serv;
+	int replicas;
+	int chunks;
+	int parity;
+	long long small;
+	long long block;
+	int dedup;
+	int compress;
+	server_pool *servers;
+	
+	//background thread that pings idle connections and reconnects to servers that went down
+	pthread_t checker;
+	pthread_mutex_t stop_lock;
+	pthread_cond_t stop_cond;
+	int stopping;
+};
+
+//one thing a traced call spent its time on, in Chrome's trace event format: ph is 'X' for a span from ts lasting dur,
+//'b', 'n' and 'e' for the begin, a point in and the end of an asynchronous span, which is how requests in flight
+//on one connection can overlap, id tying the three together
+typedef struct {
+	char name[32];
+	char detail[96];
+	char ph;
+	int tid;
+	unsigned long long id;
+	long long ts, dur;
+} trace_event;
+
+//everything recorded since dfc_trace_start, for the whole process, since one u_dfc run can use any number of handles
+//on is read without the lock, so a trace point costs a load and a branch when tracing is off
+//times are the monotonic clock in nanoseconds, and written out relative to start
+static struct {
+	int on;
+	char *path;
+	pthread_mutex_t lock;
+	trace_event *events;
+	int num_events, cap_events;
+	long long start;
+	int next_tid;
+	unsigned long long next_id;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//which thread an event happened on, numbered from 1 the first time it records something
+static __thread int trace_tid;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//write several buffers to a socket in as few syscalls as possible
+//a server that went away fails the write instead of raising SIGPIPE in whatever program we're part of
+static int socket_writev(int sock, struct iovec *iov, int iovcnt) {
+	while(iovcnt > 0) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt };
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		
+		//skip past whatever was fully written, and trim the buffer we stopped in
+		while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+//send one v2 request, the header and every part of the payload go out in a single writev
+static int send_msg(int sock, int opcode, uint32_t id, struct iovec *payload, int parts) {
+	char header[MSG_HDR_LEN];
+	struct iovec iov[parts + 1];
+	uint64_t length = 0;
+	
+	for(int i = 0; i < parts; i++) {
+		iov[i+1] = payload[i];
+		length += payload[i].iov_len;
+	}
+	msg_pack(header, opcode, 0, id, length);
+	iov[0].iov_base = header;
+	iov[0].iov_len = MSG_HDR_LEN;
+	return socket_writev(sock, iov, parts + 1);
+}
+
+//read the header of the next reply, returns -1 if the connection failed or it isn't a reply
+static int recv_msg(rbuf *in, int sock, msg_hdr *hdr) {
+	char header[MSG_HDR_LEN];
+	
+	if(rbuf_read_exact(in, sock, header, MSG_HDR_LEN) != 0 || msg_unpack(header, hdr) < 0)
+		return -1;
+	return 0;
+}
+
+//write a length-prefixed string into buf, returns how many bytes that took
+static int pack_string(char *buf, char *str) {
+	int len = strlen(str);
+	put_u16(buf, len);
+	memcpy(buf + 2, str, len);
+	return len + 2;
+}
+
+//hash function (used this in proxy and didn't wanna add any more dependencies)
+static unsigned long fileHash(char *str) {
+    unsigned long hash = 5381;
+    int c;
+
+    while ((c = *str++))
+        hash = ((hash << 5) + hash) + c;
+
+    return hash;
+}
+
+//score used for rendezvous hashing, FNV-1a over the server name, filename and chunk followed by a 64 bit mix
+//djb2 above doesn't spread similar inputs well enough for this
+static unsigned long long placement_score(char *server, char *filename, int chunk) {
+	unsigned long long hash = 14695981039346656037ULL;
+	
+	for(char *p = server; *p; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+	hash = (hash ^ 0xff) * 1099511628211ULL;
+	for(char *p = filename; *p; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+	hash = (hash ^ 0xff) * 1099511628211ULL;
+	hash ^= (unsigned long long) chunk;
+	
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+//rendezvous (highest random weight) placement: every server scores each chunk and the highest scores hold it
+//order gets every server index, best first, so a chunk's replicas are the first R entries
+//adding a server only moves the chunks it now outscores everyone on, about 1/N of them
+static void place_chunk(dfc *d, char *filename, int chunk, int order[]) {
+	unsigned long long scores[d->num_serv];
+	
+	for(int i = 0; i < d->num_serv; i++) {
+		scores[i] = placement_score(d->servers[i].name, filename, chunk);
+		
+		//insertion sort, clusters are at most a few dozen servers
+		int j = i;
+		while(j > 0 && scores[order[j-1]] < scores[i]) {
+			order[j] = order[j-1];
+			j--;
+		}
+		order[j] = i;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//functionality functions
+static void *list_thread(void*);
+static void *prepare_thread(void*);
+static void encode_stripe(char*, long long, long long, int, int, int, char*, long long);
+static void *put_thread(void*);
+static int put_chunk(int, uint32_t, char*, int, int, long long, char*, uint32_t, long long, long long);
+static int put_ref(int, uint32_t, char*, int, int, unsigned char*, uint32_t, long long, long long);
+static int find_held(void*);
+static int send_chunks(void*, int*, int, int*);
+static void *batch_thread(void*);
+static int send_batch(int, uint32_t, char**, char**, long long*, uint32_t*, long long*, long long, int);
+static long long put_generation(void);
+static void drop_older(dfc*, void*, int*);
+static void *drop_thread(void*);
+static int read_all(int, char*, long long);
+static int write_all(int, char*, long long, long long);
+static void *stat_thread(void*);
+static int get_replicated(dfc*, void*, int, int);
+static int get_erasure(dfc*, void*, int, int, int, int);
+static long long get_stripe(void*, int, int, int, int, char**, long long, long long);
+static long long shard_offset(long long, int, int, long long*);
+static int chunk_wanted(void*, int, long long*, long long*);
+static int shard_holder(void*, int, int);
+static int forget_failed(void*, int);
+static void fetch_all(void*, int);
+static void *get_thread(void*);
+static int recv_to_file(void*, long long, long long, uint32_t*);
+
+//helper functions
+static int read_conf_file(dfc*, const char*);
+static int connect_to_host(int*, char*);
+static int hello(int, rbuf*);
+static pconn *pool_connect(server_pool*);
+static pconn *pool_get(server_pool*);
+static void pool_put(server_pool*, pconn*, int);
+static void pool_close(pconn*);
+static int pool_lease(dfc*, pconn**);
+static void pool_release(dfc*, pconn**, int*);
+static void *pool_checker(void*);
+
+static long long trace_now(void);
+static void trace_record(char, const char*, const char*, unsigned long long, long long, long long);
+static void trace_span(const char*, const char*, long long);
+static void trace_async(char, const char*, const char*, int, unsigned long long);
+static unsigned long long trace_ids(int);
+static void trace_escape(FILE*, const char*);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//one file seen while listing, present has a bit set for every chunk some server has
+//up to 64 chunks fit in bits itself, more get their own array of words
+//for an erasure coded file, the chunks are stripes of data shards followed by parity shards,
+//any data of each stripe's shards are enough to rebuild it
+//gen is the generation of the newest version of the file any server has, only chunks of that version count
+typedef struct {
+	char *name;
+	long long gen;
+	int count;
+	int parity;
+	int data;
+	unsigned long long bits;
+	unsigned long long *words;
+} listed_file;
+
+//every file any server listed, in the order we first saw them
+//slots is an open addressing table of file index + 1 keyed by filename, 0 meaning empty, kept at most half full
+//all the list threads merge into the one map as their replies arrive, so it's behind a mutex
+typedef struct {
+	pthread_mutex_t lock;
+	listed_file *files;
+	int num_files, cap_files;
+	int *slots;
+	int num_slots;
+} file_map;
+
+//one server's share of a list
+typedef struct {
+	int sock;
+	rbuf *in;
+	uint32_t *next_id;
+	file_map *map;
+	int broken;
+} list_job;
+
+static unsigned long long *chunk_bits(listed_file *f) {
+	return f->count <= 64 ? &f->bits : f->words;
+}
+
+//start f over as a version of the file with count chunks, none of which any server has yet
+//returns -1 if we ran out of memory, leaving f as it was
+static int listed_reset(listed_file *f, int count, int parity, int data, long long gen) {
+	unsigned long long *words = NULL;
+	
+	if(count > 64 && (words = calloc((count + 63) / 64, sizeof(unsigned long long))) == NULL) return -1;
+	free(f->words);
+	f->words = words;
+	f->bits = 0;
+	f->count = count;
+	f->parity = parity;
+	f->data = data;
+	f->gen = gen;
+	return 0;
+}
+
+//find filename in the map, adding it if it isn't there yet
+//caller holds map->lock, returns NULL if we ran out of memory
+static listed_file *map_file(file_map *map, char *filename, int count, int parity, int data, long long gen) {
+	unsigned long mask = map->num_slots - 1;
+	unsigned long i;
+	
+	if(map->num_slots > 0) {
+		for(i = fileHash(filename) & mask; map->slots[i] != 0; i = (i + 1) & mask) {
+			listed_file *f = &map->files[map->slots[i] - 1];
+			if(strcmp(f->name, filename)==0) return f;
+		}
+	}
+	
+	if(map->num_files == map->cap_files) {
+		int cap = map->cap_files ? 2*map->cap_files : 1024;
+		listed_file *files = realloc(map->files, cap * sizeof(listed_file));
+		if(files == NULL) return NULL;
+		map->files = files;
+		map->cap_files = cap;
+	}
+	
+	//double the table once it's half full, rehashing from the file array
+	if(2*(map->num_files + 1) > map->num_slots) {
+		int num_slots = map->num_slots ? 2*map->num_slots : 2048;
+		int *slots = calloc(num_slots, sizeof(int));
+		if(slots == NULL) return NULL;
+		
+		mask = num_slots - 1;
+		for(int f = 0; f < map->num_files; f++) {
+			for(i = fileHash(map->files[f].name) & mask; slots[i] != 0; i = (i + 1) & mask);
+			slots[i] = f + 1;
+		}
+		free(map->slots);
+		map->slots = slots;
+		map->num_slots = num_slots;
+	}
+	
+	listed_file *f = &map->files[map->num_files];
+	memset(f, 0, sizeof(listed_file));
+	f->name = strdup(filename);
+	if(f->name == NULL) return NULL;
+	if(listed_reset(f, count, parity, data, gen) < 0) {
+		free(f->name);
+		return NULL;
+	}
+	
+	for(i = fileHash(filename) & mask; map->slots[i] != 0; i = (i + 1) & mask);
+	map->slots[i] = ++map->num_files;
+	return f;
+}
+
+//ask every server for its files at once and report each file once, marking the ones we can't rebuild
+int dfc_list(dfc *d, dfc_list_cb cb, void *arg) {
+	int num_serv = d->num_serv;
+	list_job jobs[num_serv];
+	pthread_t runners[num_serv];
+	pconn *conns[num_serv];
+	int broken[num_serv];
+	file_map map;
+	
+	memset(&map, 0, sizeof(map));
+	pthread_mutex_init(&map.lock, NULL);
+	memset(jobs, 0, sizeof(jobs));
+	
+	if(pool_lease(d, conns) == 0) return -1;
+	
+	for(int i=0; i<num_serv; i++) {
+		runners[i] = 0;
+		
+		//if server is down, ignore
+		if(conns[i] == NULL) continue;
+		jobs[i].sock = conns[i]->sock;
+		jobs[i].in = &conns[i]->in;
+		jobs[i].next_id = &conns[i]->next_id;
+		jobs[i].map = &map;
+		if(pthread_create(&runners[i], NULL, list_thread, &jobs[i]) != 0) {
+			runners[i] = 0;
+			list_thread(&jobs[i]);
+		}
+	}
+	for(int i=0; i<num_serv; i++) {
+		if(runners[i]) pthread_join(runners[i], NULL);
+		broken[i] = jobs[i].broken;
+	}
+	pool_release(d, conns, broken);
+	
+	//list files and determine whether or not they are constructible
+	for(int i=0; i<map.num_files; i++) {
+		listed_file *f = &map.files[i];
+		unsigned long long *bits = chunk_bits(f);
+		int all_chunks = 1;
+		
+		//an erasure coded file only needs enough of each stripe's shards, any of them
+		if(f->parity > 0) {
+			int width = f->data + f->parity;
+			for(int t=0; t<f->count && all_chunks; t+=width) {
+				int present = 0;
+				for(int c=t; c<t+width; c++)
+					present += bits[c/64] >> (c%64) & 1;
+				all_chunks = present >= f->data;
+			}
+		}
+		else {
+			for(int w=0; w<f->count/64 && all_chunks; w++)
+				if(bits[w] != ~0ULL) all_chunks = 0;
+			if(f->count % 64 && bits[f->count/64] != (1ULL << (f->count % 64)) - 1)
+				all_chunks = 0;
+		}
+		
+		cb(f->name, all_chunks, arg);
+		free(f->name);
+		free(f->words);
+	}
+	free(map.files);
+	free(map.slots);
+	pthread_mutex_destroy(&map.lock);
+	return 0;
+}
+
+//page through one server's files, merging each one into the map as soon as it arrives
+static void *list_thread(void *args) {
+	list_job *job = (list_job *)args;
+	file_map *map = job->map;
+	char request[10], name[65536];
+	uint32_t *chunks = NULL;
+	int cap_chunks = 0;
+	int32_t after = 0;
+	
+	while(after >= 0) {
+		msg_hdr hdr;
+		char fields[16];
+		uint32_t id = (*job->next_id)++;
+		
+		put_u32(request, after);
+		put_u32(request + 4, LIST_PAGE);
+		put_u16(request + 8, 0);
+		struct iovec payload = { request, 10 };
+		
+		if(send_msg(job->sock, OP_LIST, id, &payload, 1) < 0 ||
+		   recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id != id || hdr.status != STATUS_OK ||
+		   hdr.length < 8 || rbuf_read_exact(job->in, job->sock, fields, 8) != 0)
+			break;
+		
+		uint32_t files = get_u32(fields);
+		uint64_t left = hdr.length - 8;
+		after = get_u32(fields + 4);
+		
+		for(uint32_t j=0; j<files; j++) {
+			//each file is its name, how many chunks it was split into, its generation, then the chunks this server has
+			if(left < 2 || rbuf_read_exact(job->in, job->sock, fields, 2) != 0) goto done;
+			int name_len = get_u16(fields);
+			if(left < 2 + (uint64_t) name_len + 16 ||
+			   rbuf_read_exact(job->in, job->sock, name, name_len) != 0 ||
+			   rbuf_read_exact(job->in, job->sock, fields, 16) != 0)
+				goto done;
+			name[name_len] = '\0';
+			
+			//files from before chunk counts were recorded, and erasure coded files from before they were cut into stripes
+			int count = count_chunks(get_u32(fields)), parity = count_parity(get_u32(fields)), data = count_data(get_u32(fields));
+			long long gen = get_u64(fields + 4);
+			uint32_t num_chunks = get_u32(fields + 12);
+			if(count <= 0) count = LEGACY_CHUNKS;
+			if(parity >= count) parity = 0;
+			if(data == 0 || count % (data + parity) != 0) data = count - parity;
+			left -= 2 + name_len + 16;
+			
+			if(left < 4 * (uint64_t) num_chunks) goto done;
+			if((int) num_chunks > cap_chunks) {
+				cap_chunks = num_chunks;
+				uint32_t *grown = realloc(chunks, cap_chunks * sizeof(uint32_t));
+				if(grown == NULL) {
+					perror("malloc for list");
+					goto done;
+				}
+				chunks = grown;
+			}
+			if(num_chunks > 0 && rbuf_read_exact(job->in, job->sock, chunks, 4 * num_chunks) != 0) goto done;
+			left -= 4 * num_chunks;
+			
+			pthread_mutex_lock(&map->lock);
+			listed_file *f = map_file(map, name, count, parity, data, gen);
+			
+			//a newer version than the servers before us had replaces theirs, and an older one doesn't count at all
+			if(f != NULL && gen > f->gen && listed_reset(f, count, parity, data, gen) < 0) f = NULL;
+			if(f == NULL) {
+				pthread_mutex_unlock(&map->lock);
+				perror("malloc for list");
+				goto done;
+			}
+			if(gen < f->gen) num_chunks = 0;
+			
+			unsigned long long *bits = chunk_bits(f);
+			for(uint32_t k=0; k<num_chunks; k++) {
+				uint32_t chunk = le32toh(chunks[k]);
+				if(chunk < (uint32_t) f->count)
+					bits[chunk / 64] |= 1ULL << (chunk % 64);
+			}
+			pthread_mutex_unlock(&map->lock);
+		}
+		if(left != 0) break;
+	}
+done:
+	//anything but reaching the last page leaves the connection somewhere in the middle of a reply
+	job->broken = after >= 0;
+	free(chunks);
+	return NULL;
+}
+
+//start a scrub on every server, then ask them how it's going every SCRUB_POLL seconds until they're all done
+//it's one small request per server, so they're simply asked in turn
+int dfc_scrub(dfc *d, dfc_scrub_cb cb, void *arg) {
+	int num_serv = d->num_serv;
+	pconn *conns[num_serv];
+	int broken[num_serv], running[num_serv];
+	unsigned long long checked[num_serv], failed[num_serv];
+	int waiting = 1;
+	
+	if(pool_lease(d, conns) == 0) return -1;
+	memset(broken, 0, sizeof(broken));
+	for(int i=0; i<num_serv; i++) running[i] = 1;
+	
+	for(int round=0; waiting; round++) {
+		if(round > 0) sleep(SCRUB_POLL);
+		waiting = 0;
+		
+		for(int i=0; i<num_serv; i++) {
+			char fields[20];
+			msg_hdr hdr;
+			
+			if(conns[i] == NULL || broken[i] || !running[i]) continue;
+			
+			uint32_t id = conns[i]->next_id++;
+			put_u32(fields, round == 0);
+			struct iovec payload = { fields, 4 };
+			if(send_msg(conns[i]->sock, OP_SCRUB, id, &payload, 1) < 0 || recv_msg(&conns[i]->in, conns[i]->sock, &hdr) < 0 ||
+			   hdr.id != id || hdr.length != 20 || rbuf_read_exact(&conns[i]->in, conns[i]->sock, fields, 20) != 0) {
+				broken[i] = 1;
+				continue;
+			}
+			running[i] = get_u32(fields);
+			checked[i] = get_u64(fields + 4);
+			failed[i] = get_u64(fields + 12);
+			if(running[i]) waiting = 1;
+		}
+	}
+	
+	for(int i=0; i<num_serv; i++) {
+		if(conns[i] == NULL || broken[i]) cb(d->servers[i].name, 0, 0, 0, arg);
+		else cb(d->servers[i].name, 1, checked[i], failed[i], arg);
+	}
+	pool_release(d, conns, broken);
+	return 0;
+}
+
+//ask each server in turn for its stats report
+int dfc_stats(dfc *d, dfc_stats_cb cb, void *arg) {
+	int num_serv = d->num_serv;
+	pconn *conns[num_serv];
+	int broken[num_serv];
+	
+	if(pool_lease(d, conns) == 0) return -1;
+	memset(broken, 0, sizeof(broken));
+	
+	for(int i=0; i<num_serv; i++) {
+		char *report = NULL;
+		msg_hdr hdr;
+		
+		if(conns[i] == NULL) {
+			cb(d->servers[i].name, NULL, arg);
+			continue;
+		}
+		
+		uint32_t id = conns[i]->next_id++;
+		if(send_msg(conns[i]->sock, OP_STATS, id, NULL, 0) < 0 || recv_msg(&conns[i]->in, conns[i]->sock, &hdr) < 0 ||
+		   hdr.id != id || hdr.status != STATUS_OK || hdr.length > STATS_MAX || (report = malloc(hdr.length + 1)) == NULL ||
+		   rbuf_read_exact(&conns[i]->in, conns[i]->sock, report, hdr.length) != 0)
+			broken[i] = 1;
+		else
+			report[hdr.length] = '\0';
+		cb(d->servers[i].name, broken[i] ? NULL : report, arg);
+		free(report);
+	}
+	pool_release(d, conns, broken);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//what one server has of a file, and the chunks we've asked it to send us
+typedef struct {
+	int sock;
+	rbuf *in;
+	uint32_t *next_id;
+	char *server;
+	char *filename;
+	
+	//filled in by stat_thread
+	//gen is the generation of the put the server's chunks are from,
+	//total is how many chunks the server says the file has, for an erasure coded file they're stripes of data shards
+	//followed by parity shards,
+	//chunk_size is -1 for chunks it doesn't have, and chunk_crc is -1 for chunks it has no crc32c for
+	//chunk_size is always how long a chunk is once decompressed, chunk_packed is how long it's stored if it's compressed
+	//and -1 if it isn't
+	long long gen;
+	int total;
+	int parity;
+	int data;
+	long long *chunk_size;
+	long long *chunk_crc;
+	long long *chunk_packed;
+	
+	//filled in before get_thread runs
+	//chunks land at their offsets in out_fd, or with bufs set, at the start of bufs[chunk]
+	//only the part of the file from start to end is wanted, and file offset start is where out_fd starts
+	int num_chunks;
+	int *chunk;
+	int out_fd;
+	long long *offsets;
+	long long start, end;
+	char **bufs;
+	
+	//set by get_thread for each chunk that didn't arrive intact, including ones that didn't match their crc
+	//broken means the connection itself is unusable, not just that a chunk was missing
+	int *failed;
+	int broken;
+} get_job;
+
+int dfc_get(dfc *d, const char *name, int out_fd) {
+	return dfc_get_range(d, name, 0, LLONG_MAX, out_fd);
+}
+
+//only the chunks (or shards) the range touches are asked for, and only the part of each that's in it
+int dfc_get_range(dfc *d, const char *name, long long offset, long long length, int out_fd) {
+	char *filename = (char *) name;
+	int num_serv = d->num_serv;
+	get_job jobs[num_serv];
+	pthread_t runners[num_serv];
+	pconn *conns[num_serv];
+	int broken[num_serv];
+	int total = 0, parity = 0, data = 0, ret = -1;
+	
+	if(offset < 0 || length < 0) {
+		fprintf(stderr, "Bad range %lld %lld\n", offset, length);
+		return -1;
+	}
+	if(pool_lease(d, conns) == 0) return -1;
+	
+	//ask every server which chunks it has and how big they are, all at once
+	memset(jobs, 0, sizeof(jobs));
+	for(int i=0; i<num_serv; i++) {
+		jobs[i].sock = conns[i] ? conns[i]->sock : -1;
+		jobs[i].in = conns[i] ? &conns[i]->in : NULL;
+		jobs[i].next_id = conns[i] ? &conns[i]->next_id : NULL;
+		jobs[i].server = d->servers[i].name;
+		jobs[i].filename = filename;
+		jobs[i].start = offset;
+		jobs[i].end = length > LLONG_MAX - offset ? LLONG_MAX : offset + length;
+		runners[i] = 0;
+		if(conns[i] != NULL && pthread_create(&runners[i], NULL, stat_thread, &jobs[i]) != 0) {
+			runners[i] = 0;
+			stat_thread(&jobs[i]);
+		}
+	}
+	for(int i=0; i<num_serv; i++)
+		if(runners[i]) pthread_join(runners[i], NULL);
+	
+	//only the newest version of the file counts, servers still holding chunks of an older one are treated as having none
+	//(files stored without generations are all generation 0, and were only ever told apart by how many chunks they had)
+	long long gen = 0;
+	for(int i=0; i<num_serv; i++)
+		if(jobs[i].gen > gen) gen = jobs[i].gen;
+	for(int i=0; i<num_serv; i++) {
+		if(jobs[i].gen != gen) jobs[i].total = 0;
+		if(jobs[i].total > total) {
+			total = jobs[i].total;
+			parity = jobs[i].parity;
+			data = jobs[i].data;
+		}
+	}
+	
+	int construct = total > 0;
+	for(int i=0; i<num_serv && construct; i++) {
+		jobs[i].chunk = calloc(total, sizeof(int));
+		jobs[i].failed = calloc(total, sizeof(int));
+		if(jobs[i].chunk == NULL || jobs[i].failed == NULL) {
+			perror("malloc for get");
+			construct = 0;
+		}
+	}
+	
+	if(construct)
+		ret = parity > 0 ? get_erasure(d, jobs, total, parity, data, out_fd) : get_replicated(d, jobs, total, out_fd);
+	
+	for(int i=0; i<num_serv; i++) {
+		free(jobs[i].chunk_size);
+		free(jobs[i].chunk_crc);
+		free(jobs[i].chunk_packed);
+		free(jobs[i].chunk);
+		free(jobs[i].failed);
+		broken[i] = jobs[i].broken;
+	}
+	pool_release(d, conns, broken);
+	
+	return ret;
+}
+
+//fetch a replicated file once every server has said what it has of it
+//returns -1 if some chunk the range covers couldn't be had, or we can't tell where the range is in the file
+static int get_replicated(dfc *d, void *args, int total, int out_fd) {
+	get_job *jobs = (get_job *)args;
+	int num_serv = d->num_serv;
+	int load[num_serv], order[num_serv];
+	int construct = 1, known = total;
+	long long *chunk_size = malloc(total * sizeof(long long));
+	long long *offsets = malloc((total + 1) * sizeof(long long));
+	int *holder = malloc(total * sizeof(int));
+	
+	if(chunk_size == NULL || offsets == NULL || holder == NULL) {
+		perror("malloc for get");
+		construct = 0;
+		goto done;
+	}
+	
+	//each chunk comes from one server that has it, preferring the servers put would have placed it on
+	//and spreading the chunks over as many servers as possible
+	memset(load, 0, sizeof(load));
+	for(int c=0; c<total; c++) {
+		holder[c] = -1;
+		chunk_size[c] = -1;
+		place_chunk(d, jobs[0].filename, c, order);
+		for(int k=0; k<num_serv; k++) {
+			get_job *job = &jobs[order[k]];
+			if(job->total <= c || job->chunk_size[c] < 0) continue;
+			if(holder[c] == -1 || load[order[k]] < load[holder[c]])
+				holder[c] = order[k];
+		}
+		if(holder[c] == -1) continue;
+		chunk_size[c] = jobs[holder[c]].chunk_size[c];
+		load[holder[c]]++;
+	}
+	
+	//with every chunk's size known, so is where it goes in the output, and which ones the range needs
+	//a chunk nobody has only matters if the range covers it, but the range can only be found past it if we can tell
+	//how long it was: every chunk but the last is as long as the first or a byte shorter, the longer ones first
+	//(see dfc_put), so one between two of the same length is that long too
+	offsets[0] = 0;
+	for(int c=0; c<total && known == total; c++) {
+		if(chunk_size[c] < 0 && c < total - 1) {
+			long long before = -1, after = -1;
+			for(int p=c-1; p>=0 && before < 0; p--) before = chunk_size[p];
+			for(int n=c+1; n<total-1 && after < 0; n++) after = chunk_size[n];
+			if(before >= 0 && before == after) chunk_size[c] = before;
+		}
+		if(chunk_size[c] < 0) {
+			if(offsets[c] < jobs[0].end) construct = 0;
+			known = c;
+		}
+		else offsets[c+1] = offsets[c] + chunk_size[c];
+	}
+	if(!construct) goto done;
+	
+	for(int i=0; i<num_serv; i++) {
+		jobs[i].out_fd = out_fd;
+		jobs[i].offsets = offsets;
+	}
+	for(int c=0; c<known; c++) {
+		if(offsets[c] >= jobs[0].end || offsets[c+1] <= jobs[0].start) continue;
+		if(holder[c] < 0) {
+			construct = 0;
+			goto done;
+		}
+		if(chunk_wanted(&jobs[holder[c]], c, NULL, NULL))
+			jobs[holder[c]].chunk[jobs[holder[c]].num_chunks++] = c;
+	}
+	
+	//past a chunk we couldn't tell the length of, the range has already ended
+	long long end = known < total || jobs[0].end < offsets[total] ? jobs[0].end : offsets[total];
+	if(ftruncate(out_fd, end > jobs[0].start ? end - jobs[0].start : 0) < 0) {
+		perror("sizing reconstructed file");
+		construct = 0;
+		goto done;
+	}
+	
+	//fetch from every server at once, each chunk lands straight at its offset in the output
+	fetch_all(jobs, num_serv);
+	
+	//a chunk that failed (or came back damaged) gets one more try from any other server that has it
+	for(int i=0; i<num_serv; i++) {
+		for(int j=0; j<jobs[i].num_chunks; j++) {
+			if(!jobs[i].failed[j]) continue;
+			
+			int c = jobs[i].chunk[j], recovered = 0, failed = 0;
+			for(int k=0; k<num_serv && !recovered; k++) {
+				if(k == i || jobs[k].broken || jobs[k].total <= c || jobs[k].chunk_size[c] != chunk_size[c]) continue;
+				
+				get_job retry = jobs[k];
+				retry.num_chunks = 1;
+				retry.chunk = &c;
+				retry.failed = &failed;
+				failed = 0;
+				get_thread(&retry);
+				recovered = !failed;
+				jobs[k].broken = retry.broken;
+			}
+			if(!recovered) construct = 0;
+		}
+	}
+	
+done:
+	free(chunk_size);
+	free(offsets);
+	free(holder);
+	return construct ? 0 : -1;
+}
+
+//fetch an erasure coded file, rebuilding whatever data shards we can't get from the others
+//stripes with every data shard there land straight at their offsets in the output, like the chunks of a replicated file,
+//the others are then fetched and decoded one at a time (see get_stripe), so at most a stripe is ever in memory
+//returns -1 if some stripe the range needs has fewer than k shards that could be had
+static int get_erasure(dfc *d, void *args, int total, int parity, int data, int out_fd) {
+	get_job *jobs = (get_job *)args;
+	int num_serv = d->num_serv, width = data + parity, stripes = total / width;
+	long long start = jobs[0].start, end = jobs[0].end, stripe = 0, last = -1, len;
+	
+	if(total % width != 0) return -1;
+	
+	//every stripe but the last is as long as any other, and split evenly, so any shard of one (less the length
+	//a parity shard ends in) tells us how long they are
+	for(int c=0; c<(stripes - 1) * width && stripe == 0; c++) {
+		int h = shard_holder(jobs, num_serv, c);
+		if(h >= 0) stripe = data * (jobs[h].chunk_size[c] - (c % width < data ? 0 : 8));
+	}
+	if(stripes > 1 && stripe <= 0) return -1;
+	
+	long long *offsets = malloc(total * sizeof(long long));
+	char **bufs = calloc(total, sizeof(char *));
+	char *decode = calloc(stripes, 1);
+	int ret = -1;
+	if(offsets == NULL || bufs == NULL || decode == NULL) {
+		perror("malloc for get");
+		goto done;
+	}
+	for(int i=0; i<num_serv; i++) {
+		jobs[i].out_fd = out_fd;
+		jobs[i].offsets = offsets;
+	}
+	
+	//the last stripe is as long as its data shards add up to, if they're all there
+	//a data shard that isn't the length its stripe's says it should be belongs to some other version of the file
+	for(int t=0; t<stripes; t++) {
+		int base = t * width;
+		long long n = stripe;
+		if(t == stripes - 1) {
+			n = 0;
+			for(int s=0; s<data; s++) {
+				int h = shard_holder(jobs, num_serv, base + s);
+				n += h >= 0 ? jobs[h].chunk_size[base + s] : 0;
+			}
+		}
+		for(int s=0; s<data && !decode[t]; s++) {
+			int h = shard_holder(jobs, num_serv, base + s);
+			offsets[base + s] = t * stripe + shard_offset(n, data, s, &len);
+			if(h < 0 || jobs[h].chunk_size[base + s] != len) decode[t] = 1;
+		}
+		if(decode[t]) continue;
+		if(t == stripes - 1) last = n;
+		
+		for(int s=0; s<data; s++) {
+			int h = shard_holder(jobs, num_serv, base + s);
+			if(chunk_wanted(&jobs[h], base + s, NULL, NULL))
+				jobs[h].chunk[jobs[h].num_chunks++] = base + s;
+		}
+	}
+	fetch_all(jobs, num_serv);
+	
+	//a stripe any of whose data shards didn't arrive is decoded like the ones missing some
+	for(int i=0; i<num_serv; i++)
+		for(int j=0; j<jobs[i].num_chunks; j++)
+			if(jobs[i].failed[j]) decode[jobs[i].chunk[j] / width] = 1;
+	forget_failed(jobs, num_serv);
+	
+	//stripes outside the range aren't needed, the last one can be shorter than the others
+	for(int t=0; t<stripes; t++) {
+		if(!decode[t] || t * stripe >= end || (stripes > 1 && (t + 1) * stripe <= start)) continue;
+		long long n = get_stripe(jobs, num_serv, t, data, parity, bufs, t * stripe, t < stripes - 1 ? stripe : -1);
+		if(n < 0) goto done;
+		if(t == stripes - 1) last = n;
+	}
+	
+	//we only don't know how long the last stripe is if the range doesn't reach it, it's no longer than the others
+	long long file_size = last >= 0 ? (stripes - 1) * stripe + last : stripes * stripe;
+	if(file_size < end) end = file_size;
+	if(ftruncate(out_fd, end > start ? end - start : 0) < 0) {
+		perror("sizing reconstructed file");
+		goto done;
+	}
+	ret = 0;
+	
+done:
+	free(offsets);
+	free(bufs);
+	free(decode);
+	return ret;
+}
+
+//fetch k shards of stripe t of an erasure coded file, rebuild its missing data shards from them and write the part of it
+//that's in the range, the stripe starts at off in the file and has to be want bytes long, or with want -1 any length
+//bufs has a slot for every chunk of the file, the shards of the stripe go in theirs while they're fetched
+//returns how long the stripe is, or -1 if fewer than k of its shards could be had
+static long long get_stripe(void *args, int num_serv, int t, int data, int parity, char **bufs, long long off, long long want) {
+	get_job *jobs = (get_job *)args;
+	int width = data + parity, base = t * width;
+	long long size[width], start = jobs[0].start, end = jobs[0].end, len = -1, ret = -1;
+	char *shards[width], good[width];
+	int have[data];
+	
+	//every shard gets as much memory as a parity shard, which ends in the stripe's length after shard_len bytes of parity,
+	//and shorter data shards are padded with zeros, which is how they were encoded
+	for(int s=data; s<width && len < 0; s++) {
+		int h = shard_holder(jobs, num_serv, base + s);
+		if(h >= 0) len = jobs[h].chunk_size[base + s];
+	}
+	if(len < 8) return -1;
+	long long shard_len = len - 8;
+	
+	//take data shards first, they don't need decoding, and go again without any that fail until we have k or run out,
+	//only fetching the ones that didn't arrive the time before
+	memset(shards, 0, sizeof(shards));
+	memset(good, 0, sizeof(good));
+	while(1) {
+		int n = 0, fetching = 0;
+		for(int s=0; s<width && n<data; s++) {
+			if(good[s]) {
+				have[n++] = s;
+				continue;
+			}
+			int h = shard_holder(jobs, num_serv, base + s);
+			if(h < 0) continue;
+			if(jobs[h].chunk_size[base + s] > (s < data ? shard_len : len)) {
+				jobs[h].chunk_size[base + s] = -1;
+				s--;
+				continue;
+			}
+			
+			if(shards[s] == NULL && (shards[s] = calloc(1, len)) == NULL) {
+				perror("malloc for shard");
+				goto done;
+			}
+			bufs[base + s] = shards[s];
+			size[s] = jobs[h].chunk_size[base + s];
+			have[n++] = s;
+			jobs[h].chunk[jobs[h].num_chunks++] = base + s;
+			fetching++;
+		}
+		if(n < data) goto done;
+		if(fetching == 0) break;
+		
+		for(int i=0; i<num_serv; i++)
+			jobs[i].bufs = bufs;
+		fetch_all(jobs, num_serv);
+		for(int i=0; i<num_serv; i++)
+			for(int j=0; j<jobs[i].num_chunks; j++)
+				if(!jobs[i].failed[j]) good[jobs[i].chunk[j] - base] = 1;
+		if(forget_failed(jobs, num_serv) == 0) break;
+	}
+	
+	//without a parity shard among them, we have every data shard and they add up to the stripe
+	long long stripe_len = 0;
+	for(int r=0; r<data; r++)
+		stripe_len += size[have[r]];
+	for(int r=0; r<data; r++)
+		if(have[r] >= data) stripe_len = get_u64(shards[have[r]] + shard_len);
+	
+	//a data shard that isn't the length the stripe's says it should be belongs to some other version of the file
+	if(stripe_len < 0 || (want >= 0 && stripe_len != want) || (stripe_len + data - 1) / data != shard_len) goto done;
+	for(int r=0; r<data; r++) {
+		shard_offset(stripe_len, data, have[r], &len);
+		if(have[r] < data && size[have[r]] != len) goto done;
+	}
+	
+	for(int s=0; s<data; s++) {
+		if(shards[s] == NULL && (shards[s] = calloc(1, shard_len + 8)) == NULL) {
+			perror("malloc for shard");
+			goto done;
+		}
+	}
+	long long decode_start = trace_now();
+	if(rs_decode(data, parity, (uint8_t **) shards, have, shard_len) < 0) goto done;
+	trace_span("decode", jobs[0].filename, decode_start);
+	
+	//only the part of each data shard that's in the range is written
+	for(int s=0; s<data; s++) {
+		long long at = off + shard_offset(stripe_len, data, s, &len);
+		long long from = start > at ? start - at : 0, to = end < at + len ? end - at : len;
+		if(from < to && write_all(jobs[0].out_fd, shards[s] + from, to - from, at + from - start) < 0) goto done;
+	}
+	ret = stripe_len;
+	
+done:
+	for(int s=0; s<width; s++) {
+		free(shards[s]);
+		bufs[base + s] = NULL;
+	}
+	for(int i=0; i<num_serv; i++)
+		jobs[i].bufs = NULL;
+	return ret;
+}
+
+//where data shard s of a stripe of an erasure coded file starts in the stripe, which is n bytes long, and in len
+//how long it is: the stripe is split evenly between its data shards, the first ones getting an extra byte
+//if it doesn't divide evenly
+static long long shard_offset(long long n, int data, int s, long long *len) {
+	long long q = n / data, r = n % data;
+	*len = q + (s < r);
+	return s * q + (s < r ? s : r);
+}
+
+//whether the job's range needs any of chunk, and if so from (if not NULL) gets where that part starts in the chunk
+//and len how long it is
+//with bufs set the whole chunk is wanted, the caller decodes from it
+static int chunk_wanted(void *args, int chunk, long long *from, long long *len) {
+	get_job *job = (get_job *)args;
+	long long first = 0, last = job->chunk_size[chunk];
+	
+	if(!job->bufs) {
+		long long off = job->offsets[chunk];
+		if(job->start > off) first = job->start - off;
+		if(job->end - off < last) last = job->end - off;
+		if(first >= last) return 0;
+	}
+	if(from) *from = first;
+	if(len) *len = last - first;
+	return 1;
+}
+
+//a server we can still ask for shard s, or -1 if nobody has it
+static int shard_holder(void *args, int num_serv, int s) {
+	get_job *jobs = (get_job *)args;
+	for(int i=0; i<num_serv; i++)
+		if(!jobs[i].broken && jobs[i].total > s && jobs[i].chunk_size[s] >= 0) return i;
+	return -1;
+}
+
+//forget that servers have the chunks they failed to send, and clear every job for the next round
+//returns how many chunks failed
+static int forget_failed(void *args, int num_serv) {
+	get_job *jobs = (get_job *)args;
+	int failures = 0;
+	
+	for(int i=0; i<num_serv; i++) {
+		for(int j=0; j<jobs[i].num_chunks; j++) {
+			if(!jobs[i].failed[j]) continue;
+			jobs[i].chunk_size[jobs[i].chunk[j]] = -1;
+			jobs[i].failed[j] = 0;
+			failures++;
+		}
+		jobs[i].num_chunks = 0;
+	}
+	return failures;
+}
+
+//run get_thread for every job with chunks to fetch, all at once
+static void fetch_all(void *args, int num_serv) {
+	get_job *jobs = (get_job *)args;
+	pthread_t runners[num_serv];
+	
+	for(int i=0; i<num_serv; i++) {
+		runners[i] = 0;
+		if(jobs[i].num_chunks > 0 && pthread_create(&runners[i], NULL, get_thread, &jobs[i]) != 0) {
+			runners[i] = 0;
+			get_thread(&jobs[i]);
+		}
+	}
+	for(int i=0; i<num_serv; i++)
+		if(runners[i]) pthread_join(runners[i], NULL);
+}
+
+//ask one server for the sizes and crcs of the chunks it has of the file
+static void *stat_thread(void *args) {
+	get_job *job = (get_job *)args;
+	char request[BUFSIZE + 2], fields[28];
+	uint32_t id = (*job->next_id)++;
+	long long start = trace_now();
+	msg_hdr hdr;
+	
+	if(strlen(job->filename) >= BUFSIZE) return NULL;
+	struct iovec payload = { request, pack_string(request, job->filename) };
+	
+	if(send_msg(job->sock, OP_STAT, id, &payload, 1) < 0 ||
+	   recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id != id || hdr.status != STATUS_OK || hdr.length < 16 ||
+	   rbuf_read_exact(job->in, job->sock, fields, 16) != 0)
+		goto broken;
+	
+	int count = get_u32(fields), total = count_chunks(get_u32(fields + 4)), parity = count_parity(get_u32(fields + 4));
+	int data = count_data(get_u32(fields + 4));
+	long long gen = get_u64(fields + 8);
+	if(hdr.length != 16 + 28 * (uint64_t) count) goto broken;
+	
+	//files from before chunk counts were recorded, and erasure coded files from before they were cut into stripes
+	if(total <= 0 && count > 0) total = LEGACY_CHUNKS;
+	if(parity >= total) parity = 0;
+	if(data == 0 || total % (data + parity) != 0) data = total - parity;
+	
+	job->chunk_size = malloc((total > 0 ? total : 1) * sizeof(long long));
+	job->chunk_crc = malloc((total > 0 ? total : 1) * sizeof(long long));
+	job->chunk_packed = malloc((total > 0 ? total : 1) * sizeof(long long));
+	if(job->chunk_size == NULL || job->chunk_crc == NULL || job->chunk_packed == NULL) {
+		free(job->chunk_size);
+		free(job->chunk_crc);
+		free(job->chunk_packed);
+		job->chunk_size = NULL;
+		job->chunk_crc = NULL;
+		job->chunk_packed = NULL;
+		return NULL;
+	}
+	for(int i=0; i<total; i++) job->chunk_size[i] = -1;
+	
+	for(int i=0; i<count; i++) {
+		if(rbuf_read_exact(job->in, job->sock, fields, 28) != 0) {
+			free(job->chunk_size);
+			free(job->chunk_crc);
+			free(job->chunk_packed);
+			job->chunk_size = NULL;
+			job->chunk_crc = NULL;
+			job->chunk_packed = NULL;
+			goto broken;
+		}
+		uint32_t chunk = get_u32(fields);
+		long long size = get_u64(fields + 4), raw = get_u64(fields + 20);
+		if(chunk < (uint32_t) total) {
+			job->chunk_size[chunk] = raw ? raw : size;
+			job->chunk_crc[chunk] = get_u32(fields + 16) ? (long long) get_u32(fields + 12) : -1;
+			job->chunk_packed[chunk] = raw ? size : -1;
+		}
+	}
+	job->gen = gen;
+	job->total = total;
+	job->parity = parity;
+	job->data = data;
+	trace_span("stat", job->server, start);
+	return NULL;
+	
+broken:
+	job->broken = 1;
+	return NULL;
+}
+
+//request the job's chunks, keeping up to PIPELINE_DEPTH of them in flight,
+//and write each one to its place in the output (or its buffer) as it arrives
+//replies are matched to chunks by request id, so they don't have to come back in order
+//each chunk's crc32c is worked out as it streams in, one that doesn't match what the server stored fails
+//like a chunk the server lost, and the caller gets it from somewhere else
+//compressed chunks are received whole and decompressed into place right here, while the requests after them
+//are still in flight and the other servers' threads keep receiving
+//a chunk the range only covers part of is asked for as just that part, which can't be checked against a crc
+//of the whole chunk, unless it's compressed, then it comes whole and only the part is written out
+static void *get_thread(void *args) {
+	get_job *job = (get_job *)args;
+	char request[BUFSIZE + 22];
+	uint32_t first = *job->next_id;
+	int sent = 0, received = 0, len;
+	char *packed = NULL, *unpacked = NULL;
+	long long packed_cap = 0, unpacked_cap = 0;
+	unsigned long long trace_first = trace_ids(job->num_chunks);
+	msg_hdr hdr;
+	
+	if(strlen(job->filename) >= BUFSIZE) goto broken;
+	len = pack_string(request, job->filename);
+	
+	while(received < job->num_chunks) {
+		while(sent < job->num_chunks && sent - received < PIPELINE_DEPTH) {
+			long long from = 0, part = 0;
+			int n = 4;
+			put_u32(request + len, job->chunk[sent]);
+			chunk_wanted(job, job->chunk[sent], &from, &part);
+			if(part < job->chunk_size[job->chunk[sent]] && job->chunk_packed[job->chunk[sent]] < 0) {
+				put_u64(request + len + 4, from);
+				put_u64(request + len + 12, part);
+				n = 20;
+			}
+			struct iovec payload = { request, len + n };
+			trace_async('b', "get chunk", job->server, job->chunk[sent], trace_first + sent);
+			if(send_msg(job->sock, OP_GET, first + sent, &payload, 1) < 0)
+				goto broken;
+			sent++;
+		}
+		
+		if(recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id - first >= (uint32_t) sent)
+			goto broken;
+		received++;
+		
+		int i = hdr.id - first, chunk = job->chunk[i];
+		long long chunk_size = job->chunk_size[chunk], from = 0, part = 0;
+		chunk_wanted(job, chunk, &from, &part);
+		trace_async('n', "first byte", job->server, chunk, trace_first + i);
+		
+		//the server lost the chunk since it told us about it
+		if(hdr.status != STATUS_OK) {
+			if(hdr.length != 0) goto broken;
+			trace_async('e', "get chunk", job->server, chunk, trace_first + i);
+			job->failed[i] = 1;
+			continue;
+		}
+		
+		uint32_t crc = 0;
+		long long stored = job->chunk_packed[chunk];
+		if(stored >= 0) {
+			if(hdr.length != (uint64_t) stored) goto broken;
+			if(stored > packed_cap) {
+				char *grown = realloc(packed, stored);
+				if(grown == NULL) {
+					perror("malloc for compressed chunk");
+					goto broken;
+				}
+				packed = grown;
+				packed_cap = stored;
+			}
+			if(rbuf_read_exact(job->in, job->sock, packed, stored) != 0) {
+				perror("receiving chunk");
+				goto broken;
+			}
+			trace_async('e', "get chunk", job->server, chunk, trace_first + i);
+			
+			//the crc is of the chunk as it's stored, so it's checked before decompressing
+			crc = crc32c(0, packed, stored);
+			if(job->chunk_crc[chunk] >= 0 && crc != job->chunk_crc[chunk]) {
+				fprintf(stderr, "Chunk %d of %s failed its checksum\n", chunk, job->filename);
+				job->failed[i] = 1;
+				continue;
+			}
+			if(!job->bufs && chunk_size > unpacked_cap) {
+				char *grown = realloc(unpacked, chunk_size);
+				if(grown == NULL) {
+					perror("malloc for decompressed chunk");
+					goto broken;
+				}
+				unpacked = grown;
+				unpacked_cap = chunk_size;
+			}
+			char *to = job->bufs ? job->bufs[chunk] : unpacked;
+			if(lz_decompress(packed, stored, to, chunk_size) < 0) {
+				fprintf(stderr, "Chunk %d of %s failed to decompress\n", chunk, job->filename);
+				job->failed[i] = 1;
+			}
+			else if(!job->bufs && write_all(job->out_fd, unpacked + from, part, job->offsets[chunk] + from - job->start) < 0)
+				job->failed[i] = 1;
+			continue;
+		}
+		
+		if(hdr.length != (uint64_t) part ||
+		   (job->bufs ? rbuf_read_exact(job->in, job->sock, job->bufs[chunk], chunk_size)
+		              : recv_to_file(job, job->offsets[chunk] + from - job->start, part, &crc)) != 0) {
+			perror("receiving chunk");
+			goto broken;
+		}
+		trace_async('e', "get chunk", job->server, chunk, trace_first + i);
+		if(job->bufs) crc = crc32c(0, job->bufs[chunk], chunk_size);
+		if(part == chunk_size && job->chunk_crc[chunk] >= 0 && crc != job->chunk_crc[chunk]) {
+			fprintf(stderr, "Chunk %d of %s failed its checksum\n", chunk, job->filename);
+			job->failed[i] = 1;
+		}
+	}
+	*job->next_id = first + sent;
+	free(packed);
+	free(unpacked);
+	return NULL;
+	
+	//the stream can't be trusted after this, so give up on the rest of this server's chunks too
+broken:
+	*job->next_id = first + sent;
+	for(int i=0; i<job->num_chunks; i++) job->failed[i] = 1;
+	job->broken = 1;
+	free(packed);
+	free(unpacked);
+	return NULL;
+}
+
+//receive n bytes of a chunk into the job's output at off, like rbuf_read_to_fd
+//when tracing, each write is recorded on its own, so the trace shows the disk apart from the network
+static int recv_to_file(void *args, long long off, long long n, uint32_t *crc) {
+	get_job *job = (get_job *)args;
+	
+	if(!trace.on) return rbuf_read_to_fd(job->in, job->sock, job->out_fd, off, n, crc);
+	while(n > 0) {
+		if(rbuf_len(job->in) == 0) {
+			ssize_t r = rbuf_fill(job->in, job->sock);
+			if(r == 0) return 1;
+			if(r < 0) {
+				if(errno == EINTR) continue;
+				return -1;
+			}
+		}
+		
+		//with only what's buffered asked for, rbuf_read_to_fd does nothing but write it
+		long long avail = (long long) rbuf_len(job->in) < n ? (long long) rbuf_len(job->in) : n;
+		long long start = trace_now();
+		int r = rbuf_read_to_fd(job->in, job->sock, job->out_fd, off, avail, crc);
+		trace_span("disk write", job->server, start);
+		if(r != 0) return r;
+		off += avail;
+		n -= avail;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//the chunks one server should receive for a put, handed to that server's upload thread
+//held is set for each chunk whose contents the server says it has, those are sent as references (only with dedup)
+//crc is the crc32c of each chunk's contents, which the server checks them against as they arrive
+//raw is each chunk's length once decompressed if its contents are compressed, 0 if they aren't
+//gen is the put's generation (see put_generation)
+typedef struct {
+	int sock;
+	rbuf *in;
+	uint32_t *next_id;
+	char *server;
+	char *filename;
+	int total;
+	long long gen;
+	int num_chunks;
+	int *chunk;
+	long long *chunk_size;
+	char **contents;
+	int dedup;
+	char *held;
+	unsigned char (*hash)[CHASH_LEN];
+	uint32_t *crc;
+	long long *raw;
+	int failed;
+	int broken;
+} put_job;
+
+//the files one server should drop older versions of once a put of them is done
+//total is the packed chunk count every one of them now has, and gen the generation of the put
+typedef struct {
+	int sock;
+	rbuf *in;
+	uint32_t *next_id;
+	char **names;
+	int num_files;
+	int total;
+	long long gen;
+	int broken;
+} drop_job;
+
+//one chunk of a put as it goes out: contents is either where it is in the file (or parity) or its compressed copy in packed
+//raw is 0 unless it's compressed, then it's the length it came from, and hash and crc are of what's actually sent
+typedef struct {
+	char *contents;
+	long long size;
+	long long raw;
+	char *packed;
+	uint32_t crc;
+	unsigned char hash[CHASH_LEN];
+} put_prep;
+
+//a share of the chunks for prepare_thread, every step'th one starting at first
+typedef struct {
+	put_prep *chunks;
+	int first, step, total;
+	int compress, dedup;
+} prep_job;
+
+int dfc_put(dfc *d, const char *name, int fd) {
+	char *filename = (char *) name;
+	int num_serv = d->num_serv, total = d->chunks;
+	pconn *conns[num_serv];
+	int broken[num_serv];
+	struct stat st;
+	
+	if(fstat(fd, &st) < 0) {
+		perror("reading file size");
+		return -1;
+	}
+	
+	long long file_size = st.st_size, block = 0, stripe = 0, shard_len = 0, gen = put_generation();
+	long long chunk_size;
+	int offset_chunks, data, parity = 0, width = 1, needed = d->replicas;
+	
+	//striping a small file only multiplies the requests and files it costs
+	//a replicated file too big for its chunks to stay under the block size is cut into blocks of that size instead,
+	//as many as it takes (blocks grow if it would take more than a file can have)
+	//an erasure coded file is cut into stripes, each its data shards followed by parity shards as long as the longest of them
+	if(file_size < d->small) total = 1;
+	else if(d->parity == 0 && d->block > 0 && file_size > total * d->block) {
+		block = d->block;
+		if((file_size + block - 1) / block > COUNT_MAX) block = (file_size + COUNT_MAX - 1) / COUNT_MAX;
+		total = (file_size + block - 1) / block;
+	}
+	data = total;
+	chunk_size = file_size/data + 1;
+	offset_chunks = file_size % data;
+	if(total > 1 && d->parity > 0) {
+		parity = d->parity;
+		width = data + parity;
+		
+		//a stripe's shards are at most a block long and fit in a window together, so every stripe is encoded on its own
+		//and only a window's worth of parity is ever in memory (they grow if it would take more stripes than a file can have)
+		//a file that fits in one stripe is split evenly between its data shards
+		int most = COUNT_MAX / width;
+		shard_len = d->block > 0 && d->block < PUT_WINDOW / width ? d->block : PUT_WINDOW / width;
+		if((file_size + data * shard_len - 1) / (data * shard_len) > most)
+			shard_len = (file_size + (long long) data * most - 1) / ((long long) data * most);
+		if(file_size <= data * shard_len) shard_len = (file_size + data - 1) / data;
+		stripe = data * shard_len;
+		total = width * (file_size > stripe ? (file_size + stripe - 1) / stripe : 1);
+		
+		//shards wrap around when there are fewer servers than shards, but losing any one server mustn't lose more than parity of a stripe's
+		needed = (width + parity - 1) / parity;
+	}
+	
+	//make sure we're connected to enough servers to hold every replica
+	if(pool_lease(d, conns) < needed) {
+		memset(broken, 0, sizeof(broken));
+		pool_release(d, conns, broken);
+		return -1;
+	}
+	
+	//chunks are sent straight out of a mapping of the file, so nothing is copied and the file never has to fit in memory
+	char *contents = NULL;
+	if(file_size > 0) {
+		contents = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(contents == MAP_FAILED) {
+			perror("mapping file");
+			memset(broken, 0, sizeof(broken));
+			pool_release(d, conns, broken);
+			return -1;
+		}
+		madvise(contents, file_size, MADV_SEQUENTIAL);
+	}
+	
+	//chunks go out a window at a time, so the compressed copies and everything kept per chunk only ever cover
+	//PUT_WINDOW bytes of the file, however big it is
+	//every server could end up with every chunk of a window in a small cluster, so size each job for all of them
+	//for an erasure coded file that's whole stripes, whose parity shards are kept until the window has gone out
+	int window = block > 0 && PUT_WINDOW / block < total ? PUT_WINDOW / block : total;
+	if(stripe > 0 && PUT_WINDOW / stripe < total / width) window = width * (PUT_WINDOW / stripe > 0 ? PUT_WINDOW / stripe : 1);
+	if(window < 1) window = 1;
+	put_job jobs[num_serv];
+	pthread_t runners[num_serv];
+	int order[num_serv], stored[num_serv];
+	memset(jobs, 0, sizeof(jobs));
+	memset(broken, 0, sizeof(broken));
+	memset(stored, 0, sizeof(stored));
+	
+	//small files are stored whole and only cost one request anyway, so they aren't worth asking about
+	int dedup = d->dedup && total > 1;
+	int *chunk_ids = malloc(num_serv * window * sizeof(int));
+	long long *chunk_sizes = malloc(num_serv * window * sizeof(long long));
+	char **chunk_ptrs = malloc(num_serv * window * sizeof(char *));
+	char *held = malloc(num_serv * window);
+	unsigned char (*hashes)[CHASH_LEN] = malloc(num_serv * window * CHASH_LEN);
+	uint32_t *crcs = malloc(num_serv * window * sizeof(uint32_t));
+	long long *raws = malloc(num_serv * window * sizeof(long long));
+	put_prep *prep = malloc(window * sizeof(put_prep));
+	char *parity_buf = parity > 0 ? malloc(window / width * parity * (shard_len + 8)) : NULL;
+	if(chunk_ids == NULL || chunk_sizes == NULL || chunk_ptrs == NULL || held == NULL || hashes == NULL || crcs == NULL || raws == NULL ||
+	   prep == NULL || (parity > 0 && parity_buf == NULL)) {
+		perror("malloc for put");
+		free(chunk_ids);
+		free(chunk_sizes);
+		free(chunk_ptrs);
+		free(held);
+		free(hashes);
+		free(crcs);
+		free(raws);
+		free(prep);
+		free(parity_buf);
+		if(contents != NULL) munmap(contents, file_size);
+		pool_release(d, conns, broken);
+		return -1;
+	}
+	for(int i = 0; i < num_serv; i++) {
+		jobs[i].chunk = chunk_ids + i*window;
+		jobs[i].chunk_size = chunk_sizes + i*window;
+		jobs[i].contents = chunk_ptrs + i*window;
+		jobs[i].held = held + i*window;
+		jobs[i].hash = hashes + i*window;
+		jobs[i].crc = crcs + i*window;
+		jobs[i].raw = raws + i*window;
+		jobs[i].dedup = dedup;
+		jobs[i].sock = conns[i] ? conns[i]->sock : -1;
+		jobs[i].in = conns[i] ? &conns[i]->in : NULL;
+		jobs[i].next_id = conns[i] ? &conns[i]->next_id : NULL;
+		jobs[i].server = d->servers[i].name;
+		jobs[i].filename = filename;
+		jobs[i].total = count_pack(total, parity, parity > 0 ? data : 0);
+		jobs[i].gen = gen;
+	}
+	
+	//each chunk goes to the first R connected servers in its rendezvous order
+	//the shards of an erasure coded file have one copy each, spread over the connected servers in the rendezvous order of chunk 0
+	//placement stays by name even with dedup, so a new version of a file replaces the old one's chunks on the same servers
+	int shard_servers[num_serv], num_shard_servers = 0, copies = parity > 0 ? 1 : d->replicas;
+	if(parity > 0) {
+		place_chunk(d, filename, 0, order);
+		for(int k = 0; k < num_serv; k++)
+			if(conns[order[k]] != NULL) shard_servers[num_shard_servers++] = order[k];
+	}
+	
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	long long offset = 0;
+	int failed = 0;
+	for(int first = 0; first < total && !failed; first += window) {
+		int count = total - first < window ? total - first : window;
+		
+		//parity shards end in how long their stripe is, a get that has to rebuild data shards needs it to know how long they were
+		if(parity > 0) {
+			long long encode_start = trace_now();
+			for(int t = first / width; t < (first + count) / width; t++)
+				encode_stripe(contents, file_size, stripe, t, data, parity, parity_buf + (t - first / width) * parity * (shard_len + 8),
+				              shard_len + 8);
+			trace_span("encode", filename, encode_start);
+		}
+		
+		//blocks are all block bytes but the last, otherwise the first chunks get an extra byte if the file doesn't divide evenly,
+		//and so do the first data shards of a stripe
+		memset(prep, 0, count * sizeof(put_prep));
+		for(int j = 0; j < count; j++) {
+			int i = first + j;
+			if(parity > 0) {
+				int t = i / width, s = i % width;
+				long long n = file_size - t * stripe < stripe ? file_size - t * stripe : stripe;
+				if(s < data)
+					prep[j].contents = contents + t * stripe + shard_offset(n, data, s, &prep[j].size);
+				else {
+					prep[j].size = (n + data - 1) / data + 8;
+					prep[j].contents = parity_buf + ((t - first / width) * parity + s - data) * (shard_len + 8);
+				}
+				continue;
+			}
+			
+			if(block > 0)
+				prep[j].size = file_size - offset < block ? file_size - offset : block;
+			else
+				prep[j].size = i < offset_chunks ? chunk_size : chunk_size - 1;
+			prep[j].contents = contents + offset;
+			offset += prep[j].size;
+		}
+		
+		//compressing, hashing and summing the chunks is the CPU side of a put, so it's spread over a thread per core
+		long long prep_start = trace_now();
+		int num_preps = cores > 1 ? (cores < count ? cores : count) : 1;
+		prep_job preps[num_preps];
+		pthread_t prep_runners[num_preps];
+		for(int t = 0; t < num_preps; t++) {
+			preps[t] = (prep_job) { .chunks = prep, .first = t, .step = num_preps, .total = count, .compress = d->compress, .dedup = dedup };
+			prep_runners[t] = 0;
+			if(t > 0 && pthread_create(&prep_runners[t], NULL, prepare_thread, &preps[t]) != 0) {
+				prep_runners[t] = 0;
+				prepare_thread(&preps[t]);
+			}
+		}
+		prepare_thread(&preps[0]);
+		for(int t = 1; t < num_preps; t++)
+			if(prep_runners[t]) pthread_join(prep_runners[t], NULL);
+		trace_span("prepare", filename, prep_start);
+		
+		for(int i = 0; i < num_serv; i++)
+			jobs[i].num_chunks = 0;
+		memset(held, 0, num_serv * window);
+		for(int j = 0; j < count; j++) {
+			int i = first + j;
+			if(parity == 0) place_chunk(d, filename, i, order);
+			for(int k = 0, r = 0; k < num_serv && r < copies; k++) {
+				int s = parity > 0 ? shard_servers[i % num_shard_servers] : order[k];
+				if(conns[s] == NULL) continue;
+				
+				put_job *job = &jobs[s];
+				job->chunk[job->num_chunks] = i;
+				job->chunk_size[job->num_chunks] = prep[j].size;
+				job->contents[job->num_chunks] = prep[j].contents;
+				if(dedup) memcpy(job->hash[job->num_chunks], prep[j].hash, CHASH_LEN);
+				job->crc[job->num_chunks] = prep[j].crc;
+				job->raw[job->num_chunks] = prep[j].raw;
+				job->num_chunks++;
+				r++;
+			}
+		}
+		
+		//upload to every server at once, so the put takes as long as the slowest server instead of the sum of all of them
+		for(int i = 0; i < num_serv; i++) {
+			runners[i] = 0;
+			if(jobs[i].num_chunks > 0 && pthread_create(&runners[i], NULL, put_thread, &jobs[i]) != 0) {
+				perror("creating upload thread");
+				runners[i] = 0;
+				put_thread(&jobs[i]);
+			}
+		}
+		for(int i = 0; i < num_serv; i++) {
+			if(runners[i]) pthread_join(runners[i], NULL);
+			if(jobs[i].failed) failed = 1;
+			if(jobs[i].num_chunks > 0) stored[i] = 1;
+			broken[i] = jobs[i].broken;
+		}
+		for(int j = 0; j < count; j++)
+			free(prep[j].packed);
+	}
+	
+	//now the servers can drop what they still have of older versions of the file, which they kept until now in case
+	//the new one had the same contents, that's every server unless the new version is a single chunk,
+	//then the ones that got it already dropped the rest of the old one when it arrived
+	if(!failed) {
+		drop_job drops[num_serv];
+		memset(drops, 0, sizeof(drops));
+		for(int i = 0; i < num_serv; i++) {
+			if(conns[i] == NULL || broken[i] || (stored[i] && total == 1)) continue;
+			drops[i] = (drop_job) { .sock = conns[i]->sock, .in = &conns[i]->in, .next_id = &conns[i]->next_id, .names = &filename,
+			                        .num_files = 1, .total = count_pack(total, parity, parity > 0 ? data : 0), .gen = gen };
+		}
+		drop_older(d, drops, broken);
+	}
+	pool_release(d, conns, broken);
+	
+	free(chunk_ids);
+	free(chunk_sizes);
+	free(chunk_ptrs);
+	free(held);
+	free(hashes);
+	free(crcs);
+	free(raws);
+	free(prep);
+	free(parity_buf);
+	if(contents != NULL)
+		munmap(contents, file_size);
+	
+	return failed ? -1 : 0;
+}
+
+//compute the parity shards of stripe t of an erasure coded file into out, each one len bytes after the one before
+//they're as long as the stripe's longest data shard, followed by how long the stripe is
+static void encode_stripe(char *contents, long long file_size, long long stripe, int t, int data, int parity, char *out, long long len) {
+	uint8_t *data_ptrs[data], *parity_ptrs[parity];
+	size_t data_lens[data];
+	long long n = file_size - t * stripe < stripe ? file_size - t * stripe : stripe, shard;
+	
+	for(int s = 0; s < data; s++) {
+		data_ptrs[s] = (uint8_t *) contents + t * stripe + shard_offset(n, data, s, &shard);
+		data_lens[s] = shard;
+	}
+	for(int p = 0; p < parity; p++) {
+		parity_ptrs[p] = (uint8_t *) out + p * len;
+		put_u64(out + p * len + (n + data - 1) / data, n);
+	}
+	rs_encode(data, parity, data_ptrs, data_lens, parity_ptrs, (n + data - 1) / data);
+}
+
+//compress, hash and sum one share of a put's chunks
+//a chunk is only sent compressed if that saves enough, lz_pack gives up early on chunks that don't compress
+static void *prepare_thread(void *args) {
+	prep_job *job = (prep_job *)args;
+	
+	for(int i = job->first; i < job->total; i += job->step) {
+		put_prep *p = &job->chunks[i];
+		
+		if(job->compress && p->size >= LZ_MIN_INPUT && (p->packed = malloc(p->size)) != NULL) {
+			size_t n = lz_pack(p->contents, p->size, p->packed);
+			if(n > 0) {
+				p->raw = p->size;
+				p->contents = p->packed;
+				p->size = n;
+			}
+			else {
+				free(p->packed);
+				p->packed = NULL;
+			}
+		}
+		if(job->dedup) chash_buf(p->contents, p->size, p->hash);
+		p->crc = crc32c(0, p->contents, p->size);
+	}
+	return NULL;
+}
+
+//send one server its chunks, keeping up to PIPELINE_DEPTH of them unacknowledged at a time
+//the server answers every chunk, so we know it's stored once all the replies are in
+//with dedup we first ask which contents it already has, and only send references to those
+static void *put_thread(void *args) {
+	put_job *job = (put_job *)args;
+	int which[job->num_chunks], retry[job->num_chunks];
+	int n = job->num_chunks;
+	
+	for(int i = 0; i < n; i++) which[i] = i;
+	if(job->dedup && find_held(job) < 0) {
+		job->failed = job->broken = 1;
+		return NULL;
+	}
+	
+	//contents can be dropped between the question and the reference if the last chunk with them is overwritten,
+	//the server says so and those chunks go again in full, and so do chunks that were damaged on the way
+	n = send_chunks(job, which, n, retry);
+	if(n > 0) n = send_chunks(job, retry, n, which);
+	if(n != 0) job->failed = 1;
+	if(n < 0) job->broken = 1;
+	return NULL;
+}
+
+//ask the server which of a job's chunks it holds already, HAS_MAX at a time
+//a server that doesn't know the request holds nothing
+//returns -1 if the connection failed
+static int find_held(void *args) {
+	put_job *job = (put_job *)args;
+	char fields[4];
+	msg_hdr hdr;
+	
+	for(int first = 0; first < job->num_chunks; first += HAS_MAX) {
+		int count = job->num_chunks - first < HAS_MAX ? job->num_chunks - first : HAS_MAX;
+		uint32_t id = (*job->next_id)++;
+		long long start = trace_now();
+		
+		put_u32(fields, count);
+		struct iovec payload[2] = {
+			{ fields, 4 },
+			{ job->hash[first], count * CHASH_LEN }
+		};
+		if(send_msg(job->sock, OP_HAS, id, payload, 2) < 0 || recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id != id)
+			return -1;
+		
+		if(hdr.status != STATUS_OK) {
+			if(hdr.length != 0) return -1;
+			continue;
+		}
+		if(hdr.length != (uint64_t) count || rbuf_read_exact(job->in, job->sock, job->held + first, count) != 0)
+			return -1;
+		trace_span("has", job->server, start);
+	}
+	return 0;
+}
+
+//send the n chunks of a job listed in which, as references if held says so and in full otherwise
+//references the server turned down and chunks that failed their checksum are cleared in held and listed in retry
+//returns how many there are of those, or -1 if the connection failed
+static int send_chunks(void *args, int *which, int n, int *retry) {
+	put_job *job = (put_job *)args;
+	uint32_t first = *job->next_id;
+	int sent = 0, acked = 0, num_retry = 0;
+	unsigned long long trace_first = trace_ids(n);
+	msg_hdr hdr;
+	
+	while(acked < n) {
+		while(sent < n && sent - acked < PIPELINE_DEPTH) {
+			int i = which[sent], r;
+			trace_async('b', "put chunk", job->server, job->chunk[i], trace_first + sent);
+			if(job->held[i])
+				r = put_ref(job->sock, first + sent, job->filename, job->chunk[i], job->total, job->hash[i], job->crc[i], job->raw[i],
+				            job->gen);
+			else
+				r = put_chunk(job->sock, first + sent, job->filename, job->chunk[i], job->total, job->chunk_size[i],
+				              job->contents[i], job->crc[i], job->raw[i], job->gen);
+			if(r < 0) goto broken;
+			sent++;
+		}
+		
+		if(recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id - first >= (uint32_t) sent || hdr.length != 0)
+			goto broken;
+		
+		int i = which[hdr.id - first];
+		trace_async('e', "put chunk", job->server, job->chunk[i], trace_first + hdr.id - first);
+		if((hdr.status == STATUS_NOT_FOUND && job->held[i]) || hdr.status == STATUS_BAD_CHECKSUM) {
+			job->held[i] = 0;
+			retry[num_retry++] = i;
+		}
+		else if(hdr.status != STATUS_OK)
+			job->failed = 1;
+		acked++;
+	}
+	*job->next_id = first + sent;
+	return num_retry;
+	
+broken:
+	*job->next_id = first + sent;
+	return -1;
+}
+
+//send one chunk as a v2 put request, the header, fixed fields and contents all go out in a single writev
+//total is the packed chunk count of the whole file (count_pack), the server keeps it so list and get can tell if a file is complete
+//raw is the chunk's length once decompressed if contents are compressed, 0 if they aren't, and gen the put's generation
+static int put_chunk(int sock, uint32_t id, char *filename, int chunk, int total, long long chunk_size, char *contents, uint32_t crc,
+                     long long raw, long long gen) {
+	int name_len = strlen(filename);
+	if(name_len >= BUFSIZE) return -1;
+	
+	char fields[name_len + 30];
+	int len = pack_string(fields, filename);
+	put_u32(fields + len, chunk);
+	put_u32(fields + len + 4, total);
+	put_u32(fields + len + 8, crc);
+	put_u64(fields + len + 12, raw);
+	put_u64(fields + len + 20, gen);
+	
+	struct iovec payload[2] = {
+		{ fields, len + 28 },
+		{ contents, chunk_size }
+	};
+	return send_msg(sock, OP_PUT, id, payload, chunk_size > 0 ? 2 : 1);
+}
+
+//store a chunk as a reference to contents the server said it has, only the hash is sent
+static int put_ref(int sock, uint32_t id, char *filename, int chunk, int total, unsigned char *hash, uint32_t crc, long long raw,
+                   long long gen) {
+	int name_len = strlen(filename);
+	if(name_len >= BUFSIZE) return -1;
+	
+	char fields[name_len + 30 + CHASH_LEN];
+	int len = pack_string(fields, filename);
+	put_u32(fields + len, chunk);
+	put_u32(fields + len + 4, total);
+	memcpy(fields + len + 8, hash, CHASH_LEN);
+	put_u32(fields + len + 8 + CHASH_LEN, crc);
+	put_u64(fields + len + 12 + CHASH_LEN, raw);
+	put_u64(fields + len + 20 + CHASH_LEN, gen);
+	
+	struct iovec payload[1] = { { fields, len + 28 + CHASH_LEN } };
+	return send_msg(sock, OP_PUT_REF, id, payload, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//the small files one server should receive in a batched put
+//index is where each file is among the small files of the whole call
+//failed is set for every file the server didn't store
+typedef struct {
+	int sock;
+	rbuf *in;
+	uint32_t *next_id;
+	long long gen;
+	int num_files;
+	char **names;
+	char **contents;
+	long long *sizes;
+	uint32_t *crcs;
+	long long *raws;
+	int *index;
+	int *failed;
+	int broken;
+} batch_job;
+
+//put several files at once, status[i] gets 0 or -1 for each
+//files under the small threshold are read in and sent whole, every server getting all of its share in a few batched requests
+//with compress set they're compressed as they're read in, the same way as the chunks of bigger files
+//returns how many files failed
+int dfc_put_many(dfc *d, int n, const char **names, int *fds, int *status) {
+	int num_serv = d->num_serv, num_small = 0, failures = 0;
+	int small[n > 0 ? n : 1];
+	char *contents[n > 0 ? n : 1];
+	long long sizes[n > 0 ? n : 1];
+	uint32_t crcs[n > 0 ? n : 1];
+	long long raws[n > 0 ? n : 1];
+	struct stat st;
+	
+	for(int i = 0; i < n; i++) {
+		status[i] = 0;
+		if(fstat(fds[i], &st) < 0 || st.st_size >= d->small) {
+			status[i] = dfc_put(d, names[i], fds[i]);
+			continue;
+		}
+		
+		contents[num_small] = malloc(st.st_size > 0 ? st.st_size : 1);
+		sizes[num_small] = st.st_size;
+		if(contents[num_small] == NULL || read_all(fds[i], contents[num_small], st.st_size) < 0) {
+			free(contents[num_small]);
+			status[i] = -1;
+			continue;
+		}
+		
+		raws[num_small] = 0;
+		char *packed = d->compress && st.st_size >= LZ_MIN_INPUT ? malloc(st.st_size) : NULL;
+		size_t packed_len = packed ? lz_pack(contents[num_small], st.st_size, packed) : 0;
+		if(packed_len > 0) {
+			free(contents[num_small]);
+			contents[num_small] = packed;
+			sizes[num_small] = packed_len;
+			raws[num_small] = st.st_size;
+		}
+		else
+			free(packed);
+		crcs[num_small] = crc32c(0, contents[num_small], sizes[num_small]);
+		small[num_small++] = i;
+	}
+	
+	if(num_small > 0) {
+		pconn *conns[num_serv];
+		int broken[num_serv];
+		batch_job jobs[num_serv];
+		pthread_t runners[num_serv];
+		int order[num_serv];
+		int connected = pool_lease(d, conns), sending = 1;
+		long long gen = put_generation();
+		
+		//every server could be sent every file, so give each job room for all of them
+		//(or be told to drop older versions of them, which takes the room of the files once they're sent)
+		char **names_buf = malloc(2 * num_serv * num_small * sizeof(char *));
+		int *ints_buf = malloc(2 * num_serv * num_small * sizeof(int));
+		long long *sizes_buf = malloc(num_serv * num_small * sizeof(long long));
+		uint32_t *crcs_buf = malloc(num_serv * num_small * sizeof(uint32_t));
+		long long *raws_buf = malloc(num_serv * num_small * sizeof(long long));
+		int *lost = calloc(num_small, sizeof(int));
+		memset(jobs, 0, sizeof(jobs));
+		
+		if(connected < d->replicas || names_buf == NULL || ints_buf == NULL || sizes_buf == NULL || crcs_buf == NULL || raws_buf == NULL || lost == NULL) {
+			if(connected >= d->replicas) perror("malloc for batch");
+			for(int j = 0; j < num_small; j++) status[small[j]] = -1;
+			memset(broken, 0, sizeof(broken));
+			pool_release(d, conns, broken);
+			sending = 0;
+		}
+		
+		for(int i = 0; i < num_serv && sending; i++) {
+			jobs[i].names = names_buf + 2*i*num_small;
+			jobs[i].contents = names_buf + (2*i + 1)*num_small;
+			jobs[i].sizes = sizes_buf + i*num_small;
+			jobs[i].index = ints_buf + 2*i*num_small;
+			jobs[i].failed = ints_buf + (2*i + 1)*num_small;
+			jobs[i].crcs = crcs_buf + i*num_small;
+			jobs[i].raws = raws_buf + i*num_small;
+			jobs[i].gen = gen;
+			memset(jobs[i].failed, 0, num_small * sizeof(int));
+		}
+		
+		//a small file is its own chunk 0, placed on the first R connected servers like any other chunk
+		for(int j = 0; j < num_small && sending; j++) {
+			char *name = (char *) names[small[j]];
+			place_chunk(d, name, 0, order);
+			for(int k = 0, r = 0; k < num_serv && r < d->replicas; k++) {
+				if(conns[order[k]] == NULL) continue;
+				
+				batch_job *job = &jobs[order[k]];
+				job->names[job->num_files] = name;
+				job->contents[job->num_files] = contents[j];
+				job->sizes[job->num_files] = sizes[j];
+				job->crcs[job->num_files] = crcs[j];
+				job->raws[job->num_files] = raws[j];
+				job->index[job->num_files] = j;
+				job->num_files++;
+				r++;
+			}
+		}
+		
+		for(int i = 0; i < num_serv && sending; i++) {
+			runners[i] = 0;
+			if(jobs[i].num_files == 0) continue;
+			jobs[i].sock = conns[i]->sock;
+			jobs[i].in = &conns[i]->in;
+			jobs[i].next_id = &conns[i]->next_id;
+			if(pthread_create(&runners[i], NULL, batch_thread, &jobs[i]) != 0) {
+				runners[i] = 0;
+				batch_thread(&jobs[i]);
+			}
+		}
+		
+		//a file only counts as stored once every one of its replicas is
+		for(int i = 0; i < num_serv && sending; i++) {
+			if(runners[i]) pthread_join(runners[i], NULL);
+			for(int f = 0; f < jobs[i].num_files; f++)
+				if(jobs[i].failed[f]) lost[jobs[i].index[f]] = 1;
+			broken[i] = jobs[i].broken;
+		}
+		
+		//and then the servers that didn't get one drop whatever they have of an older version, as in dfc_put
+		if(sending) {
+			drop_job drops[num_serv];
+			memset(drops, 0, sizeof(drops));
+			for(int i = 0; i < num_serv; i++) {
+				drops[i].names = names_buf + 2*i*num_small;
+				drops[i].total = count_pack(1, 0, 0);
+				drops[i].gen = gen;
+				if(conns[i] == NULL) continue;
+				drops[i].sock = conns[i]->sock;
+				drops[i].in = &conns[i]->in;
+				drops[i].next_id = &conns[i]->next_id;
+			}
+			for(int j = 0; j < num_small; j++) {
+				if(lost[j]) continue;
+				char *name = (char *) names[small[j]];
+				place_chunk(d, name, 0, order);
+				for(int k = 0, r = 0; k < num_serv; k++) {
+					if(conns[order[k]] == NULL) continue;
+					if(r++ < d->replicas || broken[order[k]]) continue;
+					drop_job *drop = &drops[order[k]];
+					drop->names[drop->num_files++] = name;
+				}
+			}
+			drop_older(d, drops, broken);
+			pool_release(d, conns, broken);
+		}
+		
+		for(int j = 0; j < num_small && sending; j++)
+			if(lost[j]) status[small[j]] = -1;
+		
+		free(names_buf);
+		free(ints_buf);
+		free(sizes_buf);
+		free(crcs_buf);
+		free(raws_buf);
+		free(lost);
+	}
+	
+	for(int j = 0; j < num_small; j++)
+		free(contents[j]);
+	for(int i = 0; i < n; i++)
+		if(status[i] < 0) failures++;
+	return failures;
+}
+
+//send one server its files BATCH_FILES at a time, keeping up to PIPELINE_DEPTH batches unacknowledged
+static void *batch_thread(void *args) {
+	batch_job *job = (batch_job *)args;
+	int num_batches = (job->num_files + BATCH_FILES - 1) / BATCH_FILES;
+	uint32_t first = *job->next_id;
+	int sent = 0, acked = 0;
+	msg_hdr hdr;
+	char fields[4];
+	
+	while(acked < num_batches) {
+		while(sent < num_batches && sent - acked < PIPELINE_DEPTH) {
+			int at = sent * BATCH_FILES;
+			int count = job->num_files - at < BATCH_FILES ? job->num_files - at : BATCH_FILES;
+			if(send_batch(job->sock, first + sent, job->names + at, job->contents + at, job->sizes + at, job->crcs + at,
+			               job->raws + at, job->gen, count) < 0)
+				goto broken;
+			sent++;
+		}
+		
+		if(recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id - first >= (uint32_t) sent || hdr.length < 4 ||
+		   rbuf_read_exact(job->in, job->sock, fields, 4) != 0)
+			goto broken;
+		
+		uint32_t num_failed = get_u32(fields);
+		if(hdr.length != 4 + 4 * (uint64_t) num_failed) goto broken;
+		
+		int at = (hdr.id - first) * BATCH_FILES;
+		for(uint32_t f = 0; f < num_failed; f++) {
+			if(rbuf_read_exact(job->in, job->sock, fields, 4) != 0) goto broken;
+			uint32_t pos = get_u32(fields);
+			if(at + pos < (uint32_t) job->num_files) job->failed[at + pos] = 1;
+		}
+		acked++;
+	}
+	*job->next_id = first + sent;
+	return NULL;
+	
+	//we can't tell which of the outstanding files made it
+broken:
+	*job->next_id = first + sent;
+	for(int f = 0; f < job->num_files; f++) job->failed[f] = 1;
+	job->broken = 1;
+	return NULL;
+}
+
+//send count files as one batched put, each as a whole single chunk file, all of them from the put of generation gen
+static int send_batch(int sock, uint32_t id, char **names, char **contents, long long *sizes, uint32_t *crcs, long long *raws,
+                      long long gen, int count) {
+	struct iovec *payload = malloc((2*count + 1) * sizeof(struct iovec));
+	int fields_len = 4;
+	
+	for(int i = 0; i < count; i++)
+		fields_len += strlen(names[i]) + 38;
+	char *fields = malloc(fields_len);
+	if(payload == NULL || fields == NULL) {
+		perror("malloc for batch");
+		free(payload);
+		free(fields);
+		return -1;
+	}
+	
+	//the fixed fields of every file are packed into one buffer, with each file's contents sent from where they are
+	put_u32(fields, count);
+	payload[0].iov_base = fields;
+	payload[0].iov_len = 4;
+	
+	char *p = fields + 4;
+	int parts = 1;
+	for(int i = 0; i < count; i++) {
+		if(strlen(names[i]) >= BUFSIZE) {
+			free(payload);
+			free(fields);
+			return -1;
+		}
+		
+		int len = pack_string(p, names[i]);
+		put_u32(p + len, 0);
+		put_u32(p + len + 4, 1);
+		put_u64(p + len + 8, sizes[i]);
+		put_u32(p + len + 16, crcs[i]);
+		put_u64(p + len + 20, raws[i]);
+		put_u64(p + len + 28, gen);
+		
+		//the first file's fields follow the count, so they share its iovec
+		if(i == 0) payload[0].iov_len += len + 36;
+		else {
+			payload[parts].iov_base = p;
+			payload[parts++].iov_len = len + 36;
+		}
+		if(sizes[i] > 0) {
+			payload[parts].iov_base = contents[i];
+			payload[parts++].iov_len = sizes[i];
+		}
+		p += len + 36;
+	}
+	
+	int ret = send_msg(sock, OP_PUT_BATCH, id, payload, parts);
+	free(payload);
+	free(fields);
+	return ret;
+}
+
+//a put's generation, which only has to be bigger than the last put of the same file's, the clock does for that
+//across clients, and within one process no two puts get the same one
+static long long put_generation(void) {
+	static long long last;
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	long long gen = ts.tv_sec * 1000000000LL + ts.tv_nsec, prev = __atomic_load_n(&last, __ATOMIC_RELAXED);
+	do {
+		if(gen <= prev) gen = prev + 1;
+	} while(!__atomic_compare_exchange_n(&last, &prev, gen, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return gen;
+}
+
+//tell every server with a job to drop what it holds of older versions of the job's files, all at once
+//the put is already stored by then, a server we can't reach keeps its old chunks, but they're of an older generation
+//than the new ones, so get and list pass them over
+static void drop_older(dfc *d, void *args, int *broken) {
+	drop_job *jobs = (drop_job *)args;
+	int num_serv = d->num_serv;
+	pthread_t runners[num_serv];
+	
+	for(int i = 0; i < num_serv; i++) {
+		runners[i] = 0;
+		if(jobs[i].num_files > 0 && pthread_create(&runners[i], NULL, drop_thread, &jobs[i]) != 0) {
+			runners[i] = 0;
+			drop_thread(&jobs[i]);
+		}
+	}
+	for(int i = 0; i < num_serv; i++) {
+		if(runners[i]) pthread_join(runners[i], NULL);
+		if(jobs[i].broken) broken[i] = 1;
+	}
+}
+
+//send one server its drops, keeping up to PIPELINE_DEPTH of them unacknowledged
+//a server that can't drop a file says so, but there's nothing more to do about it than for one we can't reach
+static void *drop_thread(void *args) {
+	drop_job *job = (drop_job *)args;
+	uint32_t first = *job->next_id;
+	int sent = 0, acked = 0;
+	char fields[BUFSIZE + 14];
+	msg_hdr hdr;
+	
+	while(acked < job->num_files) {
+		while(sent < job->num_files && sent - acked < PIPELINE_DEPTH) {
+			if(strlen(job->names[sent]) >= BUFSIZE) goto broken;
+			int len = pack_string(fields, job->names[sent]);
+			put_u32(fields + len, job->total);
+			put_u64(fields + len + 4, job->gen);
+			struct iovec payload = { fields, len + 12 };
+			if(send_msg(job->sock, OP_DROP, first + sent, &payload, 1) < 0) goto broken;
+			sent++;
+		}
+		
+		if(recv_msg(job->in, job->sock, &hdr) < 0 || hdr.id - first >= (uint32_t) sent || hdr.length != 0)
+			goto broken;
+		acked++;
+	}
+	*job->next_id = first + sent;
+	return NULL;
+	
+broken:
+	*job->next_id = first + sent;
+	job->broken = 1;
+	return NULL;
+}
+
+//read exactly len bytes of fd from the start, returns -1 on error
+static int read_all(int fd, char *buf, long long len) {
+	long long got = 0;
+	
+	while(got < len) {
+		ssize_t n = pread(fd, buf + got, len - got, got);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			perror("reading file");
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+//write len bytes to fd at off, returns -1 on error
+static int write_all(int fd, char *buf, long long len, long long off) {
+	long long done = 0, start = trace_now();
+	
+	while(done < len) {
+		ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) {
+			perror("writing reconstructed file");
+			return -1;
+		}
+		done += n;
+	}
+	trace_span("disk write", NULL, start);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+dfc *dfc_open(const char *conf_path) {
+	dfc *d = calloc(1, sizeof(dfc));
+	if(d == NULL) {
+		perror("malloc for dfc");
+		return NULL;
+	}
+	
+	if(read_conf_file(d, conf_path) < 0) {
+		free(d);
+		return NULL;
+	}
+	
+	//even without erasure coding ourselves, we may have to rebuild a file someone else stored with it
+	rs_init();
+	crc32c_init();
+	
+	//warm the pool with a connection to every server, a server that isn't up is left to the checker
+	for(int i = 0; i < d->num_serv; i++) {
+		pthread_mutex_init(&d->servers[i].lock, NULL);
+		pconn *pc = pool_connect(&d->servers[i]);
+		if(pc != NULL) pool_put(&d->servers[i], pc, 0);
+	}
+	
+	pthread_mutex_init(&d->stop_lock, NULL);
+	pthread_cond_init(&d->stop_cond, NULL);
+	if(pthread_create(&d->checker, NULL, pool_checker, d) != 0) {
+		perror("creating connection checker");
+		d->checker = 0;
+	}
+	return d;
+}
+
+void dfc_close(dfc *d) {
+	if(d->checker) {
+		pthread_mutex_lock(&d->stop_lock);
+		d->stopping = 1;
+		pthread_cond_signal(&d->stop_cond);
+		pthread_mutex_unlock(&d->stop_lock);
+		pthread_join(d->checker, NULL);
+	}
+	
+	for(int i = 0; i < d->num_serv; i++) {
+		server_pool *sp = &d->servers[i];
+		while(sp->idle != NULL) {
+			pconn *pc = sp->idle;
+			sp->idle = pc->next;
+			pool_close(pc);
+		}
+		pthread_mutex_destroy(&sp->lock);
+		free(sp->name);
+		free(sp->host);
+	}
+	pthread_mutex_destroy(&d->stop_lock);
+	pthread_cond_destroy(&d->stop_cond);
+	free(d->servers);
+	free(d);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//open a new connection to a server and switch it to the binary protocol, marking the server down if we can't
+static pconn *pool_connect(server_pool *sp) {
+	pconn *pc = calloc(1, sizeof(pconn));
+	if(pc == NULL) {
+		perror("malloc for connection");
+		return NULL;
+	}
+	
+	//replies are read through a buffer so we aren't making a syscall per field
+	if(rbuf_init(&pc->in, FRAME_BUFSIZE) < 0) {
+		perror("malloc for receive buffer");
+		free(pc);
+		return NULL;
+	}
+	pc->next_id = 1;
+	
+	if(connect_to_host(&pc->sock, sp->host) == -1) {
+		rbuf_free(&pc->in);
+		free(pc);
+		pc = NULL;
+	}
+	else if(hello(pc->sock, &pc->in) < 0) {
+		pool_close(pc);
+		pc = NULL;
+	}
+	
+	pthread_mutex_lock(&sp->lock);
+	sp->down = pc == NULL;
+	pthread_mutex_unlock(&sp->lock);
+	return pc;
+}
+
+//an idle connection to the server, or a new one if none are idle
+//returns NULL if the server is down
+static pconn *pool_get(server_pool *sp) {
+	pthread_mutex_lock(&sp->lock);
+	if(sp->down) {
+		pthread_mutex_unlock(&sp->lock);
+		return NULL;
+	}
+	
+	pconn *pc = sp->idle;
+	if(pc != NULL) {
+		sp->idle = pc->next;
+		sp->num_idle--;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	
+	if(pc == NULL) pc = pool_connect(sp);
+	return pc;
+}
+
+//hand a connection back once we're done with it
+//a broken connection could be anywhere in the middle of a reply, so it's closed instead
+static void pool_put(server_pool *sp, pconn *pc, int broken) {
+	if(!broken) {
+		pthread_mutex_lock(&sp->lock);
+		if(sp->num_idle < POOL_MAX_IDLE) {
+			pc->next = sp->idle;
+			sp->idle = pc;
+			sp->num_idle++;
+			pc = NULL;
+		}
+		pthread_mutex_unlock(&sp->lock);
+	}
+	if(pc != NULL) pool_close(pc);
+}
+
+static void pool_close(pconn *pc) {
+	close(pc->sock);
+	rbuf_free(&pc->in);
+	free(pc);
+}
+
+//take a connection to every server for one call, conns[i] is NULL for servers that are down
+//returns how many servers we have a connection to
+static int pool_lease(dfc *d, pconn **conns) {
+	int connected = 0;
+	
+	for(int i = 0; i < d->num_serv; i++) {
+		conns[i] = pool_get(&d->servers[i]);
+		if(conns[i] != NULL) connected++;
+	}
+	return connected;
+}
+
+static void pool_release(dfc *d, pconn **conns, int *broken) {
+	for(int i = 0; i < d->num_serv; i++)
+		if(conns[i] != NULL)
+			pool_put(&d->servers[i], conns[i], broken[i]);
+}
+
+//every POOL_CHECK_INTERVAL seconds, ping the idle connections and reconnect to servers with none
+//so the next call finds working connections instead of finding out the hard way
+static void *pool_checker(void *args) {
+	dfc *d = (dfc *)args;
+	
+	while(1) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += POOL_CHECK_INTERVAL;
+		
+		pthread_mutex_lock(&d->stop_lock);
+		while(!d->stopping && pthread_cond_timedwait(&d->stop_cond, &d->stop_lock, &until) == 0);
+		int stopping = d->stopping;
+		pthread_mutex_unlock(&d->stop_lock);
+		if(stopping) return NULL;
+		
+		for(int i = 0; i < d->num_serv; i++) {
+			server_pool *sp = &d->servers[i];
+			
+			//take the idle list so calls don't pick up a connection while we're pinging it
+			pthread_mutex_lock(&sp->lock);
+			pconn *pc = sp->idle;
+			sp->idle = NULL;
+			sp->num_idle = 0;
+			pthread_mutex_unlock(&sp->lock);
+			
+			int alive = 0;
+			while(pc != NULL) {
+				pconn *next = pc->next;
+				int broken = hello(pc->sock, &pc->in) < 0;
+				if(!broken) alive++;
+				pool_put(sp, pc, broken);
+				pc = next;
+			}
+			
+			if(alive == 0) {
+				pc = pool_connect(sp);
+				if(pc != NULL) pool_put(sp, pc, 0);
+			}
+		}
+	}
+}
+
+//reads configuration file, without connecting to anything yet
+//lines are "server <name> <host:port>", plus optional "replicas <n>", "chunks <n>", "small <bytes>", "dedup <0|1>",
+//"compress <0|1>" and "erasure <k> <m>"
+//chunks defaults to one per server
+//if errors, return -1
+static int read_conf_file(dfc *d, const char *conf_path) {
+	int cap = 0;
+	char *home = getenv("HOME");
+	char line[BUFSIZE];
+	FILE *fp;
+	
+	if(conf_path != NULL)
+		fp = fopen(conf_path, "r");
+	else {
+		if(home == NULL) return -1;
+		
+		char filepath[strlen(home) + 20];
+		strncpy(filepath, home, strlen(home) + 20);
+		strncat(filepath, "/dfc.conf", strlen(home) + 20 - strlen(filepath));
+		fp = fopen(filepath, "r");
+	}
+	if(fp==NULL) return -1;
+	
+	d->replicas = DEFAULT_REPLICAS;
+	d->small = DEFAULT_SMALL;
+	d->block = DEFAULT_BLOCK;
+	d->dedup = 1;
+	
+	while(fgets(line, BUFSIZE, fp) != NULL) {
+		char *s = strtok(line, " \t\r\n");
+		if(s==NULL || s[0]=='#') continue;
+		
+		//"small 0" stripes everything, "block 0" always stripes over the same number of chunks however big the file
+		if(strcmp(s, "small")==0 || strcmp(s, "block")==0) {
+			char *n = strtok(NULL, " \t\r\n");
+			if(n==NULL || atoll(n) < 0) {
+				fclose(fp);
+				return -1;
+			}
+			if(s[0]=='s') d->small = atoll(n);
+			else d->block = atoll(n);
+			continue;
+		}
+		
+		//"dedup 0" always sends every chunk, "compress 1" compresses the chunks worth it
+		if(strcmp(s, "dedup")==0 || strcmp(s, "compress")==0) {
+			char *n = strtok(NULL, " \t\r\n");
+			if(n==NULL) {
+				fclose(fp);
+				return -1;
+			}
+			if(s[0]=='d') d->dedup = atoi(n) != 0;
+			else d->compress = atoi(n) != 0;
+			continue;
+		}
+		
+		//"erasure 4 2" stores striped files as 4 data and 2 parity shards, which replaces replicas for them
+		if(strcmp(s, "erasure")==0) {
+			char *k = strtok(NULL, " \t\r\n");
+			char *m = strtok(NULL, " \t\r\n");
+			if(k==NULL || m==NULL || atoi(k) <= 0 || atoi(m) <= 0 || atoi(k) + atoi(m) > RS_MAX_SHARDS) {
+				fclose(fp);
+				return -1;
+			}
+			d->chunks = atoi(k);
+			d->parity = atoi(m);
+			continue;
+		}
+		
+		if(strcmp(s, "replicas")==0 || strcmp(s, "chunks")==0) {
+			char *n = strtok(NULL, " \t\r\n");
+			if(n==NULL || atoi(n) <= 0) {
+				fclose(fp);
+				return -1;
+			}
+			if(s[0]=='r') d->replicas = atoi(n);
+			else d->chunks = atoi(n);
+			continue;
+		}
+		
+		if(strcmp(s, "server")!=0) {
+			fclose(fp);
+			return -1;
+		}
+		
+		char *s_n = strtok(NULL, " \t");
+		char *hn = strtok(NULL, " \t\r\n");
+		if(s_n==NULL || hn==NULL) {
+			fclose(fp);
+			return -1;
+		}
+		
+		if(d->num_serv == cap) {
+			cap = cap ? 2*cap : 8;
+			d->servers = realloc(d->servers, cap * sizeof(server_pool));
+			if(d->servers == NULL) {
+				perror("malloc for server list");
+				fclose(fp);
+				return -1;
+			}
+		}
+		
+		server_pool *sp = &d->servers[d->num_serv++];
+		memset(sp, 0, sizeof(server_pool));
+		sp->name = strdup(s_n);
+		sp->host = strdup(hn);
+	}
+	
+	fclose(fp);
+	
+	if(d->num_serv == 0) return -1;
+	if(d->chunks == 0) d->chunks = d->num_serv;
+	if(d->parity > 0 && d->chunks + d->parity > RS_MAX_SHARDS) return -1;
+	if(d->replicas > d->num_serv) d->replicas = d->num_serv;
+	return 0;
+}
+
+//connect to host, adapted from beej's guide
+static int connect_to_host(int *server_sock, char *hostname) {
+
+	char host_port[strlen(hostname)+1];
+	struct addrinfo hints, *servinfo, *p;
+	char *host, *port, port_str[8];
+	
+	bzero(port_str, 8);
+	strcpy(host_port, hostname);
+	host = strtok(host_port, ":");
+	if(host==NULL) return -1;
+	port = strtok(NULL, ":");
+	if(port==NULL) return -1;
+	else strcpy(port_str, port);
+	
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	long long start = trace_now();
+	if (getaddrinfo(host, port_str, &hints, &servinfo) != 0) {
+	    return -1;
+	}
+	trace_span("dns", hostname, start);
+	
+	for(p = servinfo; p != NULL; p = p->ai_next) {
+   		if ((*server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+		        perror("socket");
+        		continue;
+    		}
+
+		//the agent keeps retrying servers that are down, so nothing can leak on the way out
+		start = trace_now();
+        	if (connect(*server_sock, p->ai_addr, p->ai_addrlen) == -1) {
+        		close(*server_sock);
+        		freeaddrinfo(servinfo);
+        		return -1;
+        	}
+		trace_span("connect", hostname, start);
+
+		//commands are small writes that we wait on a reply for, so don't let Nagle hold them back
+		int one = 1;
+		setsockopt(*server_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    		break;
+	}
+	
+	freeaddrinfo(servinfo);
+	return p == NULL ? -1 : 0;
+}
+
+//switch the connection to the binary protocol, returns -1 if the server doesn't speak it
+static int hello(int sock, rbuf *in) {
+	long long start = trace_now();
+	msg_hdr hdr;
+	
+	if(send_msg(sock, OP_HELLO, 0, NULL, 0) < 0 || recv_msg(in, sock, &hdr) < 0 ||
+	   hdr.opcode != OP_HELLO || hdr.status != STATUS_OK || hdr.length != 0)
+		return -1;
+	trace_span("hello", NULL, start);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int dfc_trace_start(const char *path) {
+	pthread_mutex_lock(&trace.lock);
+	free(trace.path);
+	trace.path = strdup(path);
+	trace.num_events = 0;
+	trace.on = trace.path != NULL;
+	trace.start = trace_now();
+	pthread_mutex_unlock(&trace.lock);
+	return trace.on ? 0 : -1;
+}
+
+//events are written in the order they were recorded, which trace viewers don't mind
+int dfc_trace_stop(void) {
+	int ret = 0;
+	
+	pthread_mutex_lock(&trace.lock);
+	if(!trace.on) {
+		pthread_mutex_unlock(&trace.lock);
+		return -1;
+	}
+	trace.on = 0;
+	
+	FILE *out = fopen(trace.path, "w");
+	if(out == NULL) {
+		perror("opening trace file");
+		ret = -1;
+	}
+	else {
+		int pid = getpid();
+		fprintf(out, "{\"traceEvents\":[\n");
+		fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"u_dfc\"}}", pid);
+		for(int i = 0; i < trace.num_events; i++) {
+			trace_event *e = &trace.events[i];
+			fprintf(out, ",\n{\"name\":");
+			trace_escape(out, e->name);
+			fprintf(out, ",\"cat\":\"dfc\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", e->ph, pid, e->tid, (e->ts - trace.start) / 1000.0);
+			if(e->ph == 'X') fprintf(out, ",\"dur\":%.3f", e->dur / 1000.0);
+			if(e->ph != 'X') fprintf(out, ",\"id\":\"0x%llx\"", e->id);
+			if(e->detail[0]) {
+				fprintf(out, ",\"args\":{\"detail\":");
+				trace_escape(out, e->detail);
+				fprintf(out, "}");
+			}
+			fprintf(out, "}");
+		}
+		fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+		if(fclose(out) != 0) {
+			perror("writing trace file");
+			ret = -1;
+		}
+	}
+	
+	free(trace.events);
+	free(trace.path);
+	trace.events = NULL;
+	trace.path = NULL;
+	trace.num_events = trace.cap_events = 0;
+	pthread_mutex_unlock(&trace.lock);
+	return ret;
+}
+
+long long dfc_trace_now(void) {
+	return trace_now();
+}
+
+void dfc_trace_span(const char *name, const char *detail, long long start) {
+	trace_span(name, detail, start);
+}
+
+//the monotonic clock in nanoseconds, or 0 when we aren't tracing, which every other trace function takes as "don't"
+static long long trace_now(void) {
+	struct timespec ts;
+	
+	if(!trace.on) return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//add an event to the trace, detail may be NULL
+static void trace_record(char ph, const char *name, const char *detail, unsigned long long id, long long ts, long long dur) {
+	pthread_mutex_lock(&trace.lock);
+	if(!trace.on) {
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+	if(trace.num_events == trace.cap_events) {
+		int cap = trace.cap_events ? trace.cap_events * 2 : 4096;
+		trace_event *grown = realloc(trace.events, cap * sizeof(trace_event));
+		if(grown == NULL) {
+			pthread_mutex_unlock(&trace.lock);
+			return;
+		}
+		trace.events = grown;
+		trace.cap_events = cap;
+	}
+	if(trace_tid == 0) trace_tid = ++trace.next_tid;
+	
+	trace_event *e = &trace.events[trace.num_events++];
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+	e->ph = ph;
+	e->tid = trace_tid;
+	e->id = id;
+	e->ts = ts;
+	e->dur = dur;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+//record a span from start (a trace_now) until now
+static void trace_span(const char *name, const char *detail, long long start) {
+	if(start == 0) return;
+	long long now = trace_now();
+	trace_record('X', name, detail, 0, start, now - start);
+}
+
+//record the begin ('b'), a point in ('n') or the end ('e') of asynchronous span id, for a chunk on server
+static void trace_async(char ph, const char *name, const char *server, int chunk, unsigned long long id) {
+	char detail[96];
+	
+	if(!trace.on) return;
+	snprintf(detail, sizeof(detail), "%s chunk %d", server, chunk);
+	trace_record(ph, name, detail, id, trace_now(), 0);
+}
+
+//n ids for asynchronous spans no one else is using
+static unsigned long long trace_ids(int n) {
+	if(!trace.on) return 0;
+	return __atomic_fetch_add(&trace.next_id, n, __ATOMIC_RELAXED);
+}
+
+//write s as a JSON string
+static void trace_escape(FILE *out, const char *s) {
+	fputc('"', out);
+	for(; *s; s++) {
+		unsigned char ch = *s;
+		if(ch == '"' || ch == '\\') fprintf(out, "\\%c", ch);
+		else if(ch < 0x20) fprintf(out, "\\u%04x", ch);
+		else fputc(ch, out);
+	}
+	fputc('"', out);
+}
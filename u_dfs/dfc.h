@@ -0,0 +1,78 @@
+#ifndef DFC_H
+#define DFC_H
+
+//client library for the DFS, used by u_dfc and by anything that wants to talk to the servers directly
+//build it in with dfc.c, frame.h and proto.h, and link with -pthread
+//
+//a handle keeps a pool of open connections to every server in the configuration and checks on them in the background,
+//so calls after the first don't pay for connection setup
+//handles can be shared between threads, each call takes its own connections out of the pool
+//calls return 0 on success and -1 on failure
+
+typedef struct dfc dfc;
+
+//called once per file by dfc_list, complete is 0 if some of its chunks aren't on any server we can reach
+typedef void (*dfc_list_cb)(const char *name, int complete, void *arg);
+
+//called once per server by dfc_scrub, reached is 0 if we couldn't ask it, otherwise checked and failed count its chunks
+typedef void (*dfc_scrub_cb)(const char *server, int reached, unsigned long long checked, unsigned long long failed, void *arg);
+
+//called once per server by dfc_stats, report is the server's statistics as text, or NULL if we couldn't ask it
+typedef void (*dfc_stats_cb)(const char *server, const char *report, void *arg);
+
+//conf_path is a dfc.conf, NULL for $HOME/dfc.conf
+//returns NULL if the configuration can't be read
+dfc *dfc_open(const char *conf_path);
+void dfc_close(dfc *d);
+
+//store everything in fd as name
+//files under the "small" size from dfc.conf are stored whole instead of being striped
+//big files are striped in blocks of the "block" size from dfc.conf (4 MB unless it says otherwise), spread over the servers
+//by rendezvous hash and sent a few hundred MB at a time, so a file of any size moves in pieces every server works on at once
+//with "erasure <k> <m>" in dfc.conf, striped files are stored as k data and m Reed-Solomon parity shards (see rs.h),
+//one copy of each instead of replicas, and any k of them can rebuild the file; small files are still replicated
+//unless dfc.conf has "dedup 0", chunks a server already holds the contents of are sent as references to them
+//with "compress 1" in dfc.conf, chunks that compress well are sent and stored compressed, and get decompresses them
+int dfc_put(dfc *d, const char *name, int fd);
+
+//put n files at once, status[i] is set to 0 or -1 for each
+//the small ones go to each server in a few batched requests instead of one request per chunk
+//returns how many failed
+int dfc_put_many(dfc *d, int n, const char **names, int *fds, int *status);
+
+//write name into fd, which must be a regular file opened for writing
+//every chunk is checked against the crc32c it was stored with, and one that doesn't match is fetched from another replica
+//data shards of an erasure coded file that can't be had (or don't match) are rebuilt from the parity shards
+//on failure fd may be left holding part of the file
+int dfc_get(dfc *d, const char *name, int fd);
+
+//write length bytes of name starting at offset into fd (fewer if the file ends first), like dfc_get otherwise
+//only the chunks the range covers are fetched, and of those only the bytes in it, except for compressed chunks,
+//which come whole; a chunk fetched in part can't be checked against its crc32c
+int dfc_get_range(dfc *d, const char *name, long long offset, long long length, int fd);
+
+int dfc_list(dfc *d, dfc_list_cb cb, void *arg);
+
+//have every server check the chunks it holds against their crc32c, dropping the ones that fail so gets go to the good copies
+//waits until every server is done, which takes as long as reading back everything they hold
+//a server that was already scrubbing is waited for instead of starting over
+int dfc_scrub(dfc *d, dfc_scrub_cb cb, void *arg);
+
+//ask every server what it's been doing: request counts and bytes by operation, connections,
+//and list, put and get latency histograms split into disk and network time (the format is in u_dfs.c's stats_format)
+int dfc_stats(dfc *d, dfc_stats_cb cb, void *arg);
+
+//record what every call in this process spends its time on until dfc_trace_stop, which writes it to path
+//as Chrome trace event JSON (open it in chrome://tracing or Perfetto)
+//that's DNS lookups, connects, the stat and each chunk request of a get from when it's sent to its first and last byte,
+//disk writes, erasure decoding, and for puts the preparing of each window and each chunk from sent to acknowledged
+//start it before dfc_open to see the first connects; with tracing off each trace point is a single branch
+int dfc_trace_start(const char *path);
+int dfc_trace_stop(void);
+
+//let the caller add its own spans: take dfc_trace_now before and pass it to dfc_trace_span after
+//dfc_trace_now is 0 when not tracing, and dfc_trace_span ignores that
+long long dfc_trace_now(void);
+void dfc_trace_span(const char *name, const char *detail, long long start);
+
+#endif
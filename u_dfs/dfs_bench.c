@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dfc.h"
+
+//load generator for u_dfs, build with dfc.c: gcc -O2 -pthread dfs_bench.c dfc.c -o dfs_bench
+//starts its own u_dfs servers on loopback ports with a dfc.conf to match, stores the objects gets will read,
+//then runs client threads doing a mix of put, get and list for a while and reports throughput and latency per operation
+//
+//	-n servers	how many u_dfs to start (3)
+//	-c clients	how many client threads, sharing one dfc handle like a program using the library would (8)
+//	-t seconds	how long to run (10)
+//	-m mix		how often each operation comes up, e.g. put:1,get:4,list:1 (the default)
+//	-z sizes	object sizes chosen between evenly, with K, M or G suffixes (1K,64K,1M,16M)
+//	-f objects	how many objects of each size gets read from (4)
+//	-s path		the u_dfs to run (./u_dfs)
+//	-a args		extra arguments for every u_dfs, e.g. "-s -u"
+//	-o line		extra dfc.conf line, can be given more than once, e.g. -o "compress 1"
+//	-p port		first port, the servers take the ones after it (20001)
+//	-j file		also write the results there as JSON, - for stdout
+//	-k		keep the work directory (the servers' data, the conf and the objects)
+//
+//the conf has "dedup 0" before any -o lines, so puts of the same contents still move every byte
+
+//most of anything we keep a list of
+#define MAX_SERVERS 64
+#define MAX_SIZES 32
+#define MAX_CONF_LINES 32
+
+//how long a server gets to start listening, in milliseconds
+#define START_TIMEOUT 5000
+
+//names each client cycles through for its puts, so the servers' disks don't fill up over a long run
+#define PUT_NAMES 4
+
+enum { OP_PUT_BENCH, OP_GET_BENCH, OP_LIST_BENCH, NUM_OPS };
+const char *op_names[NUM_OPS] = { "put", "get", "list" };
+
+//one client's results, latencies are in nanoseconds
+typedef struct {
+	uint64_t *lat[NUM_OPS];
+	long count[NUM_OPS], cap[NUM_OPS];
+	long errors[NUM_OPS];
+	long long bytes[NUM_OPS];
+} op_stats;
+
+typedef struct {
+	int id;
+	pthread_t runner;
+	op_stats stats;
+} client;
+
+//everything the clients share, set up by main
+struct {
+	dfc *d;
+	char *dir;
+	int weights[NUM_OPS], total_weight;
+	long long sizes[MAX_SIZES];
+	int num_sizes;
+	int objects;
+	int *sources;
+	uint64_t deadline;
+} bench;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//functionality functions
+int start_servers(char*, int, int, char*, pid_t*, char*);
+void stop_servers(pid_t*, int);
+int make_sources(void);
+int preload(void);
+void *client_thread(void*);
+int run_op(client*, int, uint64_t*, int, long long*);
+void report(client*, int, double, FILE*, int);
+
+//helper functions
+uint64_t now_ns(void);
+uint64_t next_rand(uint64_t*);
+long long parse_size(char*);
+int parse_mix(char*);
+int parse_sizes(char*);
+int wait_listening(int);
+void record(op_stats*, int, uint64_t, long long);
+int cmp_u64(const void*, const void*);
+void count_file(const char*, int, void*);
+int remove_entry(const char*, const struct stat*, int, struct FTW*);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+	int num_serv = 3, num_clients = 8, seconds = 10, port = 20001, keep = 0, num_conf = 0, opt;
+	char *server = "./u_dfs", *server_args = "", *json = NULL;
+	char *conf_lines[MAX_CONF_LINES];
+	char mix[] = "put:1,get:4,list:1", sizes[] = "1K,64K,1M,16M";
+
+	bench.objects = 4;
+	if(parse_mix(mix) < 0 || parse_sizes(sizes) < 0) return -1;
+
+	while((opt = getopt(argc, argv, "n:c:t:m:z:f:s:a:o:p:j:k")) != -1) {
+		switch(opt) {
+		case 'n': num_serv = atoi(optarg); break;
+		case 'c': num_clients = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'm':
+			if(parse_mix(optarg) < 0) {
+				printf("Bad mix %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'z':
+			if(parse_sizes(optarg) < 0) {
+				printf("Bad sizes %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'f': bench.objects = atoi(optarg); break;
+		case 's': server = optarg; break;
+		case 'a': server_args = optarg; break;
+		case 'o':
+			if(num_conf < MAX_CONF_LINES) conf_lines[num_conf++] = optarg;
+			break;
+		case 'p': port = atoi(optarg); break;
+		case 'j': json = optarg; break;
+		case 'k': keep = 1; break;
+		default:
+			printf("Usage: %s [-n servers] [-c clients] [-t seconds] [-m put:1,get:4,list:1] [-z 1K,64K,1M,16M] [-f objects]\n"
+			       "       [-s u_dfs path] [-a server args] [-o conf line] [-p first port] [-j json file] [-k]\n", argv[0]);
+			return -1;
+		}
+	}
+	if(num_serv <= 0 || num_serv > MAX_SERVERS || num_clients <= 0 || seconds <= 0 || bench.objects <= 0 || port <= 0) {
+		printf("Bad arguments\n");
+		return -1;
+	}
+
+	//a server that dies under us shouldn't take the benchmark with it
+	signal(SIGPIPE, SIG_IGN);
+
+	char dir[] = "/tmp/dfs_bench.XXXXXX";
+	if(mkdtemp(dir) == NULL) {
+		perror("making work directory");
+		return -1;
+	}
+	bench.dir = dir;
+
+	//the servers are named by their ports, and the conf only has the lines we were given after ours
+	char conf[sizeof(dir) + 16];
+	snprintf(conf, sizeof(conf), "%s/dfc.conf", dir);
+	FILE *fp = fopen(conf, "w");
+	if(fp == NULL) {
+		perror("writing dfc.conf");
+		return -1;
+	}
+	for(int i = 0; i < num_serv; i++)
+		fprintf(fp, "server dfs%d 127.0.0.1:%d\n", port + i, port + i);
+	fprintf(fp, "dedup 0\n");
+	for(int i = 0; i < num_conf; i++)
+		fprintf(fp, "%s\n", conf_lines[i]);
+	fclose(fp);
+
+	pid_t pids[num_serv];
+	int ret = -1;
+	client *clients = calloc(num_clients, sizeof(client));
+	if(clients == NULL) {
+		perror("malloc for clients");
+		return -1;
+	}
+
+	if(start_servers(server, num_serv, port, server_args, pids, dir) < 0) goto done;
+	if((bench.d = dfc_open(conf)) == NULL) {
+		printf("Bad configuration file\n");
+		goto stop;
+	}
+	if(make_sources() < 0 || preload() < 0) goto disconnect;
+
+	//every client stops at the same moment, whatever it's in the middle of still counts
+	uint64_t start = now_ns();
+	bench.deadline = start + (uint64_t) seconds * 1000000000ULL;
+	for(int i = 0; i < num_clients; i++) {
+		clients[i].id = i;
+		if(pthread_create(&clients[i].runner, NULL, client_thread, &clients[i]) != 0) {
+			perror("creating client thread");
+			num_clients = i;
+			break;
+		}
+	}
+	for(int i = 0; i < num_clients; i++)
+		pthread_join(clients[i].runner, NULL);
+	double elapsed = (now_ns() - start) / 1e9;
+
+	report(clients, num_clients, elapsed, stdout, 0);
+	if(json != NULL) {
+		FILE *out = strcmp(json, "-")==0 ? stdout : fopen(json, "w");
+		if(out == NULL) perror("writing json");
+		else {
+			report(clients, num_clients, elapsed, out, 1);
+			if(out != stdout) fclose(out);
+		}
+	}
+	ret = 0;
+
+disconnect:
+	dfc_close(bench.d);
+stop:
+	stop_servers(pids, num_serv);
+done:
+	for(int i = 0; i < num_clients; i++)
+		for(int op = 0; op < NUM_OPS; op++) free(clients[i].stats.lat[op]);
+	free(clients);
+	if(bench.sources != NULL)
+		for(int i = 0; i < bench.num_sizes; i++)
+			if(bench.sources[i] >= 0) close(bench.sources[i]);
+	free(bench.sources);
+	if(!keep) nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	else printf("Kept %s\n", dir);
+	return ret;
+}
+
+//start num_serv servers on the ports from port on, each storing into <dir>/<port>
+//args is split on spaces and passed to every one of them
+//returns -1 (with the ones that did start stopped again) if one of them never starts listening
+int start_servers(char *path, int num_serv, int port, char *args, pid_t *pids, char *dir) {
+	char *argv[32];
+	char *extra = strdup(args);
+	int argc = 3;
+
+	if(extra == NULL) return -1;
+	for(char *a = strtok(extra, " "); a != NULL && argc < 30; a = strtok(NULL, " "))
+		argv[argc++] = a;
+	argv[argc] = NULL;
+
+	for(int i = 0; i < num_serv; i++) pids[i] = -1;
+	for(int i = 0; i < num_serv; i++) {
+		char data[strlen(dir) + 16], port_s[16];
+		snprintf(data, sizeof(data), "%s/%d", dir, port + i);
+		snprintf(port_s, sizeof(port_s), "%d", port + i);
+		argv[0] = path;
+		argv[1] = data;
+		argv[2] = port_s;
+
+		pids[i] = fork();
+		if(pids[i] < 0) {
+			perror("starting server");
+			break;
+		}
+		if(pids[i] == 0) {
+			execv(path, argv);
+			perror("running server");
+			_exit(127);
+		}
+		if(wait_listening(port + i) < 0) {
+			printf("Server on port %d didn't start\n", port + i);
+			break;
+		}
+	}
+	free(extra);
+
+	for(int i = 0; i < num_serv; i++) {
+		if(pids[i] > 0 && waitpid(pids[i], NULL, WNOHANG) == 0) continue;
+		stop_servers(pids, num_serv);
+		return -1;
+	}
+	return 0;
+}
+
+void stop_servers(pid_t *pids, int num_serv) {
+	for(int i = 0; i < num_serv; i++)
+		if(pids[i] > 0) kill(pids[i], SIGTERM);
+	for(int i = 0; i < num_serv; i++)
+		if(pids[i] > 0) waitpid(pids[i], NULL, 0);
+}
+
+//one file of each size for puts to send, unlinked so it's gone with us
+//the contents are random, so compression (if the conf turns it on) has nothing to gain
+int make_sources() {
+	char path[strlen(bench.dir) + 16], buf[1 << 16];
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+	bench.sources = malloc(bench.num_sizes * sizeof(int));
+	if(bench.sources == NULL) {
+		perror("malloc for objects");
+		return -1;
+	}
+	for(int i = 0; i < bench.num_sizes; i++) bench.sources[i] = -1;
+	for(int i = 0; i < bench.num_sizes; i++) {
+		snprintf(path, sizeof(path), "%s/source", bench.dir);
+		bench.sources[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if(bench.sources[i] < 0) {
+			perror("making object");
+			return -1;
+		}
+		unlink(path);
+
+		for(long long off = 0; off < bench.sizes[i]; off += sizeof(buf)) {
+			long long n = bench.sizes[i] - off < (long long) sizeof(buf) ? bench.sizes[i] - off : (long long) sizeof(buf);
+			for(size_t j = 0; j < sizeof(buf); j += 8) {
+				uint64_t r = next_rand(&seed);
+				memcpy(buf + j, &r, 8);
+			}
+			if(pwrite(bench.sources[i], buf, n, off) != n) {
+				perror("making object");
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+//store the objects gets read, bench.objects of each size
+int preload() {
+	char name[64];
+
+	for(int i = 0; i < bench.num_sizes; i++) {
+		for(int k = 0; k < bench.objects; k++) {
+			snprintf(name, sizeof(name), "obj-%lld-%d", bench.sizes[i], k);
+			if(dfc_put(bench.d, name, bench.sources[i]) < 0) {
+				printf("Couldn't store %s\n", name);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+//do operations until the deadline, each one picked by the mix and sized from the sizes
+void *client_thread(void *args) {
+	client *c = (client *)args;
+	uint64_t seed = 0x2545f4914f6cdd1dULL * (c->id + 1);
+	char path[strlen(bench.dir) + 32];
+	int puts = 0;
+
+	//gets land in a file of our own, emptied each time
+	snprintf(path, sizeof(path), "%s/get-%d", bench.dir, c->id);
+	int out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(out < 0) {
+		perror("opening get file");
+		return NULL;
+	}
+	unlink(path);
+
+	while(now_ns() < bench.deadline) {
+		int pick = next_rand(&seed) % bench.total_weight, op = 0;
+		while(pick >= bench.weights[op]) pick -= bench.weights[op++];
+
+		long long bytes = 0;
+		uint64_t start = now_ns();
+		int ok = run_op(c, op, &seed, op == OP_PUT_BENCH ? puts++ : out, &bytes) == 0;
+		if(op == OP_GET_BENCH && ftruncate(out, 0) < 0) perror("emptying get file");
+		if(ok) record(&c->stats, op, now_ns() - start, bytes);
+		else c->stats.errors[op]++;
+	}
+	close(out);
+	return NULL;
+}
+
+//run one operation, arg is how many puts this client has done for a put and the file to get into for a get
+//bytes gets how much it moved
+int run_op(client *c, int op, uint64_t *seed, int arg, long long *bytes) {
+	int size = next_rand(seed) % bench.num_sizes;
+	char name[64];
+
+	if(op == OP_PUT_BENCH) {
+		snprintf(name, sizeof(name), "put-%d-%d", c->id, arg % PUT_NAMES);
+		*bytes = bench.sizes[size];
+		return dfc_put(bench.d, name, bench.sources[size]);
+	}
+	if(op == OP_GET_BENCH) {
+		snprintf(name, sizeof(name), "obj-%lld-%d", bench.sizes[size], (int)(next_rand(seed) % bench.objects));
+		*bytes = bench.sizes[size];
+		return dfc_get(bench.d, name, arg);
+	}
+	int files = 0;
+	return dfc_list(bench.d, count_file, &files);
+}
+
+//print count, throughput and latency percentiles for each operation that ran, as a table or as JSON
+void report(client *clients, int num_clients, double elapsed, FILE *out, int json) {
+	if(json) fprintf(out, "{\"seconds\": %.3f, \"clients\": %d, \"ops\": {", elapsed, num_clients);
+	else fprintf(out, "%-5s %9s %7s %10s %10s %9s %9s %9s %9s\n", "op", "count", "errors", "ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+	int first = 1;
+	for(int op = 0; op < NUM_OPS; op++) {
+		long count = 0, errors = 0;
+		long long bytes = 0;
+		for(int i = 0; i < num_clients; i++) {
+			count += clients[i].stats.count[op];
+			errors += clients[i].stats.errors[op];
+			bytes += clients[i].stats.bytes[op];
+		}
+		if(count == 0 && errors == 0) continue;
+
+		//every client's latencies in one sorted list, the percentiles are read straight off it
+		uint64_t *all = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+		if(all == NULL) {
+			perror("malloc for report");
+			return;
+		}
+		long n = 0;
+		for(int i = 0; i < num_clients; i++) {
+			memcpy(all + n, clients[i].stats.lat[op], clients[i].stats.count[op] * sizeof(uint64_t));
+			n += clients[i].stats.count[op];
+		}
+		qsort(all, count, sizeof(uint64_t), cmp_u64);
+		double p50 = count ? all[(count - 1) * 50 / 100] / 1e6 : 0;
+		double p99 = count ? all[(count - 1) * 99 / 100] / 1e6 : 0;
+		double p999 = count ? all[(count - 1) * 999 / 1000] / 1e6 : 0;
+		double max = count ? all[count - 1] / 1e6 : 0;
+		free(all);
+
+		if(json)
+			fprintf(out, "%s\"%s\": {\"count\": %ld, \"errors\": %ld, \"ops_per_sec\": %.2f, \"mb_per_sec\": %.2f, "
+			        "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}",
+			        first ? "" : ", ", op_names[op], count, errors, count / elapsed, bytes / elapsed / 1e6, p50, p99, p999, max);
+		else
+			fprintf(out, "%-5s %9ld %7ld %10.1f %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+			        op_names[op], count, errors, count / elapsed, bytes / elapsed / 1e6, p50, p99, p999, max);
+		first = 0;
+	}
+	if(json) fprintf(out, "}}\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//xorshift64*, every client has its own state
+uint64_t next_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+//a byte count with an optional K, M or G suffix, -1 if it isn't one
+long long parse_size(char *s) {
+	char *end;
+	long long n = strtoll(s, &end, 10);
+
+	if(end == s || n < 0) return -1;
+	if(*end == 'K' || *end == 'k') n <<= 10;
+	else if(*end == 'M' || *end == 'm') n <<= 20;
+	else if(*end == 'G' || *end == 'g') n <<= 30;
+	else if(*end != '\0') return -1;
+	if(*end != '\0' && end[1] != '\0') return -1;
+	return n;
+}
+
+//"put:1,get:4,list:1", operations left out don't run
+int parse_mix(char *mix) {
+	char *copy = strdup(mix), *save;
+	int weights[NUM_OPS] = { 0 }, total = 0;
+
+	if(copy == NULL) return -1;
+	for(char *part = strtok_r(copy, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save)) {
+		char *colon = strchr(part, ':');
+		int op = 0;
+		if(colon != NULL) *colon = '\0';
+		while(op < NUM_OPS && strcmp(part, op_names[op]) != 0) op++;
+		if(colon == NULL || atoi(colon + 1) < 0 || op == NUM_OPS) {
+			free(copy);
+			return -1;
+		}
+		weights[op] = atoi(colon + 1);
+		total += weights[op];
+	}
+	free(copy);
+	if(total == 0) return -1;
+
+	memcpy(bench.weights, weights, sizeof(weights));
+	bench.total_weight = total;
+	return 0;
+}
+
+//"1K,64K,1M,16M"
+int parse_sizes(char *sizes) {
+	char *copy = strdup(sizes), *save;
+	int n = 0;
+
+	if(copy == NULL) return -1;
+	for(char *part = strtok_r(copy, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save)) {
+		long long size = parse_size(part);
+		if(size < 0 || n == MAX_SIZES) {
+			free(copy);
+			return -1;
+		}
+		bench.sizes[n++] = size;
+	}
+	free(copy);
+	if(n == 0) return -1;
+	bench.num_sizes = n;
+	return 0;
+}
+
+//returns -1 if nothing is listening on the port after START_TIMEOUT
+int wait_listening(int port) {
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for(int waited = 0; waited < START_TIMEOUT; waited += 10) {
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if(sock < 0) return -1;
+		int ok = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		close(sock);
+		if(ok) return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+void record(op_stats *s, int op, uint64_t ns, long long bytes) {
+	if(s->count[op] == s->cap[op]) {
+		long cap = s->cap[op] ? 2*s->cap[op] : 1024;
+		uint64_t *grown = realloc(s->lat[op], cap * sizeof(uint64_t));
+		if(grown == NULL) return;
+		s->lat[op] = grown;
+		s->cap[op] = cap;
+	}
+	s->lat[op][s->count[op]++] = ns;
+	s->bytes[op] += bytes;
+}
+
+int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+//list callback, only counts
+void count_file(const char *name, int complete, void *arg) {
+	(void) name;
+	(void) complete;
+	(*(int *)arg)++;
+}
+
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void) st;
+	(void) type;
+	(void) ftw;
+	remove(path);
+	return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+//buffered framing shared by u_dfs and u_dfc
+//commands end in \r\n\r\n, and anything after a command (e.g. the binary chunk header following a put)
+//stays in the buffer for whoever reads next
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "crc32c.h"
+
+#define FRAME_BUFSIZE 65536
+#define FRAME_DELIM "\r\n\r\n"
+#define FRAME_DELIM_LEN 4
+
+//unconsumed bytes live in data[start, end)
+//scanned remembers how far we already searched for a delimiter so partial commands aren't rescanned
+typedef struct {
+	char *data;
+	size_t cap;
+	size_t start, end;
+	size_t scanned;
+} rbuf;
+
+//a complete command inside an rbuf, with the delimiter replaced by '\0'
+//only valid until the next rbuf_fill on the same buffer
+typedef struct {
+	char *ptr;
+	size_t len;
+} frame_view;
+
+static inline int rbuf_init(rbuf *rb, size_t cap) {
+	rb->data = malloc(cap);
+	if(rb->data == NULL) return -1;
+	rb->cap = cap;
+	rb->start = rb->end = rb->scanned = 0;
+	return 0;
+}
+
+static inline void rbuf_free(rbuf *rb) {
+	free(rb->data);
+	rb->data = NULL;
+	rb->cap = rb->start = rb->end = rb->scanned = 0;
+}
+
+static inline size_t rbuf_len(rbuf *rb) {
+	return rb->end - rb->start;
+}
+
+static inline void rbuf_consume(rbuf *rb, size_t n) {
+	rb->start += n;
+	rb->scanned = rb->scanned > n ? rb->scanned - n : 0;
+	if(rb->start == rb->end)
+		rb->start = rb->end = rb->scanned = 0;
+}
+
+//one recv of as much as fits, moving leftover bytes to the front first if needed
+//returns what recv returned, or -1 with errno ENOBUFS if the buffer is already full
+static inline ssize_t rbuf_fill(rbuf *rb, int sock) {
+	if(rb->end == rb->cap && rb->start > 0) {
+		memmove(rb->data, rb->data + rb->start, rb->end - rb->start);
+		rb->end -= rb->start;
+		rb->start = 0;
+	}
+	if(rb->end == rb->cap) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	ssize_t n = recv(sock, rb->data + rb->end, rb->cap - rb->end, 0);
+	if(n > 0) rb->end += n;
+	return n;
+}
+
+//look for a complete command in the buffered bytes
+//memchr does the heavy lifting (it's vectorized in libc), we only compare the full delimiter at each '\r'
+//returns 1 and fills view if found, 0 if more bytes are needed
+static inline int rbuf_frame(rbuf *rb, frame_view *view) {
+	char *base = rb->data + rb->start;
+	size_t len = rb->end - rb->start;
+	size_t pos = rb->scanned;
+
+	while(pos + FRAME_DELIM_LEN <= len) {
+		char *cr = memchr(base + pos, '\r', len - pos - (FRAME_DELIM_LEN - 1));
+		if(cr == NULL) break;
+
+		if(memcmp(cr, FRAME_DELIM, FRAME_DELIM_LEN)==0) {
+			*cr = '\0';
+			view->ptr = base;
+			view->len = cr - base;
+			rbuf_consume(rb, view->len + FRAME_DELIM_LEN);
+			return 1;
+		}
+		pos = cr - base + 1;
+	}
+
+	//the last few bytes could be the start of a delimiter, so resume just before them
+	rb->scanned = len >= FRAME_DELIM_LEN ? len - (FRAME_DELIM_LEN - 1) : 0;
+	return 0;
+}
+
+//pointer to the first unconsumed byte, there are rbuf_len() of them
+static inline char *rbuf_peek(rbuf *rb) {
+	return rb->data + rb->start;
+}
+
+//copy up to n already-buffered bytes into dst, returns how many were copied
+static inline size_t rbuf_take(rbuf *rb, void *dst, size_t n) {
+	size_t have = rbuf_len(rb);
+	if(n > have) n = have;
+	memcpy(dst, rb->data + rb->start, n);
+	rbuf_consume(rb, n);
+	return n;
+}
+
+//blocking helpers for the client side
+
+//receive until a full command is buffered
+//returns 0 on success, 1 if the peer closed, -1 on error or if the command doesn't fit
+static inline int rbuf_read_frame(rbuf *rb, int sock, frame_view *view) {
+	while(!rbuf_frame(rb, view)) {
+		ssize_t n = rbuf_fill(rb, sock);
+		if(n == 0) return 1;
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//receive exactly n bytes into dst, using leftover bytes first
+//big reads bypass the buffer and go straight into dst
+//returns 0 on success, 1 if the peer closed early, -1 on error
+static inline int rbuf_read_exact(rbuf *rb, int sock, void *dst, size_t n) {
+	char *p = dst;
+	size_t got = rbuf_take(rb, p, n);
+
+	while(got < n) {
+		ssize_t r;
+		if(n - got >= rb->cap)
+			r = recv(sock, p + got, n - got, 0);
+		else {
+			r = rbuf_fill(rb, sock);
+			if(r > 0) {
+				got += rbuf_take(rb, p + got, n - got);
+				continue;
+			}
+		}
+
+		if(r == 0) return 1;
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		got += r;
+	}
+	return 0;
+}
+
+//receive exactly n bytes and write them to fd starting at off, using leftover bytes first
+//data only ever passes through the fixed-size buffer, so this works for any n
+//crc (if not NULL) is carried on over the bytes as they go by, see crc32c.h
+//returns 0 on success, 1 if the peer closed early, -1 on a receive error, -2 on a write error
+static inline int rbuf_read_to_fd(rbuf *rb, int sock, int fd, off_t off, long long n, uint32_t *crc) {
+	while(n > 0) {
+		if(rbuf_len(rb) == 0) {
+			ssize_t r = rbuf_fill(rb, sock);
+			if(r == 0) return 1;
+			if(r < 0) {
+				if(errno == EINTR) continue;
+				return -1;
+			}
+		}
+
+		size_t avail = rbuf_len(rb);
+		if((long long) avail > n) avail = n;
+
+		ssize_t w = pwrite(fd, rbuf_peek(rb), avail, off);
+		if(w < 0) {
+			if(errno == EINTR) continue;
+			return -2;
+		}
+		if(crc) *crc = crc32c(*crc, rbuf_peek(rb), w);
+		rbuf_consume(rb, w);
+		off += w;
+		n -= w;
+	}
+	return 0;
+}
+
+#endif
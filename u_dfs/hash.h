@@ -0,0 +1,134 @@
+#ifndef HASH_H
+#define HASH_H
+
+//content hash shared by u_dfs and u_dfc, used to find chunks with the same contents
+//it's the 128 bit MurmurHash3 (x64 variant), which runs at about memory speed
+//a hash can be fed its input in pieces as it arrives, the result is the same however the input is split
+//it isn't cryptographic, it finds accidental duplicates but won't stop a client that wants to collide with another file
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define CHASH_LEN 16
+
+typedef struct {
+	uint64_t h1, h2;
+	uint64_t len;
+	unsigned char tail[16];
+	int tail_len;
+} chash;
+
+#define CHASH_C1 0x87c37b91114253d5ULL
+#define CHASH_C2 0x4cf5ad432745937fULL
+
+static inline uint64_t chash_rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t chash_fmix(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline uint64_t chash_k1(uint64_t k) {
+	return chash_rotl(k * CHASH_C1, 31) * CHASH_C2;
+}
+
+static inline uint64_t chash_k2(uint64_t k) {
+	return chash_rotl(k * CHASH_C2, 33) * CHASH_C1;
+}
+
+static inline void chash_block(chash *h, const unsigned char *p) {
+	uint64_t k1, k2;
+	memcpy(&k1, p, 8);
+	memcpy(&k2, p + 8, 8);
+
+	h->h1 ^= chash_k1(le64toh(k1));
+	h->h1 = (chash_rotl(h->h1, 27) + h->h2) * 5 + 0x52dce729;
+	h->h2 ^= chash_k2(le64toh(k2));
+	h->h2 = (chash_rotl(h->h2, 31) + h->h1) * 5 + 0x38495ab5;
+}
+
+static inline void chash_init(chash *h) {
+	memset(h, 0, sizeof(chash));
+}
+
+static inline void chash_update(chash *h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	h->len += len;
+
+	//finish off a block left partly filled by the last call
+	if(h->tail_len > 0) {
+		size_t n = 16 - h->tail_len;
+		if(n > len) n = len;
+		memcpy(h->tail + h->tail_len, p, n);
+		h->tail_len += n;
+		p += n;
+		len -= n;
+		if(h->tail_len < 16) return;
+		chash_block(h, h->tail);
+		h->tail_len = 0;
+	}
+
+	for(; len >= 16; p += 16, len -= 16)
+		chash_block(h, p);
+
+	memcpy(h->tail, p, len);
+	h->tail_len = len;
+}
+
+static inline void chash_final(chash *h, unsigned char *out) {
+	uint64_t k1 = 0, k2 = 0;
+
+	for(int i = h->tail_len - 1; i >= 8; i--)
+		k2 = (k2 << 8) | h->tail[i];
+	for(int i = (h->tail_len < 8 ? h->tail_len : 8) - 1; i >= 0; i--)
+		k1 = (k1 << 8) | h->tail[i];
+	if(h->tail_len > 8) h->h2 ^= chash_k2(k2);
+	if(h->tail_len > 0) h->h1 ^= chash_k1(k1);
+
+	h->h1 ^= h->len;
+	h->h2 ^= h->len;
+	h->h1 += h->h2;
+	h->h2 += h->h1;
+	h->h1 = chash_fmix(h->h1);
+	h->h2 = chash_fmix(h->h2);
+	h->h1 += h->h2;
+	h->h2 += h->h1;
+
+	uint64_t v1 = htole64(h->h1), v2 = htole64(h->h2);
+	memcpy(out, &v1, 8);
+	memcpy(out + 8, &v2, 8);
+}
+
+//hash len bytes in one go
+static inline void chash_buf(const void *data, size_t len, unsigned char *out) {
+	chash h;
+	chash_init(&h);
+	chash_update(&h, data, len);
+	chash_final(&h, out);
+}
+
+//hex is 2*CHASH_LEN characters and a '\0'
+static inline void chash_hex(const unsigned char *hash, char *hex) {
+	for(int i = 0; i < CHASH_LEN; i++)
+		sprintf(hex + 2*i, "%02x", hash[i]);
+}
+
+//returns -1 if hex isn't 2*CHASH_LEN hex digits
+static inline int chash_parse(const char *hex, unsigned char *hash) {
+	for(int i = 0; i < CHASH_LEN; i++) {
+		unsigned int v;
+		if(sscanf(hex + 2*i, "%2x", &v) != 1) return -1;
+		hash[i] = v;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef LZ_H
+#define LZ_H
+
+//LZ77 block compression shared by u_dfs and u_dfc, used by u_dfc to compress chunks before they're sent and stored
+//the format is LZ4's block format: a run of sequences, each a token byte whose high nibble is the number of literals
+//and low nibble the match length - 4 (15 in either meaning more length bytes follow, each adding up to 255),
+//the literals, then a u16 little-endian offset back into the output where the match is copied from
+//the last sequence is only literals
+//matches are found with a single hash table of 4 byte prefixes, greedily, and compression speeds up
+//over stretches where nothing matches, so contents that don't compress cost little
+//lz_pack decides whether a chunk is worth compressing at all by compressing a sample of it first
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+//the format's rules for where matches stop near the end of the input
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+//chunks smaller than this aren't worth compressing, and bigger ones are judged by this much from their middle
+#define LZ_MIN_INPUT 1024
+#define LZ_SAMPLE 16384
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t lz_read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+//how many bytes at p match the ones at r, stopping at limit
+static inline size_t lz_match_len(const uint8_t *p, const uint8_t *r, const uint8_t *limit) {
+	const uint8_t *start = p;
+
+	//a word at a time, the lowest differing bit says which byte differed
+	while(limit - p >= 8) {
+		uint64_t x = lz_read64(p) ^ lz_read64(r);
+		if(x) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return p - start + (__builtin_ctzll(x) >> 3);
+#else
+			return p - start + (__builtin_clzll(x) >> 3);
+#endif
+		}
+		p += 8;
+		r += 8;
+	}
+	while(p < limit && *p == *r) {
+		p++;
+		r++;
+	}
+	return p - start;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+//write the part of a length that didn't fit in the token, returns NULL if it runs past oend
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, size_t n) {
+	for(; n >= 255; n -= 255) {
+		if(op >= oend) return NULL;
+		*op++ = 255;
+	}
+	if(op >= oend) return NULL;
+	*op++ = n;
+	return op;
+}
+
+//write one sequence, nlit literals then a match of mlen bytes at off (mlen 0 for the last sequence)
+//returns where the next one goes, or NULL if it runs past oend
+static uint8_t *lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit, size_t off, size_t mlen) {
+	if(op >= oend) return NULL;
+	uint8_t *token = op++;
+
+	*token = (nlit >= 15 ? 15 : nlit) << 4;
+	if(nlit >= 15 && (op = lz_put_len(op, oend, nlit - 15)) == NULL) return NULL;
+	if((size_t)(oend - op) < nlit) return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if(mlen == 0) return op;
+
+	if(oend - op < 2) return NULL;
+	op[0] = off;
+	op[1] = off >> 8;
+	op += 2;
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if(mlen >= 15) return lz_put_len(op, oend, mlen - 15);
+	return op;
+}
+
+//compress len bytes of in into at most cap bytes of out
+//returns the compressed length, or 0 if it didn't fit in cap
+static size_t lz_compress(const void *in, size_t len, void *out, size_t cap) {
+	const uint8_t *src = in, *ip = src, *anchor = src, *end = src + len;
+	uint8_t *op = out, *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+
+	if(len > LZ_MATCH_LIMIT) {
+		const uint8_t *mflimit = end - LZ_MATCH_LIMIT, *matchlimit = end - LZ_LAST_LITERALS;
+		unsigned misses = 1 << 6;
+
+		//every slot starts out pointing at the start of the input, which is still a real candidate
+		memset(table, 0, sizeof(table));
+		ip++;
+		while(ip < mflimit) {
+			uint32_t v = lz_read32(ip), h = lz_hash(v);
+			const uint8_t *ref = src + table[h];
+			table[h] = ip - src;
+
+			//the longer we go without a match, the further we step
+			if(ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != v) {
+				ip += misses++ >> 6;
+				continue;
+			}
+			misses = 1 << 6;
+
+			while(ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t *p = ip + LZ_MIN_MATCH;
+			p += lz_match_len(p, ref + LZ_MIN_MATCH, matchlimit);
+
+			op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, p - ip);
+			if(op == NULL) return 0;
+			ip = anchor = p;
+			table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+		}
+	}
+
+	op = lz_sequence(op, oend, anchor, end - anchor, 0, 0);
+	return op ? (size_t)(op - (uint8_t *) out) : 0;
+}
+
+//read the part of a length that didn't fit in the token, returns NULL if it runs past iend
+static const uint8_t *lz_get_len(const uint8_t *ip, const uint8_t *iend, size_t *n) {
+	unsigned b;
+	do {
+		if(ip >= iend) return NULL;
+		b = *ip++;
+		*n += b;
+	} while(b == 255);
+	return ip;
+}
+
+//decompress n bytes of in, which must come to exactly len bytes, into out
+//anything that isn't a valid block is caught before it can write outside out
+//returns -1 if in isn't a valid block of len bytes
+static int lz_decompress(const void *in, size_t n, void *out, size_t len) {
+	const uint8_t *ip = in, *iend = ip + n;
+	uint8_t *op = out, *oend = op + len;
+
+	while(ip < iend) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4, mlen = token & 15;
+
+		//short runs are copied 16 bytes at a time when there's room to spare, the bytes past them are written over later
+		if(nlit == 15 && (ip = lz_get_len(ip, iend, &nlit)) == NULL) return -1;
+		if((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+		if(nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);
+		else
+			memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if(ip == iend) break;
+
+		if(iend - ip < 2) return -1;
+		size_t off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if(mlen == 15 && (ip = lz_get_len(ip, iend, &mlen)) == NULL) return -1;
+		mlen += LZ_MIN_MATCH;
+		if(off == 0 || off > (size_t)(op - (uint8_t *) out) || (size_t)(oend - op) < mlen) return -1;
+
+		//a match can overlap what it's producing, which repeats the last off bytes
+		const uint8_t *m = op - off;
+		if(off >= 16 && (size_t)(oend - op) >= mlen + 16) {
+			for(size_t i = 0; i < mlen; i += 16)
+				memcpy(op + i, m + i, 16);
+		}
+		else if(off >= mlen)
+			memcpy(op, m, mlen);
+		else if(off >= 8) {
+			for(size_t i = 0; i < mlen; i += 8)
+				memcpy(op + i, m + i, mlen - i < 8 ? mlen - i : 8);
+		}
+		else {
+			for(size_t i = 0; i < mlen; i++)
+				op[i] = m[i];
+		}
+		op += mlen;
+	}
+	return op == oend ? 0 : -1;
+}
+
+//compress len bytes of src into dst if that saves at least an eighth of them
+//a chunk whose middle doesn't compress (images, archives, anything already compressed) is left alone without trying the rest
+//dst needs room for len bytes, returns the compressed length or 0 if the chunk should be sent as it is
+static size_t lz_pack(const void *src, size_t len, void *dst) {
+	const uint8_t *p = src;
+
+	if(len < LZ_MIN_INPUT) return 0;
+	if(len > 2*LZ_SAMPLE && lz_compress(p + len/2 - LZ_SAMPLE/2, LZ_SAMPLE, dst, LZ_SAMPLE - LZ_SAMPLE/8) == 0)
+		return 0;
+	return lz_compress(src, len, dst, len - len/8);
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+//binary protocol (v2) shared by u_dfs and u_dfc
+//every message, request or reply, starts with a fixed 16 byte header:
+//
+//	byte 0		PROTO_MAGIC
+//	byte 1		protocol version
+//	byte 2		opcode, a reply carries the opcode of its request
+//	byte 3		status, always 0 in requests
+//	bytes 4-7	request id, chosen by the client and echoed in the reply
+//	bytes 8-15	length of the payload that follows
+//
+//all integers are little-endian no matter what the hosts are
+//"chunks in the file" is a packed count (see count_pack), the server only stores it and hands it back
+//"raw length" is 0 for contents stored as they are, and for contents the client compressed (lz.h) it's their length
+//once decompressed; sizes, crcs and hashes are always of the contents as they're sent and stored
+//"generation" is picked by the client for each put of a file, later puts get bigger ones (0 for none): once a server
+//stores a chunk of a generation, stat and list only show the file's chunks of that generation, chunks of older
+//ones stay until OP_DROP (in case the new chunks are references to their contents), and a chunk of an older
+//generation than the server holds is refused
+//the server tells the protocols apart by the first byte of a connection, PROTO_MAGIC can't start a text command
+//
+//payloads (s = u16 length then that many bytes of string):
+//	OP_HELLO	request and reply empty, the reply's version is what the server speaks
+//	OP_PUT		s name, u32 chunk, u32 chunks in the file, u32 crc32c of the contents, u64 raw length, u64 generation,
+//			then the chunk contents; reply empty, STATUS_BAD_CHECKSUM if the contents that arrived don't match the crc
+//	OP_GET		s name, u32 chunk, and optionally u64 offset and u64 length to only get that part of the contents;
+//			reply is the chunk contents (or the part of them asked for, shorter if the chunk ends first)
+//	OP_STAT		s name; reply is u32 chunks held, u32 chunks in the file (0 if unknown), u64 generation, then for each chunk
+//			u32 chunk, u64 size, u32 crc32c, u32 1 if the server knows the crc (0 for chunks stored without one)
+//			and u64 raw length
+//	OP_LIST		u32 cursor, u32 limit (0 for no limit), s prefix; reply is u32 files, i32 next cursor (-1 at the end),
+//			then for each file s name, u32 chunks in the file, u64 generation, u32 chunks held, and a u32 per chunk held
+//	OP_PUT_BATCH	u32 files, then for each s name, u32 chunk, u32 chunks in the file, u64 size, u32 crc32c, u64 raw length,
+//			u64 generation and the contents;
+//			reply is u32 files that failed, then a u32 position in the batch for each
+//	OP_HAS		u32 count, then count content hashes (see hash.h), at most HAS_MAX; reply is a byte per hash, 1 if the
+//			server holds those contents and a OP_PUT_REF of them will work
+//	OP_PUT_REF	s name, u32 chunk, u32 chunks in the file, content hash, u32 crc32c, u64 raw length, u64 generation;
+//			stores the chunk by pointing it at
+//			contents the server already holds instead of sending them; reply empty, STATUS_NOT_FOUND if it no longer holds them
+//	OP_SCRUB	u32 1 to start checking every chunk the server holds against its crc in the background (unless that's
+//			already running), 0 to only ask how it's going; reply is u32 1 if a scrub is running, u64 chunks checked
+//			and u64 chunks that failed, counting from the start of the current or last scrub; chunks that fail are dropped
+//	OP_STATS	request empty; reply is the server's statistics as text, a line per count or histogram
+//	OP_DROP		s name, u32 chunks in the file, u64 generation; sent once a put is done, drops every chunk the server
+//			holds of older generations of the file, and if the put stored nothing there, it keeps the count and
+//			generation (files it holds nothing of are left alone); reply empty
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define PROTO_MAGIC 0xD5
+//bumped whenever a payload changes, 3 added the crc32c of chunks to the puts and stat, 4 the raw length,
+//5 ranges on get, 6 generations
+#define PROTO_VERSION 6
+#define MSG_HDR_LEN 16
+#define HAS_MAX 128
+
+enum msg_op { OP_HELLO = 1, OP_PUT, OP_GET, OP_STAT, OP_LIST, OP_PUT_BATCH, OP_HAS, OP_PUT_REF, OP_SCRUB, OP_STATS, OP_DROP };
+
+enum msg_status { STATUS_OK = 0, STATUS_NOT_FOUND, STATUS_IO_ERROR, STATUS_BAD_REQUEST, STATUS_UNSUPPORTED, STATUS_BAD_CHECKSUM };
+
+typedef struct {
+	int version;
+	int opcode;
+	int status;
+	uint32_t id;
+	uint64_t length;
+} msg_hdr;
+
+//most chunks a file can have, what fits in the packed count
+#define COUNT_MAX 0xffff
+
+//a file's chunk count as clients send it: the low 16 bits are how many chunks the file has,
+//for an erasure coded file the next 8 are how many Reed-Solomon parity shards (rs.h) each of its stripes has
+//and the top 8 how many data shards, 0 data shards meaning the whole file is one stripe; both are 0 for a replicated file
+static inline uint32_t count_pack(int chunks, int parity, int data) { return (uint32_t) data << 24 | (uint32_t) parity << 16 | chunks; }
+static inline int count_chunks(uint32_t count) { return count & 0xffff; }
+static inline int count_parity(uint32_t count) { return count >> 16 & 0xff; }
+static inline int count_data(uint32_t count) { return count >> 24; }
+
+static inline void put_u16(char *p, uint16_t v) { v = htole16(v); memcpy(p, &v, 2); }
+static inline void put_u32(char *p, uint32_t v) { v = htole32(v); memcpy(p, &v, 4); }
+static inline void put_u64(char *p, uint64_t v) { v = htole64(v); memcpy(p, &v, 8); }
+static inline uint16_t get_u16(const char *p) { uint16_t v; memcpy(&v, p, 2); return le16toh(v); }
+static inline uint32_t get_u32(const char *p) { uint32_t v; memcpy(&v, p, 4); return le32toh(v); }
+static inline uint64_t get_u64(const char *p) { uint64_t v; memcpy(&v, p, 8); return le64toh(v); }
+
+static inline void msg_pack(char *buf, int opcode, int status, uint32_t id, uint64_t length) {
+	buf[0] = (char) PROTO_MAGIC;
+	buf[1] = PROTO_VERSION;
+	buf[2] = opcode;
+	buf[3] = status;
+	put_u32(buf + 4, id);
+	put_u64(buf + 8, length);
+}
+
+//returns -1 if buf doesn't start with a message header
+static inline int msg_unpack(const char *buf, msg_hdr *hdr) {
+	if((unsigned char) buf[0] != PROTO_MAGIC) return -1;
+	hdr->version = (unsigned char) buf[1];
+	hdr->opcode = (unsigned char) buf[2];
+	hdr->status = (unsigned char) buf[3];
+	hdr->id = get_u32(buf + 4);
+	hdr->length = get_u64(buf + 8);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef RS_H
+#define RS_H
+
+//Reed-Solomon erasure coding over GF(2^8), used by u_dfc to store each stripe of a file as k data shards and m parity shards
+//any k of the k+m shards are enough to rebuild the data
+//the code is systematic, so the data shards are just the file cut in k pieces, and the parity shards come from
+//a Cauchy matrix: parity shard i is the sum over j of data shard j times 1/((k+i) ^ j)
+//every k rows of the identity stacked on that matrix are invertible, which is what makes any k shards enough
+//
+//multiplying a region by a constant is the inner loop of encoding and decoding, it looks the low and high nibble
+//of 16 or 32 bytes at a time up in two 16 entry product tables with a byte shuffle (SSSE3 or AVX2),
+//machines without those use a 64K table of every product
+//call rs_init once before anything else
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RS_X86 1
+#endif
+
+//shard numbers have to be distinct field elements
+#define RS_MAX_SHARDS 256
+
+//encoding works through the shards this many bytes at a time, so a block of every shard stays in cache
+#define RS_BLOCK 16384
+
+static uint8_t rs_exp[512];
+static uint8_t rs_log[256];
+static uint8_t rs_mul_tab[256][256];
+
+//lo[c][x] and hi[c][x] are c times x and c times x << 4, what the shuffle kernels look nibbles up in
+static uint8_t rs_lo[256][16] __attribute__((aligned(16)));
+static uint8_t rs_hi[256][16] __attribute__((aligned(16)));
+
+static void (*rs_region)(uint8_t*, const uint8_t*, size_t, uint8_t, int);
+static pthread_once_t rs_once = PTHREAD_ONCE_INIT;
+
+static inline uint8_t rs_mul(uint8_t a, uint8_t b) {
+	return rs_mul_tab[a][b];
+}
+
+static inline uint8_t rs_inv(uint8_t a) {
+	return rs_exp[255 - rs_log[a]];
+}
+
+//dst = c * src, or dst ^= c * src with add set
+static void rs_region_scalar(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c, int add) {
+	const uint8_t *row = rs_mul_tab[c];
+
+	if(add)
+		for(size_t i = 0; i < len; i++) dst[i] ^= row[src[i]];
+	else
+		for(size_t i = 0; i < len; i++) dst[i] = row[src[i]];
+}
+
+#ifdef RS_X86
+__attribute__((target("ssse3")))
+static void rs_region_ssse3(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c, int add) {
+	__m128i lo = _mm_load_si128((const __m128i *) rs_lo[c]);
+	__m128i hi = _mm_load_si128((const __m128i *) rs_hi[c]);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, mask)),
+		                          _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+		if(add) p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+	rs_region_scalar(dst + i, src + i, len - i, c, add);
+}
+
+//the shuffle only looks within each 128 bit lane, so both lanes get a copy of the tables
+__attribute__((target("avx2")))
+static void rs_region_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint8_t c, int add) {
+	__m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) rs_lo[c]));
+	__m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) rs_hi[c]));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, mask)),
+		                             _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+		if(add) p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), p);
+	}
+	rs_region_scalar(dst + i, src + i, len - i, c, add);
+}
+#endif
+
+//build the tables for the field with polynomial x^8 + x^4 + x^3 + x^2 + 1 and pick the fastest kernel we can run
+static void rs_setup(void) {
+	int x = 1;
+
+	for(int i = 0; i < 255; i++) {
+		rs_exp[i] = rs_exp[i + 255] = x;
+		rs_log[x] = i;
+		x <<= 1;
+		if(x & 0x100) x ^= 0x11d;
+	}
+	for(int a = 0; a < 256; a++)
+		for(int b = 0; b < 256; b++)
+			rs_mul_tab[a][b] = a && b ? rs_exp[rs_log[a] + rs_log[b]] : 0;
+	for(int c = 0; c < 256; c++) {
+		for(int n = 0; n < 16; n++) {
+			rs_lo[c][n] = rs_mul_tab[c][n];
+			rs_hi[c][n] = rs_mul_tab[c][n << 4];
+		}
+	}
+
+	rs_region = rs_region_scalar;
+#ifdef RS_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) rs_region = rs_region_avx2;
+	else if(__builtin_cpu_supports("ssse3")) rs_region = rs_region_ssse3;
+#endif
+}
+
+static inline void rs_init(void) {
+	pthread_once(&rs_once, rs_setup);
+}
+
+//coefficient of data shard j in parity shard i
+static inline uint8_t rs_coef(int k, int i, int j) {
+	return rs_inv((k + i) ^ j);
+}
+
+//compute m parity shards of len bytes each from k data shards
+//data[j] holds data_len[j] <= len bytes, anything past that counts as zeros
+static void rs_encode(int k, int m, uint8_t **data, const size_t *data_len, uint8_t **parity, size_t len) {
+	for(size_t off = 0; off < len; off += RS_BLOCK) {
+		size_t block = len - off < RS_BLOCK ? len - off : RS_BLOCK;
+
+		for(int i = 0; i < m; i++) {
+			memset(parity[i] + off, 0, block);
+			for(int j = 0; j < k; j++) {
+				if(data_len[j] <= off) continue;
+				size_t n = data_len[j] - off < block ? data_len[j] - off : block;
+				rs_region(parity[i] + off, data[j] + off, n, rs_coef(k, i, j), 1);
+			}
+		}
+	}
+}
+
+//invert the n by n matrix a into inv with Gauss-Jordan elimination, a is destroyed
+//returns -1 if it's singular
+static int rs_invert(int n, uint8_t *a, uint8_t *inv) {
+	memset(inv, 0, n * n);
+	for(int i = 0; i < n; i++) inv[i*n + i] = 1;
+
+	for(int col = 0; col < n; col++) {
+		int pivot = col;
+		while(pivot < n && a[pivot*n + col] == 0) pivot++;
+		if(pivot == n) return -1;
+
+		if(pivot != col) {
+			for(int j = 0; j < n; j++) {
+				uint8_t t = a[col*n + j]; a[col*n + j] = a[pivot*n + j]; a[pivot*n + j] = t;
+				t = inv[col*n + j]; inv[col*n + j] = inv[pivot*n + j]; inv[pivot*n + j] = t;
+			}
+		}
+
+		uint8_t scale = rs_inv(a[col*n + col]);
+		for(int j = 0; j < n; j++) {
+			a[col*n + j] = rs_mul(a[col*n + j], scale);
+			inv[col*n + j] = rs_mul(inv[col*n + j], scale);
+		}
+
+		for(int row = 0; row < n; row++) {
+			uint8_t f = a[row*n + col];
+			if(row == col || f == 0) continue;
+			for(int j = 0; j < n; j++) {
+				a[row*n + j] ^= rs_mul(f, a[col*n + j]);
+				inv[row*n + j] ^= rs_mul(f, inv[col*n + j]);
+			}
+		}
+	}
+	return 0;
+}
+
+//rebuild every data shard that isn't among the k shard numbers in have
+//shards[s] points at len bytes for every shard s, the contents of the ones in have and room for the missing data shards
+//returns -1 if have doesn't name k different shards
+static int rs_decode(int k, int m, uint8_t **shards, const int *have, size_t len) {
+	uint8_t a[k * k], inv[k * k];
+	char present[k + m];
+
+	memset(present, 0, k + m);
+	for(int r = 0; r < k; r++) {
+		if(have[r] < 0 || have[r] >= k + m || present[have[r]]) return -1;
+		present[have[r]] = 1;
+
+		//the row of the coding matrix that produced shard have[r]
+		for(int j = 0; j < k; j++)
+			a[r*k + j] = have[r] < k ? have[r] == j : rs_coef(k, have[r] - k, j);
+	}
+	if(rs_invert(k, a, inv) < 0) return -1;
+
+	for(int d = 0; d < k; d++) {
+		if(present[d]) continue;
+		for(size_t off = 0; off < len; off += RS_BLOCK) {
+			size_t block = len - off < RS_BLOCK ? len - off : RS_BLOCK;
+			for(int r = 0; r < k; r++)
+				rs_region(shards[d] + off, shards[have[r]] + off, block, inv[d*k + r], r > 0);
+		}
+	}
+	return 0;
+}
+
+#endif
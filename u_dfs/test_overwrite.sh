@@ -0,0 +1,88 @@
+#!/bin/sh
+#overwriting a file with a smaller one has to leave nothing of the old one behind on any server
+#starts four u_dfs on loopback (with and without -s), puts a big file, then a small one under the same name,
+#and checks get hands back the small one and list calls it complete, for every way a put can go out
+#run from this directory: sh test_overwrite.sh
+
+set -e
+dir=$(mktemp -d)
+pids=""
+trap 'kill $pids 2>/dev/null || true; rm -rf "$dir"' EXIT
+
+gcc -O2 -pthread -o "$dir/u_dfs" u_dfs.c
+gcc -O2 -pthread -o "$dir/u_dfc" u_dfc.c dfc.c
+
+start() {
+	pids=""
+	for i in 1 2 3 4; do
+		mkdir -p "$dir/dfs$i"
+		"$dir/u_dfs" "$dir/dfs$i" $((21100 + i)) $1 > "$dir/srv$i.log" 2>&1 &
+		pids="$pids $!"
+	done
+	sleep 1
+}
+
+stop() {
+	kill $pids 2>/dev/null
+	wait $pids 2>/dev/null || true
+}
+
+#conf lines for the case, then the sizes of the big and small file
+check() {
+	printf 'server dfs1 127.0.0.1:21101\nserver dfs2 127.0.0.1:21102\nserver dfs3 127.0.0.1:21103\nserver dfs4 127.0.0.1:21104\n%b' "$1" > "$dir/dfc.conf"
+	mkdir -p "$dir/in" "$dir/out"
+	head -c "$2" /dev/urandom > "$dir/in/f"
+	(cd "$dir/in" && HOME="$dir" "$dir/u_dfc" put f)
+	head -c "$3" /dev/urandom > "$dir/in/f"
+	(cd "$dir/in" && HOME="$dir" "$dir/u_dfc" put f)
+	(cd "$dir/out" && HOME="$dir" "$dir/u_dfc" get f)
+	cmp "$dir/in/f" "$dir/out/f" || { echo "FAIL get after overwrite: $1 $2 -> $3"; exit 1; }
+	HOME="$dir" "$dir/u_dfc" list | grep -qx f || { echo "FAIL list after overwrite: $1 $2 -> $3"; exit 1; }
+}
+
+for flags in "" "-s"; do
+	start "$flags"
+	#striped then whole, striped in blocks then fewer blocks, erasure coded then whole, then fewer shards
+	#and then fewer stripes
+	check "" 2000000 12
+	check "block 65536\n" 2000000 300000
+	check "erasure 2 1\n" 2000000 12
+	check "erasure 2 1\nblock 0\n" 2000000 100000
+	check "erasure 2 1\nblock 65536\n" 2000000 300000
+
+	#a batched put of the small file, then gets after the servers replayed their journals and rescanned their storage
+	#z is all zeros, so its chunks are stored once and linked to from every chunk
+	printf 'server dfs1 127.0.0.1:21101\nserver dfs2 127.0.0.1:21102\nserver dfs3 127.0.0.1:21103\nserver dfs4 127.0.0.1:21104\n' > "$dir/dfc.conf"
+	head -c 2000000 /dev/urandom > "$dir/in/g"
+	head -c 300000 /dev/zero > "$dir/in/z"
+	(cd "$dir/in" && HOME="$dir" "$dir/u_dfc" put g z)
+	echo "hello small" > "$dir/in/g"
+	echo "other small" > "$dir/in/h"
+	(cd "$dir/in" && HOME="$dir" "$dir/u_dfc" put g h)
+	stop
+	start "$flags"
+	(cd "$dir/out" && HOME="$dir" "$dir/u_dfc" get g)
+	cmp "$dir/in/g" "$dir/out/g" || { echo "FAIL batched overwrite $flags"; exit 1; }
+
+	#the servers that got none of the small g still know its generation after loading the index that replay wrote
+	stop
+	start "$flags"
+	cat "$dir"/dfs*/.index | grep -q '^d [0-9]* [0-9]* g$' || { echo "FAIL generation forgotten after restart $flags"; exit 1; }
+	stop
+	start "$flags -r"
+	rm -f "$dir/out/g"
+	(cd "$dir/out" && HOME="$dir" "$dir/u_dfc" get g)
+	cmp "$dir/in/g" "$dir/out/g" || { echo "FAIL batched overwrite after rescan $flags"; exit 1; }
+
+	#and again once they loaded the index the rescan wrote
+	stop
+	start "$flags"
+	rm -f "$dir/out/g"
+	(cd "$dir/out" && HOME="$dir" "$dir/u_dfc" get g z)
+	cmp "$dir/in/g" "$dir/out/g" || { echo "FAIL batched overwrite after restart from rescan $flags"; exit 1; }
+	cmp "$dir/in/z" "$dir/out/z" || { echo "FAIL linked chunks after restart from rescan $flags"; exit 1; }
+	HOME="$dir" "$dir/u_dfc" list | grep -qx z || { echo "FAIL list after restart from rescan $flags"; exit 1; }
+	stop
+	rm -rf "$dir"/dfs*
+done
+echo "ok"
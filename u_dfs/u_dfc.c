@@ -5,492 +5,467 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <dirent.h>
-#include <sys/time.h>
+#include <sys/un.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
-#define BUFSIZE 4096
+#include "dfc.h"
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-//helper function for writing to socket
-int socket_write(int sock, char *message, int stream_size) {
-	int bytes_written, unsent_bytes, new_bytes_written;
-	
-	bytes_written = write(sock, message, stream_size);
-	if(bytes_written < 0) return -1;
-	unsent_bytes = stream_size - bytes_written;
-	
-	while(unsent_bytes > 0) {
-		new_bytes_written = write(sock, message+bytes_written, unsent_bytes);
-		if(new_bytes_written < 0) return -1;
-		
-		bytes_written += new_bytes_written;
-		unsent_bytes = stream_size - bytes_written;
-	}
-	return 0;
-}
+//command line front end to the dfc library, build with dfc.c: gcc -pthread u_dfc.c dfc.c -o u_dfc
+//"u_dfc agent" stays running with pooled connections to every server and does the work for other u_dfc runs,
+//which hand it their files over a unix socket in $HOME
+//without an agent, u_dfc opens its own connections like it always has
+//"u_dfc get <file> <offset> <length>" writes just that range of the file to stdout
+//"u_dfc --trace <trace file> <command> ..." records where the time goes as Chrome trace event JSON (see dfc_trace_start),
+//it always connects itself, since with an agent the work would happen in the agent
 
-//hash function (used this in proxy and didn't wanna add any more dependencies)
-unsigned long fileHash(char *str) {
-    unsigned long hash = 5381;
-    int c;
+#define BUFSIZE 4096
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
+//where the agent listens, relative to $HOME
+#define AGENT_SOCKET ".dfc-agent.sock"
 
-    return hash;
-}
+//put hands files over this many at a time (an agent request can carry at most 253 fds),
+//with at most AGENT_REQUEST bytes of filenames
+#define PUT_GROUP 128
+#define AGENT_REQUEST 65536
+
+//the agent's connection pools, shared by every client it serves
+dfc *pool;
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 //functionality functions
-void list(int[], int);
-void put(int[], char*);
-void put_chunk(int, char*, int, int, char*);
-void get(int[], char*);
+int run(dfc*, int, char*, char*, int);
+int put_group(dfc*, int, char**, int);
+int get_range(dfc*, int, char*, char*, char*);
+int run_put_many(dfc*, int, char**, int*, int*, int);
+int agent(void);
+void *agent_client(void*);
+void print_file(const char*, int, void*);
+void print_scrub(const char*, int, unsigned long long, unsigned long long, void*);
+void print_stats(const char*, const char*, void*);
 
 //helper functions
-int read_conf_file(int[]);
-int connect_to_host(int*, char*);
-int recv_line(int, char*);
-void rmdir_rec(char*);
-int get_file_size(FILE*);
+int agent_path(struct sockaddr_un*);
+int agent_connect(void);
+int is_number(const char*);
+int send_request(int, char*, int, int*, int);
+int recv_request(int, char*, int, int*, int*);
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv) {
+	char *trace = NULL;
+
+	if(argc >= 3 && strcmp(argv[1], "--trace")==0) {
+		trace = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
 	if(argc < 2) {
-		printf("Usage: %s <command> [filename] ... [filename]\n", argv[0]);
+		printf("Usage: %s [--trace <trace file>] <command> [filename] ... [filename]\n", argv[0]);
 		exit(-1);
 	}
-	int dfs[4];
-	
-	if(read_conf_file(dfs)==-1) {
-		printf("Bad configuration file\n");
-		exit(-1);	
+
+	if(strcmp(argv[1], "agent")==0)
+		return agent();
+	if(trace != NULL && dfc_trace_start(trace) < 0) {
+		printf("Can't trace to %s\n", trace);
+		exit(-1);
+	}
+
+	//use the agent's warm connections if one is running, otherwise connect ourselves
+	dfc *d = NULL;
+	int sock = trace == NULL ? agent_connect() : -1;
+	if(sock < 0) {
+		d = dfc_open(NULL);
+		if(d == NULL) {
+			printf("Bad configuration file\n");
+			exit(-1);
+		}
+	}
+
+	if(strcmp(argv[1], "list")==0) {
+		//the list is written straight to our stdout, so nothing we've buffered can end up after it
+		fflush(stdout);
+		run(d, sock, "list", "", STDOUT_FILENO);
+	}
+	if(strcmp(argv[1], "scrub")==0) {
+		fflush(stdout);
+		run(d, sock, "scrub", "", STDOUT_FILENO);
+	}
+	if(strcmp(argv[1], "stats")==0) {
+		fflush(stdout);
+		run(d, sock, "stats", "", STDOUT_FILENO);
 	}
-	
-	//for put and get, must let server know we're done when we finish our commands, hence the second loop
-	if(strcmp(argv[1], "list")==0) list(dfs, 4);
 	if(strcmp(argv[1], "put")==0) {
-		for(int i=2; i < argc; i++)
-			put(dfs, argv[i]);
-		for(int i=0; i < 4; i++)
-			if(dfs[i]!=-1)
-				socket_write(dfs[i], "exit\r\n\r\n", 8);
+		for(int i=2; i < argc; )
+			i += put_group(d, sock, argv + i, argc - i);
 	}
-	if(strcmp(argv[1], "get")==0) {
-		for(int i=2; i < argc; i++)
-			get(dfs, argv[i]);
-		for(int i=0; i < 4; i++)
-			if(dfs[i]!=-1)
-				socket_write(dfs[i], "exit\r\n\r\n", 8);
+	if(strcmp(argv[1], "get")==0 && argc == 5 && is_number(argv[3]) && is_number(argv[4])) {
+		if(get_range(d, sock, argv[2], argv[3], argv[4]) < 0)
+			fprintf(stderr, "%s range get failed\n", argv[2]);
 	}
-}
+	else if(strcmp(argv[1], "get")==0) {
+		for(int i=2; i < argc; i++) {
+			//rebuild into a temporary file, so a failed get doesn't clobber a local copy
+			char tmp[strlen(argv[i]) + 10];
+			sprintf(tmp, "%s.part", argv[i]);
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			long long start = dfc_trace_now();
+			int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+			if(fd < 0) perror("opening reconstructed file");
 
-//assuming a maximum of 512 files
-//currently not enforced
-void list(int dfs[], int num_serv) {
-	//files is a hashmap, file[hash] contains the filename, where hash is the hash value of the filename
-	//if two files hash to the same name, we just move the file to the next available index and check
-	//we have correct filename every time we reference the files array
-	
-	//chunks uses the file hash to determine which chunks it has
-	int chunks[512][num_serv];
-	char files[512][512];
-	
-	memset(files, 0, 512*512);
-	memset(chunks, 0, 512*num_serv);
-
-	//for each server, get a list of filenames and associated chunks
-	for(int i=0; i<num_serv; i++) {
-		//if server was never connected, ignore
-		if(dfs[i] == -1) continue;
-		
-		int lines;
-		
-		socket_write(dfs[i], "list\r\n\r\n", 8);
-		if(recv(dfs[i], &lines, sizeof(int), 0) < (ssize_t) sizeof(int))
-			continue;
-		
-		char buffer[BUFSIZE];
-		
-		for(int j=0; j<lines; j++) {
-			bzero(buffer, BUFSIZE);
-			
-			if(recv_line(dfs[i], buffer)!=0) break;
-			
-			char *filename;
-			int chunk1, chunk2;
-			
-			filename = strtok(buffer, " ");
-			chunk1 = atoi(strtok(NULL, " "));
-			chunk2 = atoi(strtok(NULL, " "));
-			
-			//add file information to file and chunk hashmaps
-			int fh = fileHash(filename) % 512;
-			int f_in = fh;
-			while(files[f_in][0]!=0 && strcmp(files[f_in], filename)!=0)
-				f_in++;
-			if(files[f_in][0]==0) {
-				strcpy(files[f_in], filename);
-				chunks[f_in][chunk1] = 1;
-				chunks[f_in][chunk2] = 1;
-			} else {
-				chunks[f_in][chunk1] = 1;
-				chunks[f_in][chunk2] = 1;
+			int ok = fd >= 0 && run(d, sock, "get", argv[i], fd) == 0;
+			dfc_trace_span("get", argv[i], start);
+
+			//the chunks are already in place, so all that's left of putting the file together is closing and renaming it
+			start = dfc_trace_now();
+			if(fd >= 0) close(fd);
+			if(ok && rename(tmp, argv[i]) < 0) {
+				perror("renaming reconstructed file");
+				ok = 0;
 			}
-		}
-		
-		socket_write(dfs[i], "exit\r\n\r\n", 8);
-	}
-	
-	//list files and determine whether or not they are constructible
-	for(int i = 0; i < 512; i++) {
-		if(files[i][0]!=0) {
-			int all_chunks = 1;
-			for(int j=0; j<num_serv; j++) {
-				if(chunks[i][j]==0)
-					all_chunks = 0;
+			dfc_trace_span("merge", argv[i], start);
+			if(!ok) {
+				printf("%s is incomplete\n", argv[i]);
+				if(fd >= 0) unlink(tmp);
 			}
-			
-			if(all_chunks)
-				printf("%s\n", files[i]);
-			else
-				printf("%s [incomplete]\n", files[i]);
 		}
 	}
+
+	if(d != NULL) dfc_close(d);
+	else close(sock);
+	if(trace != NULL) dfc_trace_stop();
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//put as many of the files as fit in one group, so the small ones can be batched
+//returns how many files it took
+int put_group(dfc *d, int sock, char **names, int n) {
+	char *group[PUT_GROUP];
+	int fds[PUT_GROUP], status[PUT_GROUP];
+	int count = 0, taken = 0, bytes = 0;
 
-void get(int dfs[], char *filename) {
-	char file_dir[strlen(filename)+10];
-	char file_path[strlen(filename)+20];
-	int chunk, chunk_size, max_chunk_size = 0;
-	int chunks_recvd[4] = {0,0,0,0};
-	int construct = 1;
-	char chunk_toa[3];
-	FILE *fp, *chp;
-	int bytes_recvd = 0;
-	
-	//store file chunks in directory sharing name of file
-	strcpy(file_dir, "./");
-	strcat(file_dir, filename);
-	strcat(file_dir, ".dir");
-	
-	//if file directory doesn't exist, make it
-	mkdir(file_dir, 0700);
-	
-	//loop through each server
-	for(int i=0; i<4; i++) {
-		if(dfs[i]==-1) continue;
-		
-		construct = 1;
-		
-		socket_write(dfs[i], "get ", 4);
-		socket_write(dfs[i], filename, strlen(filename));
-		socket_write(dfs[i], "\r\n\r\n", 4);
-		
-		for(int j=0; j<2; j++){
-			bytes_recvd = 0;
-			
-			if(recv(dfs[i], &chunk, sizeof(int), 0) < (ssize_t) sizeof(int))
-				perror("receiving chunk filename");
-			if(chunk==-1) {
-				//server might have sent sentinel to let us know it doesn't have the file
-				printf("%s is incomplete\n", filename);
-				rmdir_rec(file_dir);
-				return;
-			}
-			
-			if(recv(dfs[i], &chunk_size, sizeof(int), 0) < (ssize_t) sizeof(int))
-				perror("receiving filesize");
-			if(chunk_size > max_chunk_size) 
-				max_chunk_size = chunk_size;
-		
-			char contents[chunk_size];
-			bzero(chunk_toa, 3);
-			sprintf(chunk_toa, "%d", chunk);
-	
-			bzero(file_path, strlen(filename) + 5);
-			strcpy(file_path, file_dir);
-			strcat(file_path, "/");
-			strcat(file_path, chunk_toa);
-			
-			//hacky way to make sure all bytes of file are received
-			while((bytes_recvd += recv(dfs[i], contents + bytes_recvd, chunk_size - bytes_recvd, 0)) < chunk_size);
-	
-			//create temp files to hold chunk info
-			fp = fopen(file_path, "w");
-			
-			fwrite(contents, chunk_size, 1, fp);
-	
-			fclose(fp);
-			
-			chunks_recvd[chunk] = 1;
+	while(taken < n && count < PUT_GROUP && bytes + strlen(names[taken]) + 1 < AGENT_REQUEST - 16) {
+		int fd = open(names[taken], O_RDONLY);
+		if(fd < 0)
+			printf("%s put failed\n", names[taken]);
+		else {
+			group[count] = names[taken];
+			fds[count++] = fd;
+			bytes += strlen(names[taken]) + 1;
 		}
-		
-		for(int j=0; j<4; j++)
-			if(chunks_recvd[j]==0)
-				construct = 0;
-				
-		if(construct==1) break;
+		taken++;
 	}
-	
-	if(construct==0) {
-		printf("%s is incomplete\n", filename);
-		rmdir_rec(file_dir);
-		
-		return;
+
+	//a name too long to go in any request still gets reported instead of stopping us forever
+	if(taken == 0) {
+		printf("%s put failed\n", names[0]);
+		return 1;
 	}
-	
-	//fp now contains the main file
-	fp = fopen(filename, "w");
-	
-	for(int i=0; i<4; i++) {
-		char chunk_toa[3];
-		bzero(chunk_toa, 3);
-		sprintf(chunk_toa, "%d", i);
-		
-		//file_path will get the path for each chunk
-		bzero(file_path, strlen(filename) + 20);
-		strcpy(file_path, file_dir);
-		strcat(file_path, "/");
-		strcat(file_path, chunk_toa);
-		
-		chp = fopen(file_path, "r");
-		chunk_size = get_file_size(chp);
-		
-		char contents[chunk_size];
-		if(fread(contents, chunk_size, 1, chp) < 1) 
-			perror("reading local chunk file");
-		if(fwrite(contents, chunk_size, 1, fp) < 1)
-			perror("writing to reconstructed file");
-		fclose(chp);
+
+	long long start = dfc_trace_now();
+	if(count > 0 && run_put_many(d, sock, group, fds, status, count) < 0)
+		for(int i = 0; i < count; i++) status[i] = -1;
+	for(int i = 0; i < count; i++) {
+		if(status[i] < 0) printf("%s put failed\n", group[i]);
+		close(fds[i]);
 	}
-	
-	fclose(fp);
-	
-	rmdir_rec(file_dir);
+	dfc_trace_span("put", count == 1 ? group[0] : "group", start);
+	return taken;
 }
 
-//removes temporary directory for storing file chunk data
-void rmdir_rec(char *file_dir) {
-	struct dirent *d;
-	DIR *dh;	
-	dh = opendir(file_dir);
-	if(!dh) perror("opening directory");
-	
-	//for each element in current directory, add to buffer in a line
-	//skip '.' and '..', as well as the server binary listing
-	while((d = readdir(dh)) != NULL) {
-		if(d->d_name[0] == '.') continue;
-		char file_name[strlen(file_dir) + 10];
-		strcpy(file_name, file_dir);
-		strcat(file_name, "/");
-		strcat(file_name, d->d_name);
-		
-		if(remove(file_name) < 0)
-			perror("removing chunk");
+//get length bytes of name from offset and write them to stdout
+//they're rebuilt in a temporary file first, since chunks arrive out of order and land at their offsets
+int get_range(dfc *d, int sock, char *name, char *offset, char *length) {
+	char request[BUFSIZE];
+	char buf[BUFSIZE];
+	ssize_t n;
+	int ret = 0;
+
+	if(snprintf(request, BUFSIZE, "%s %s %s", offset, length, name) >= BUFSIZE) return -1;
+
+	FILE *tmp = tmpfile();
+	if(tmp == NULL) {
+		perror("opening temporary file");
+		return -1;
 	}
-	
-	if(rmdir(file_dir) < 0)
-		perror("removing temp directory");
-}
+	int fd = fileno(tmp);
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	long long start = dfc_trace_now();
+	if(run(d, sock, "getrange", request, fd) != 0) ret = -1;
+	dfc_trace_span("get", name, start);
 
-void put(int dfs[], char *filename) {
-	FILE *fp = fopen(filename, "r");
-	int invalid_flag = 0;
-	int hash_bucket, index;
-	
-	//make sure file exists and we're connected to all 4 servers
-	if(fp==NULL)
-		invalid_flag = 1;
-
-	for(int i = 0; i<4; i++) {
-		if(dfs[i] == -1)
-			invalid_flag = 1;
+	start = dfc_trace_now();
+	fflush(stdout);
+	lseek(fd, 0, SEEK_SET);
+	while(ret == 0 && (n = read(fd, buf, BUFSIZE)) > 0) {
+		if(write(STDOUT_FILENO, buf, n) != n) {
+			perror("writing range");
+			ret = -1;
+		}
 	}
-	
-	if(invalid_flag==1) {
-		printf("%s put failed\n", filename);
-		if(fp!=NULL)
-			fclose(fp);
-		return;
+	dfc_trace_span("merge", name, start);
+	fclose(tmp);
+	return ret;
+}
+
+//put a group of files, through the agent on sock if d is NULL
+//the agent request is "putmany" and the filenames, each ending in '\0', with the files attached in the same order
+//it answers with an int status per file
+int run_put_many(dfc *d, int sock, char **names, int *fds, int *status, int n) {
+	if(d != NULL) {
+		dfc_put_many(d, n, (const char **) names, fds, status);
+		return 0;
 	}
 
-	int file_size, chunk_size, offset_chunks;
-	
-	file_size = get_file_size(fp);
-	chunk_size = file_size/4 + 1;
-	offset_chunks = file_size % 4;
-	
-	char chunks[4][chunk_size + 1];
-	
-	//make sure we read proper number of bytes if not perfectly divisible by 4
-	for(int i = 0; i < 4; i++) {
-		if(i < offset_chunks) {
-			if(fread(chunks[i], chunk_size, 1, fp) < 1)
-				perror("reading into chunk");
-		}
-		else
-			if(fread(chunks[i], chunk_size - 1, 1, fp) < 1)
-				perror("reading into chunk");
+	char request[AGENT_REQUEST];
+	int len = sprintf(request, "putmany ");
+	for(int i = 0; i < n; i++)
+		len += sprintf(request + len, "%s", names[i]) + 1;
+
+	if(send_request(sock, request, len, fds, n) < 0 ||
+	   recv(sock, status, n * sizeof(int), MSG_WAITALL) != (ssize_t)(n * sizeof(int)))
+		return -1;
+	return 0;
+}
+
+//do one operation, through the agent on sock if d is NULL
+//fd is the file being put, the file to get into, or where to write the list (or scrub or stats report)
+int run(dfc *d, int sock, char *op, char *name, int fd) {
+	if(d == NULL) {
+		char request[BUFSIZE];
+		int status;
+
+		int len = snprintf(request, BUFSIZE, "%s %s", op, name);
+		if(len >= BUFSIZE || send_request(sock, request, len, &fd, 1) < 0 ||
+		   recv(sock, &status, sizeof(int), 0) != sizeof(int))
+			return -1;
+		return status;
 	}
-	
-	fclose(fp);
-	
-	//hash_bucket will tell us which servers get which chunks
-	hash_bucket = fileHash(filename) % 4;
-	for(int i = 0; i < 4; i++) {
-		index = (i + hash_bucket) % 4;
-		
-		if(i < offset_chunks) {
-		
-			put_chunk(dfs[index], filename, i, chunk_size, chunks[i]);
-			put_chunk(dfs[(index+3)%4], filename, i, chunk_size, chunks[i]);
-			
-		} else {
-		
-			int chunk_minus_one = chunk_size - 1;
-			put_chunk(dfs[index], filename, i, chunk_minus_one, chunks[i]);
-			put_chunk(dfs[(index+3)%4], filename, i, chunk_minus_one, chunks[i]);
-			
-		}
+
+	if(strcmp(op, "put")==0) return dfc_put(d, name, fd);
+	if(strcmp(op, "get")==0) return dfc_get(d, name, fd);
+	if(strcmp(op, "getrange")==0) {
+		//name is "<offset> <length> <filename>"
+		long long offset, length;
+		int skip = 0;
+		if(sscanf(name, "%lld %lld %n", &offset, &length, &skip) != 2 || skip == 0) return -1;
+		return dfc_get_range(d, name + skip, offset, length, fd);
 	}
+	if(strcmp(op, "scrub")==0) return dfc_scrub(d, print_scrub, &fd);
+	if(strcmp(op, "stats")==0) return dfc_stats(d, print_stats, &fd);
+	return dfc_list(d, print_file, &fd);
 }
 
-//send individual chunks to socket given by sock
-void put_chunk(int sock, char *filename, int chunk, int chunk_size, char *contents) {
-	socket_write(sock, "put ", 4);
-	socket_write(sock, filename, strlen(filename));
-	socket_write(sock, "\r\n\r\n", 4);
-	socket_write(sock, (char *)&chunk, sizeof(int));
-	socket_write(sock, (char *)&chunk_size, sizeof(int));
-	socket_write(sock, contents, chunk_size);
+//list callback, arg points at the fd to write to
+void print_file(const char *name, int complete, void *arg) {
+	int fd = *(int *)arg;
+
+	if(complete)
+		dprintf(fd, "%s\n", name);
+	else
+		dprintf(fd, "%s [incomplete]\n", name);
 }
 
-int get_file_size(FILE *fp) {
-	int retval;
-	
-	fseek(fp, 0, SEEK_END);
-	retval = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	
-	return retval;
+//scrub callback, arg points at the fd to write to
+void print_scrub(const char *server, int reached, unsigned long long checked, unsigned long long failed, void *arg) {
+	int fd = *(int *)arg;
+
+	if(!reached)
+		dprintf(fd, "%s unreachable\n", server);
+	else
+		dprintf(fd, "%s: %llu chunks checked, %llu failed\n", server, checked, failed);
+}
+
+//stats callback, arg points at the fd to write to
+void print_stats(const char *server, const char *report, void *arg) {
+	int fd = *(int *)arg;
+
+	if(report == NULL)
+		dprintf(fd, "%s unreachable\n", server);
+	else
+		dprintf(fd, "%s:\n%s", server, report);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-//reads configuration file
-//if errors, return -1
-int read_conf_file(int dfs[]) {
-	int connected = 0;
-	char *home = getenv("HOME");
-	
-	char filepath[strlen(home) + 20];
-	strncpy(filepath, home, strlen(home) + 20);
-	strncat(filepath, "/dfc.conf", strlen(home) + 20 - strlen(filepath));
-	
-	FILE *fp = fopen(filepath, "r");
-	if(fp==NULL) return -1;
-	
-	for(int i = 0; i < 4; i++) {
-		char line[50];
-		if(fgets(line, 50, fp)==NULL) {
-			fclose(fp);
-			return -1;
+//serve u_dfc runs until killed
+//each one gets a thread, and they all share one set of connection pools
+int agent() {
+	struct sockaddr_un addr;
+	int listen_sock;
+
+	//a u_dfc that goes away mid-list should only fail that write
+	signal(SIGPIPE, SIG_IGN);
+
+	pool = dfc_open(NULL);
+	if(pool == NULL) {
+		printf("Bad configuration file\n");
+		return -1;
+	}
+
+	if(agent_path(&addr) < 0) {
+		printf("No usable agent socket path\n");
+		return -1;
+	}
+
+	//seqpacket keeps each request in one message, which is all the framing we need
+	listen_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(listen_sock < 0) {
+		perror("opening agent socket");
+		return -1;
+	}
+
+	//only this user gets to hand us files
+	unlink(addr.sun_path);
+	umask(077);
+	if(bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_sock, 128) < 0) {
+		perror("binding agent socket");
+		return -1;
+	}
+
+	while(1) {
+		int client_sock = accept(listen_sock, NULL, NULL);
+		if(client_sock < 0) {
+			if(errno != EINTR) perror("accepting u_dfc");
+			continue;
 		}
-		
-		char *s = strtok(line, " ");
-		if(s==NULL || strcmp(s, "server")!=0) {
-			fclose(fp);
-			return -1;
+
+		pthread_t runner;
+		if(pthread_create(&runner, NULL, agent_client, (void *)(long) client_sock) != 0) {
+			perror("creating agent thread");
+			close(client_sock);
+			continue;
 		}
-		
-		char *s_n = strtok(NULL, " ");
-		if(s_n==NULL)
-			return -1;
-		char *hn = strtok(NULL, " \r\n");
-		if(connect_to_host(dfs + i, hn) == -1) *(dfs + i) = -1;
-		else connected++;
+		pthread_detach(runner);
 	}
-	
-	fclose(fp);
-	return connected;
 }
 
-//connect to host, adapted from beej's guide
-int connect_to_host(int *server_sock, char *hostname) {
-
-	char host_port[strlen(hostname)+1];
-	struct addrinfo hints, *servinfo, *p;
-	char *host, *port, port_str[8];
-	
-	bzero(port_str, 8);
-	strcpy(host_port, hostname);
-	host = strtok(host_port, ":");
-	if(host==NULL) return -1;
-	port = strtok(NULL, ":");
-	if(port==NULL) return -1;
-	else strcpy(port_str, port);
-	
-
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	
-	if (getaddrinfo(host, port_str, &hints, &servinfo) != 0) {
-	    return -1;
+//run one u_dfc's requests, each is "<op> <filename>" with the file to use attached, and gets an int status back
+//(for getrange the filename has the offset and length in front of it), except putmany, which carries a group of files (see run_put_many)
+void *agent_client(void *args) {
+	int sock = (int)(long) args;
+	char *request = malloc(AGENT_REQUEST);
+	int fds[PUT_GROUP], status[PUT_GROUP];
+	int len, nfds;
+
+	if(request == NULL) {
+		perror("malloc for agent request");
+		close(sock);
+		return NULL;
 	}
-	
-	for(p = servinfo; p != NULL; p = p->ai_next) {
-   		if ((*server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-		        perror("socket");
-        		continue;
-    		}
 
-        	if (connect(*server_sock, p->ai_addr, p->ai_addrlen) == -1)
-        		return -1;
+	while((len = recv_request(sock, request, AGENT_REQUEST, fds, &nfds)) > 0) {
+		char *op = request, *name = strchr(request, ' ');
+		int replies = 1;
 
-    		break;
-	}
-	
-	return 0;
-}
+		status[0] = -1;
+		if(name != NULL && nfds > 0) {
+			*name++ = '\0';
 
-//receive lines delimited by \r\n\r\n
-int recv_line(int client_sock, char *buffer) {
-	char *ch_buf = buffer;
-	int rcv_ch;
-	int counter = 0;
-	
-	while((rcv_ch = recv(client_sock, ch_buf, 1,0))) {
-		if(rcv_ch < 0) {
-			perror("receiving command");
-			return -1;
-		}
-		
-		counter++;
-		if(counter >= BUFSIZE) {
-			perror("command too big");
-			return -1;
+			if(strcmp(op, "putmany")==0) {
+				char *names[PUT_GROUP];
+				char *end = request + len;
+				int n = 0;
+
+				//every fd needs its name, or we could store a file under the wrong one
+				while(n < nfds && name < end) {
+					names[n++] = name;
+					name += strlen(name) + 1;
+				}
+				replies = nfds;
+				if(n == nfds) dfc_put_many(pool, n, (const char **) names, fds, status);
+				else for(int i = 0; i < nfds; i++) status[i] = -1;
+			}
+			else if(nfds == 1)
+				status[0] = run(pool, -1, op, name, fds[0]);
 		}
-		
-		if(counter >= 4 && strcmp(ch_buf - 3, "\r\n\r\n")==0)
-			return 0;
-		else
-			ch_buf++;
+		for(int i = 0; i < nfds; i++) close(fds[i]);
+
+		if(send(sock, status, replies * sizeof(int), MSG_NOSIGNAL) != (ssize_t)(replies * sizeof(int)))
+			break;
 	}
-	
+
+	free(request);
+	close(sock);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//returns -1 if there's no $HOME or the path doesn't fit
+int agent_path(struct sockaddr_un *addr) {
+	char *home = getenv("HOME");
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if(home == NULL) return -1;
+
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", home, AGENT_SOCKET);
+	return len < (int) sizeof(addr->sun_path) ? 0 : -1;
+}
+
+//whether s is all digits, so "get a 0 10" can tell a range from three files
+int is_number(const char *s) {
+	if(*s == '\0') return 0;
+	for(; *s; s++)
+		if(*s < '0' || *s > '9') return 0;
 	return 1;
 }
+
+//returns -1 if no agent is running
+int agent_connect() {
+	struct sockaddr_un addr;
+
+	if(agent_path(&addr) < 0) return -1;
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if(sock < 0) return -1;
+
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+//send one request with nfds files attached to it
+int send_request(int sock, char *request, int len, int *fds, int nfds) {
+	struct iovec iov = { request, len };
+	char control[CMSG_SPACE(PUT_GROUP * sizeof(int))];
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)) };
+
+	memset(control, 0, sizeof(control));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+//receive one request into request as a string, fds gets the files attached to it and nfds how many there were
+//returns the request's length, 0 once the client hangs up, -1 on error
+int recv_request(int sock, char *request, int cap, int *fds, int *nfds) {
+	struct iovec iov = { request, cap - 1 };
+	char control[CMSG_SPACE(PUT_GROUP * sizeof(int))];
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+	*nfds = 0;
+	ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if(len <= 0) return len;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+	}
+
+	//a request too big for the buffer would be cut short, so refuse it rather than act on part of it
+	if(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) request[0] = '\0';
+	request[len] = '\0';
+	return len;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -5,324 +6,3750 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <dirent.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <signal.h>
 #include <pthread.h>
 
+#include "frame.h"
+#include "proto.h"
+#include "hash.h"
+#include "crc32c.h"
+#include "uring.h"
+
 #define BUFSIZE 4096
+#define MAX_EVENTS 64
+
+//defaults for the listen queue and the number of clients we will serve at once
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_MAX_CONNS 4096
+
+//with -s chunks are appended to segment files under <dfs>/.seg instead of getting a file each
+//a new segment is started once the active one passes SEGMENT_MAX
+#define SEGMENT_MAX (256LL << 20)
+#define SEG_MAGIC 0x44534547
+#define SEG_HDR_LEN 24
+
+//flags in a segment record's header
+//SEG_HASHED records have the content hash of the chunk between the filename and the contents,
+//SEG_REF records are chunks stored with OP_PUT_REF, which have the hash but no contents of their own
+//SEG_BODY records are copies the compactor made of contents other chunks point at, after the chunk itself was replaced
+//SEG_CRC records have the crc32c of the contents after the hash (or after the name if there's no hash)
+//SEG_LZ records hold contents the client compressed (lz.h), with their u64 length once decompressed after the crc
+//SEG_GEN records have the u64 generation of the put that stored them after that
+#define SEG_HASHED 1
+#define SEG_REF 2
+#define SEG_BODY 4
+#define SEG_CRC 8
+#define SEG_LZ 16
+#define SEG_GEN 32
+
+//a chunk file's crc32c is kept in this extended attribute so a rescan can find it again,
+//and a compressed one's length once decompressed in the other
+#define CRC_XATTR "user.crc32c"
+#define LZ_XATTR "user.lz_size"
+
+//with -u, each event loop has this many buffers of RING_BUFSIZE registered with its io_uring for chunk writes,
+//and a table of RING_FILES files to write them to
+#define RING_BUFS 64
+#define RING_BUFSIZE (128 << 10)
+#define RING_FILES 256
+
+//latency histograms have a bucket per power of two microseconds, the last one taking everything longer
+//and the stats report has to fit in STATS_BUFSIZE
+#define STAT_BUCKETS 32
+#define STATS_BUFSIZE 16384
+
+//with -m, chunk contents are cached in memory in CACHE_SHARDS separately locked parts, each with CACHE_BUCKETS hash chains
+#define CACHE_SHARDS 8
+#define CACHE_BUCKETS 16384
+
+//scrub reads chunks this many bytes at a time
+#define SCRUB_BUFSIZE (1 << 20)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-//helper function to make sure everything is written
-int socket_write(int sock, char *message, int stream_size) {
-	int bytes_written, unsent_bytes, new_bytes_written;
-	
-	bytes_written = write(sock, message, stream_size);
-	if(bytes_written < 0) return -1;
-	unsent_bytes = stream_size - bytes_written;
-	
-	while(unsent_bytes > 0) {
-		new_bytes_written = write(sock, message+bytes_written, unsent_bytes);
-		if(new_bytes_written < 0) return -1;
-		
-		bytes_written += new_bytes_written;
-		unsent_bytes = stream_size - bytes_written;
-	}
-	return 0;
-}
+//connections are driven as state machines by the event loops
+//CONN_NEW waits for the first byte to tell which protocol the client speaks
+//CONN_CMD waits for a text command ending in \r\n\r\n, CONN_MSG for a v2 request (see proto.h)
+//the put states wait for the binary chunk header and contents, CONN_BATCH for the next file of a batched put
+enum conn_state { CONN_NEW, CONN_CMD, CONN_MSG, CONN_PUT_HDR, CONN_PUT_BODY, CONN_BATCH };
+
+//replies are queued as segments of buffered bytes, each optionally followed by a region of a file
+//the file part goes out with sendfile so chunk contents never pass through user space
+//or with the chunk cache, a region of a cached chunk, which the segment holds a reference to until it's sent
+typedef struct out_seg {
+	char *buf;
+	size_t len, sent, cap;
+	int fd;
+	struct cache_entry *cached;
+	off_t off;
+	long long remaining;
+	struct out_seg *next;
+
+	//every segment of a get or list reply carries its timing forward, the last one records it once it's sent (see stat_tag)
+	int stat_op, stat_last;
+	uint64_t stat_start, stat_disk;
+} out_seg;
 
-//used to pass arguments to threads
 typedef struct {
-	int argc;
-	char **argv;
 	int sock;
-} thread_args;
+	enum conn_state state;
+	int events;
+	int closing;
+
+	//bytes received but not yet consumed
+	rbuf in;
+
+	//chunk currently being received by put
+	//contents are written to put_tmp as they arrive and renamed into place once complete,
+	//or with -s straight into the record reserved for them at put_rec in segment put_seg (-1 if none)
+	//put_id is the request id to answer once it's stored, if it came in as a v2 request
+	//put_crc is the crc32c of the contents so far, and v2 puts also say what it should come to in put_expect,
+	//put_corrupt is set if it didn't
+	//put_raw is the length of the contents once decompressed if the client compressed them, 0 if it didn't
+	//put_gen is the generation of the put the chunk belongs to, 0 for text puts which don't have one
+	//with -u, put_inflight is how many writes of the chunk the loop's ring hasn't finished, and put_file is
+	//where put_fd is in the ring's file table (-1 if it isn't)
+	char *put_path;
+	char *put_tmp;
+	int put_fd;
+	int put_seg;
+	long long put_rec, put_off;
+	char *put_name;
+	int put_chunk, put_count, put_error;
+	long long put_size, put_remaining;
+	int put_v2;
+	uint32_t put_id;
+	chash put_hash;
+	uint32_t put_crc, put_expect;
+	int put_check, put_corrupt;
+	long long put_raw, put_gen;
+	int put_inflight, put_file;
+	uint64_t put_start, put_disk;
+
+	//batched put being received, batch_remaining is how much of its payload hasn't been read yet
+	//batch_failed lists the files (by position in the batch) that couldn't be stored
+	int batch_files, batch_done;
+	uint64_t batch_remaining;
+	uint32_t batch_id;
+	uint32_t *batch_failed;
+	int batch_num_failed, batch_cap_failed;
+
+	//chunks that couldn't be stored since the client last asked with sync
+	int put_failures;
+
+	//reply segments waiting for the socket to become writable
+	out_seg *out_head, *out_tail;
+} conn;
+
+//each event loop owns an epoll instance and (with SO_REUSEPORT) its own listening socket
+typedef struct {
+	int epfd;
+	int listen_sock;
+} event_loop;
+
+//server settings, filled in from the command line
+struct {
+	char *dfs;
+	int port;
+	int backlog;
+	int max_conns;
+	int threads;
+	int rescan;
+	int segments;
+	int uring;
+	int admin_port;
+	long long cache_bytes;
+} config;
+
+//with -u, what an event loop needs to write chunks through io_uring instead of with pwrite
+//a put copies what it's received into free buffers and queues a write of each, and everything one read brought in
+//goes to the kernel in one submit, so the loop goes back to the network while the disk catches up
+//owner and len say which connection each buffer in flight belongs to and how much of it is being written
+//buffers are only RING_BUFSIZE apart in bufs, and only used as fixed buffers if registering them worked,
+//and likewise for the file table
+typedef struct {
+	uring ring;
+	char *bufs;
+	int fixed_bufs, fixed_files;
+	int free_bufs[RING_BUFS], num_free_bufs;
+	conn *owner[RING_BUFS];
+	unsigned len[RING_BUFS];
+	int free_files[RING_FILES], num_free_files;
+} disk_ring;
+
+//the calling event loop's ring, NULL without -u
+__thread disk_ring *ring;
+
+//what we know about one chunk of a file
+//seg is -1 for a chunk stored in its own file, otherwise the chunk's record starts at off in that segment
+//flags are the record's SEG_ flags, chunks in files use SEG_HASHED, SEG_CRC and SEG_LZ too,
+//and chunks stored before we hashed (or kept crcs) don't have them
+//size is what's stored, and with SEG_LZ raw is how long that comes to once the client decompresses it
+//gen is the generation of the put that stored it, 0 if it didn't say (see file_entry)
+typedef struct {
+	int chunk;
+	int seg;
+	long long size;
+	long long off;
+	int flags;
+	uint32_t crc;
+	long long raw;
+	long long gen;
+	unsigned char hash[CHASH_LEN];
+} chunk_info;
+
+//contents held by one or more chunks, for deduplication
+//refs is how many chunks in the index have these contents
+//seg is -1 if they're in <dfs>/.cas/<hash>, which every chunk file with them is a hard link to,
+//otherwise they're the contents of the record at off in that segment, which stays until refs drops to 0
+typedef struct {
+	int used;
+	int refs;
+	int seg;
+	long long off, len;
+	long long size;
+	unsigned char hash[CHASH_LEN];
+} cas_body;
+
+//a file in .cas, used to find the chunk files linked to it when rescanning
+typedef struct {
+	ino_t ino;
+	unsigned char hash[CHASH_LEN];
+} cas_inode;
+
+//what we know about one file
+//count is the number of chunks the whole file was split into, 0 if the client never told us
+//slot is indexed by chunk number and holds where that chunk is in chunks + 1, 0 if we don't have it,
+//so finding a chunk doesn't mean walking the thousands a big file can have
+//gen is the newest generation of the file we've heard of, only chunks from a put of that generation are current
+//and shown to clients, the rest are what's left of older versions until the new put replaces or drops them
+//(they're kept until then since the new version may well be stored as references to their contents)
+typedef struct {
+	char *name;
+	int count;
+	long long gen;
+	int num_chunks, cap_chunks;
+	chunk_info *chunks;
+	int *slot;
+	int cap_slot;
+} file_entry;
+
+//in-memory index of every file and chunk we store, so list/stat/get never have to walk the directories
+//entries stay in the order files were first stored (which is also the order list pages through them),
+//slots is an open addressing table of entry index + 1 keyed by filename, 0 meaning empty
+//bodies is an open addressing table of the contents we hold, keyed by hash
+//changes are appended to <dfs>/.journal, and on startup the journal is folded into a fresh <dfs>/.index snapshot
+//while loading, changes are only made in memory, the files on disk already reflect them
+struct {
+	pthread_rwlock_t lock;
+	file_entry *entries;
+	int num_entries, cap_entries;
+	int *slots;
+	int num_slots;
+	cas_body *bodies;
+	int num_bodies, cap_bodies;
+	int journal_fd;
+	int loading;
+} meta;
+
+//a segment is a log of records, each a SEG_HDR_LEN byte header, the filename, the content hash if the SEG_HASHED flag
+//is set, the u32 crc32c of the contents if SEG_CRC is, the u64 length of the contents once decompressed if SEG_LZ is,
+//the u64 generation if SEG_GEN is, then the chunk contents (unless it's a SEG_REF)
+//header is u32 SEG_MAGIC, u8 committed, u8 flags, u16 filename length, u32 chunk, u32 chunks in the file, u64 size,
+//little-endian like the v2 protocol, and committed is only set once the contents are all on disk
+typedef struct {
+	int fd;
+	int writers;
+	long long end;
+	long long dead;
+} segment;
+
+//segments by number, fd is -1 for numbers that were compacted away
+//new records go at the end of the active segment, writers counts puts still filling in records they reserved,
+//and dead counts bytes no longer referenced by the index
+//once half of a sealed segment is dead the compactor copies what's left into the active one and removes it
+//lock order is meta.lock before store.lock
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	segment *segs;
+	int num_segs;
+	int active;
+	char *path;
+} store;
+
+//background check of every chunk against its crc, started by OP_SCRUB
+//checked and failed count from the start of the current (or last) pass
+struct {
+	pthread_mutex_t lock;
+	int running;
+	uint64_t checked, failed;
+} scrub = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//one chunk's contents in the chunk cache
+//refs counts the cache's own reference while the entry is in it, one for each reply still sending from it,
+//and one for the get loading it; loading entries are in the table but not the LRU list, so a get that misses on a chunk
+//another get is already reading sends it from its file instead of reading it in again
+//dead entries were dropped from the cache (evicted, or the chunk was stored again) and go once the last reference does
+typedef struct cache_entry {
+	char *name;
+	int chunk;
+	int shard;
+	long long size;
+	char *data;
+	int refs;
+	int loading, dead;
+	struct cache_entry *hnext, *prev, *next;
+} cache_entry;
+
+//a part of the cache, the one a chunk goes in is picked by hash
+//entries are listed most recently used first, and the least recently used ones are evicted once bytes passes budget
+typedef struct {
+	pthread_mutex_t lock;
+	cache_entry *buckets[CACHE_BUCKETS];
+	cache_entry *head, *tail;
+	long long bytes;
+	int entries;
+	uint64_t evictions;
+} cache_shard;
+
+//-m caches the chunks gets ask for, so a popular one is served from memory instead of being opened and read every time
+//each shard gets an even share of the budget, and chunks bigger than half a share are never cached
+//storing a chunk again (or a scrub dropping it) takes it out of the cache, see meta_update and meta_remove
+struct {
+	cache_shard *shards;
+	long long budget, max_entry;
+} cache;
+
+//number of open client connections across all loops
+int active_conns = 0;
+
+//what the server has been doing, for OP_STATS and the admin port
+//every event loop counts into a shard of its own, so counting never waits on a lock or shares a cache line,
+//and a report adds the shards up (each count is only written by its own loop, so reading it while it moves is fine)
+//counts are by opcode, text commands included under the opcode they match; bytes per opcode are the requests' and
+//replies' v2 lengths, and sock_in and sock_out are everything that went through our sockets
+//with -m, cache_hits and cache_misses count chunks served from the chunk cache or not, and cache_bypassed the misses
+//on a chunk another get was reading in, which are sent from the chunk's file
+//list, put and get latencies are split into time spent on disk (and in the index) and time spent waiting on the network:
+//a put's disk time is its writes and finishing it, the rest is waiting for its contents to arrive,
+//and a get's or list's is building the reply and sendfile reading it out, the rest is waiting for the client to take it
+enum stat_timed { STAT_LIST, STAT_PUT, STAT_GET, STAT_TIMED };
+enum stat_part { STAT_TOTAL, STAT_DISK, STAT_NET, STAT_PARTS };
+#define STAT_OPS 16
+
+typedef struct {
+	uint64_t count[STAT_OPS], errors[STAT_OPS], bytes_in[STAT_OPS], bytes_out[STAT_OPS];
+	uint64_t sock_in, sock_out;
+	uint64_t cache_hits, cache_misses, cache_bypassed;
+	uint64_t hist[STAT_TIMED][STAT_PARTS][STAT_BUCKETS];
+} __attribute__((aligned(64))) stat_shard;
+
+struct {
+	stat_shard *shards;
+	int num_shards, next_shard;
+	time_t started;
+} stats;
+
+//the calling event loop's shard, NULL anywhere else
+__thread stat_shard *shard;
 
-void *server_thread(void*);
-void parse_command(int, char*, char*);
-int recv_cmd(int, char*);
+int open_listener(int, int);
+void *event_loop_thread(void*);
+void accept_conns(event_loop*);
+void conn_readable(event_loop*, conn*);
+void conn_service(event_loop*, conn*);
+void conn_close(event_loop*, conn*);
+void set_events(event_loop*, conn*, int);
+int process_input(conn*);
+int parse_command(conn*, char*);
+char *find_header(char*, char*);
+int msg_process(conn*);
+int msg_batch_file(conn*);
+void msg_batch_reply(conn*);
+void msg_reply(conn*, msg_hdr*, int, uint64_t);
+char *msg_string(char*, char*, char*);
 
-void list(int, char*);
-void put(int, char*, char*);
-void get(int, char*, char*);
+int out_append(conn*, const char*, size_t);
+int out_file(conn*, int, off_t, long long);
+int out_cached(conn*, cache_entry*, off_t, long long);
+int out_flush(conn*);
+void out_pop(conn*);
+
+int meta_load(char*);
+int meta_read_records(char*);
+void meta_scan(char*);
+int meta_write_snapshot(char*);
+unsigned long name_hash(char*);
+file_entry *meta_lookup(char*);
+file_entry *meta_insert(char*);
+chunk_info *meta_chunk(file_entry*, int);
+long long chunk_data(char*, chunk_info*);
+long long chunk_len(char*, chunk_info*);
+int meta_record(char*, chunk_info*, int, char*);
+int meta_update(char*, chunk_info*, int, char*);
+void meta_release(char*, chunk_info*, chunk_info*);
+int meta_remove(char*, chunk_info*);
+void meta_drop(char*, file_entry*, chunk_info*);
+int meta_retire(char*, int, long long);
+int meta_stale(char*, long long);
+int meta_current(file_entry*);
+int meta_move(char*, int, unsigned char*, int, long long, int, long long);
+int meta_uses_segment(int);
+int meta_format(char*, char*, chunk_info*, int);
+int meta_format_body(char*, cas_body*);
+void meta_journal(char*, int);
+int meta_sync(void);
+void meta_scan_segments(void);
+void meta_prune_bodies(void);
+void meta_set_body(cas_body*);
+unsigned long cas_slot(unsigned char*);
+void cas_drop(cas_body*);
+cas_body *cas_lookup(unsigned char*);
+cas_body *cas_insert(unsigned char*);
+void cas_remove(cas_body*);
+void cas_path(char*, unsigned char*);
+int cas_inode_cmp(const void*, const void*);
+int cas_pin(unsigned char*, cas_body*);
+void cas_unpin(unsigned char*);
+
+void list(conn*, char*, char*, char*);
+void put(conn*, char*, char*, int);
+int put_begin(conn*, int, long long);
+void put_write(conn*);
+void put_finish(conn*);
+void put_abort(conn*);
+void get(conn*, char*, char*);
+int get_chunk(conn*, char*, int);
+int open_chunk(char*, int, long long*, off_t*, chunk_info*);
+void stat_file(conn*, char*);
+void msg_list(conn*, msg_hdr*, char*);
+void msg_put(conn*, msg_hdr*, char*);
+void msg_put_batch(conn*, msg_hdr*, char*);
+void msg_get(conn*, msg_hdr*, char*);
+void msg_stat(conn*, msg_hdr*, char*);
+void msg_has(conn*, msg_hdr*, char*);
+void msg_put_ref(conn*, msg_hdr*, char*);
+void msg_drop(conn*, msg_hdr*, char*);
+void msg_scrub(conn*, msg_hdr*, char*);
+void *scrub_thread(void*);
+int scrub_chunk(char*, int, char*);
+
+int cache_init(void);
+int cache_open(char*, int, long long*, off_t*, cache_entry**);
+cache_entry *cache_find(cache_shard*, char*, int, unsigned long);
+void cache_drop(cache_shard*, cache_entry*);
+void cache_unref(cache_entry*);
+void cache_release(cache_entry*);
+void cache_forget(char*, int);
+unsigned long cache_hash(char*, int);
+int read_chunk_count(char*, long long*);
+void write_chunk_count(char*, int, long long);
+void sync_puts(conn*);
+
+disk_ring *ring_open(void);
+void ring_write(conn*, char*, size_t);
+void ring_reap(unsigned);
+void ring_settle(conn*);
+
+uint64_t now_ns(void);
+void stat_add(uint64_t*, uint64_t);
+void stat_latency(int, uint64_t, uint64_t);
+void stat_tag(conn*, int, uint64_t, out_seg*);
+int stat_timed(int);
+int stats_format(char*, int);
+void msg_stats(conn*, msg_hdr*);
+void *admin_thread(void*);
+
+int store_open(char*);
+int store_start(void);
+int store_add(int, int);
+int store_new_segment(void);
+int store_reserve(long long, int*, long long*);
+void store_done(int);
+void store_dead(int, long long);
+int store_victim(void);
+void *compactor_thread(void*);
+int compact_segment(int);
+long long seg_record(int, long long, long long, char*, char*, chunk_info*);
+int seg_sums(char*, chunk_info*);
+int seg_sums_len(int);
+int copy_range(int, long long, int, long long, long long);
+void seg_path(char*, int);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char *argv[]) {
-	int sockfd, client_sock;
-	struct sockaddr_in server, client;
-	int clientlen;
-	
-	if(argc < 3) {
-		printf("Usage %s <dir> <port #>\n", argv[0]);
+	int opt;
+
+	config.backlog = DEFAULT_BACKLOG;
+	config.max_conns = DEFAULT_MAX_CONNS;
+	config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while((opt = getopt(argc, argv, "a:b:c:m:t:rsu")) != -1) {
+		switch(opt) {
+		case 'b': config.backlog = atoi(optarg); break;
+		case 'c': config.max_conns = atoi(optarg); break;
+		case 't': config.threads = atoi(optarg); break;
+		case 'r': config.rescan = 1; break;
+		case 's': config.segments = 1; break;
+		case 'u': config.uring = 1; break;
+		case 'a': config.admin_port = atoi(optarg); break;
+		case 'm': config.cache_bytes = atoll(optarg) << 20; break;
+		default:
+			printf("Usage %s <dir> <port #> [-b backlog] [-c max connections] [-t threads] [-r] [-s] [-u] [-a admin port] [-m cache MB]\n", argv[0]);
+			exit(-1);
+		}
+	}
+
+	if(argc - optind < 2) {
+		printf("Usage %s <dir> <port #> [-b backlog] [-c max connections] [-t threads] [-r] [-s] [-u] [-a admin port] [-m cache MB]\n", argv[0]);
+		exit(-1);
+	}
+
+	config.dfs = argv[optind];
+	config.port = atoi(argv[optind+1]);
+	if(config.port==0) {
+		printf("Must use a valid port!\n");
+		exit(-1);
+	}
+	if(config.backlog <= 0) config.backlog = DEFAULT_BACKLOG;
+	if(config.max_conns <= 0) config.max_conns = DEFAULT_MAX_CONNS;
+	if(config.threads <= 0) config.threads = 1;
+
+	//a client hanging up mid-reply should only fail that send, not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	crc32c_init();
+
+	//-u is only a different way of writing, so without io_uring we write the usual way
+	if(config.uring) {
+		uring probe;
+		if(uring_init(&probe, 1) < 0) {
+			perror("io_uring unavailable, writing chunks with pwrite");
+			config.uring = 0;
+		}
+		else uring_exit(&probe);
+	}
+
+	//in case directory doesn't exist, make the directory
+	mkdir(config.dfs, 0700);
+
+	//segments are opened even without -s so chunks stored by an earlier -s run can still be read
+	if(store_open(config.dfs) < 0) {
+		printf("Couldn't open segments for %s\n", config.dfs);
+		exit(-1);
+	}
+
+	//-r rebuilds the index from the directories and segments, for when the snapshot or journal can't be trusted
+	if(meta_load(config.dfs) < 0) {
+		printf("Couldn't load index for %s\n", config.dfs);
+		exit(-1);
+	}
+
+	if(store_start() < 0) {
+		printf("Couldn't start segment store for %s\n", config.dfs);
+		exit(-1);
+	}
+
+	if(config.cache_bytes > 0 && cache_init() < 0) {
+		printf("Couldn't set up a %lld MB chunk cache\n", config.cache_bytes >> 20);
+		exit(-1);
+	}
+
+	stats.started = time(NULL);
+	stats.num_shards = config.threads;
+	stats.shards = aligned_alloc(64, config.threads * sizeof(stat_shard));
+	if(stats.shards == NULL) {
+		perror("malloc for stats");
 		exit(-1);
 	}
-	
-	//create/open server socket
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if(sockfd < 0)
+	memset(stats.shards, 0, config.threads * sizeof(stat_shard));
+
+	//-a serves the stats report to anything that connects to the admin port, then hangs up
+	if(config.admin_port > 0) {
+		pthread_t admin;
+		int admin_sock = open_listener(config.admin_port, 0);
+		if(admin_sock < 0 || fcntl(admin_sock, F_SETFL, 0) < 0 ||
+		   pthread_create(&admin, NULL, admin_thread, (void *)(long) admin_sock) != 0) {
+			printf("Couldn't open admin port %d\n", config.admin_port);
+			exit(-1);
+		}
+		pthread_detach(admin);
+	}
+
+	//one event loop per core, each with its own listening socket so the kernel spreads accepts across them
+	//if SO_REUSEPORT isn't available, every loop shares the first socket and waits on it with EPOLLEXCLUSIVE
+	event_loop loops[config.threads];
+	pthread_t runners[config.threads];
+	int shared_sock = -1;
+
+	for(int i = 0; i < config.threads; i++) {
+		loops[i].epfd = epoll_create1(0);
+		if(loops[i].epfd < 0) {
+			perror("creating epoll instance");
+			exit(-1);
+		}
+
+		if(shared_sock == -1) {
+			loops[i].listen_sock = open_listener(config.port, 1);
+			if(loops[i].listen_sock < 0)
+				loops[i].listen_sock = shared_sock = open_listener(config.port, 0);
+		} else
+			loops[i].listen_sock = shared_sock;
+
+		if(loops[i].listen_sock < 0) exit(-1);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | (shared_sock == -1 ? 0 : EPOLLEXCLUSIVE);
+		ev.data.ptr = NULL;
+		if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listen_sock, &ev) < 0) {
+			perror("adding listener to epoll");
+			exit(-1);
+		}
+	}
+
+	for(int i = 0; i < config.threads; i++)
+		pthread_create(&runners[i], NULL, event_loop_thread, &loops[i]);
+
+	for(int i = 0; i < config.threads; i++)
+		pthread_join(runners[i], NULL);
+}
+
+//create/open a non-blocking listening socket on port
+//returns -1 on error
+int open_listener(int port, int reuseport) {
+	struct sockaddr_in server;
+	int sockfd, optval = 1;
+
+	sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(sockfd < 0) {
 		perror("opening socket");
-		
-	int optval = 1;
+		return -1;
+	}
+
 	if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval, sizeof(int)) < 0)
 		perror("setting reuseaddr");
-		
-	//set up pthread attributes
-	pthread_attr_t attr;
-    	pthread_attr_init(&attr);
-	
+	if(reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+		close(sockfd);
+		return -1;
+	}
+
 	//populate server info
 	server.sin_family = AF_INET;
 	server.sin_addr.s_addr = INADDR_ANY;
-	if(atoi(argv[2])!=0)
-		server.sin_port = htons(atoi(argv[2]));
-	else {
-		printf("Must use a valid port!\n");
-		exit(-1);
-	}
-	
-	//bind server, set listen queue to 3
-	if(bind(sockfd, (struct sockaddr *)&server, sizeof(server)) < 0)
+	server.sin_port = htons(port);
+
+	if(bind(sockfd, (struct sockaddr *)&server, sizeof(server)) < 0) {
 		perror("binding socket");
+		close(sockfd);
+		return -1;
+	}
+
+	if(listen(sockfd, config.backlog) < 0) {
+		perror("listening on socket");
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void *event_loop_thread(void *args) {
+	event_loop *loop = (event_loop *)args;
+	struct epoll_event events[MAX_EVENTS];
+
+	if(config.uring) ring = ring_open();
+	shard = &stats.shards[__atomic_fetch_add(&stats.next_shard, 1, __ATOMIC_RELAXED)];
+
+	while(1) {
+		int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			perror("waiting on epoll");
+			break;
+		}
+
+		for(int i = 0; i < n; i++) {
+			conn *c = events[i].data.ptr;
+
+			//the listener is registered with a NULL pointer
+			if(c == NULL) {
+				accept_conns(loop);
+				continue;
+			}
+
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				conn_readable(loop, c);
+			else if(events[i].events & EPOLLOUT)
+				conn_service(loop, c);
+		}
+	}
+	return NULL;
+}
+
+//accept everything pending on the listener, refusing clients over the connection cap
+void accept_conns(event_loop *loop) {
+	struct sockaddr_in client;
+	socklen_t clientlen = sizeof(client);
 
-	listen(sockfd, 3);
-	
-	clientlen = sizeof(client);
-	
-	//in case directory doesn't exist, make the directory
-	mkdir(argv[1], 0700);
-	
 	while(1) {
-		//accept connection and pass to thread
-		thread_args pa;
-		thread_args *arg_ptr;
-		
-		client_sock = accept(sockfd, (struct sockaddr *)&client,(socklen_t *)&clientlen);
+		int client_sock = accept4(loop->listen_sock, (struct sockaddr *)&client, &clientlen, SOCK_NONBLOCK);
 		if(client_sock < 0) {
-			perror("accepting connection");
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("accepting connection");
+			return;
+		}
+
+		if(__atomic_add_fetch(&active_conns, 1, __ATOMIC_RELAXED) > config.max_conns) {
+			__atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+			close(client_sock);
+			continue;
+		}
+
+		//pipelined clients wait on small replies, and replies that have more behind them are corked with MSG_MORE anyway
+		int one = 1;
+		setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		conn *c = calloc(1, sizeof(conn));
+		if(c == NULL) {
+			perror("malloc for connection");
+			__atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+			close(client_sock);
 			continue;
 		}
-		
-		pa.sock = client_sock;
-		pa.argc = argc;
-		pa.argv = argv;
-		
-		pthread_t runner;
-	
-		arg_ptr = malloc(sizeof(thread_args));
-		if(arg_ptr==NULL) perror("malloc before proxy thread creation");
-		*arg_ptr = pa;
-		
-		pthread_create(&runner, &attr, server_thread, (void *) arg_ptr);
+		if(rbuf_init(&c->in, FRAME_BUFSIZE) < 0) {
+			perror("malloc for connection buffer");
+			free(c);
+			__atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+			close(client_sock);
+			continue;
+		}
+		c->sock = client_sock;
+		c->put_fd = -1;
+		c->put_seg = -1;
+		c->put_file = -1;
+		c->state = CONN_NEW;
+		c->events = EPOLLIN;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+			perror("adding connection to epoll");
+			conn_close(loop, c);
+		}
 	}
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void conn_close(event_loop *loop, conn *c) {
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+	close(c->sock);
+	rbuf_free(&c->in);
+	//a client that hangs up mid-chunk leaves nothing behind
+	if(c->put_tmp != NULL || c->put_seg >= 0) put_abort(c);
+	free(c->put_path);
+	free(c->batch_failed);
+	while(c->out_head) out_pop(c);
+	free(c);
+	__atomic_sub_fetch(&active_conns, 1, __ATOMIC_RELAXED);
+}
+
+//while a reply is still being flushed we stop reading, so a slow reader can't make us buffer without bound
+void set_events(event_loop *loop, conn *c, int events) {
+	struct epoll_event ev;
+	if(c->events == events) return;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->sock, &ev) < 0)
+		perror("updating epoll events");
+	c->events = events;
+}
+
+void conn_readable(event_loop *loop, conn *c) {
+	int n;
+
+	//chunk contents pass through the same fixed-size buffer as commands on their way to disk
+	n = rbuf_fill(&c->in, c->sock);
+	if(n > 0) stat_add(&shard->sock_in, n);
+
+	if(n < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+		perror("receiving from client");
+		conn_close(loop, c);
+		return;
+	}
+	if(n == 0) {
+		conn_close(loop, c);
+		return;
+	}
 
-void *server_thread(void *args) {
-	thread_args *a = (thread_args *)args;
-	
-	//constantly waits for command until client tells server to exit
+	conn_service(loop, c);
+}
+
+//run commands and flush their replies until we either need more input or the socket is full
+void conn_service(event_loop *loop, conn *c) {
 	while(1) {
-			
-		char buffer[BUFSIZE];
-		bzero(buffer, BUFSIZE);
-		if(recv_cmd(a->sock, buffer)!=0) break;
-		if(strcmp(buffer, "exit\r\n\r\n")==0) break;
-		
-		parse_command(a->sock, buffer, a->argv[1]);
-			
-	}
-	close(a->sock);
-	return NULL;
+		int blocked = process_input(c);
+
+		int flushed = out_flush(c);
+		if(flushed < 0) {
+			conn_close(loop, c);
+			return;
+		}
+		if(flushed == 0) {
+			set_events(loop, c, EPOLLOUT);
+			return;
+		}
+
+		if(c->closing) {
+			conn_close(loop, c);
+			return;
+		}
+
+		if(!blocked) {
+			set_events(loop, c, EPOLLIN);
+			return;
+		}
+	}
+}
+
+//consume as much buffered input as the current state allows
+//returns 1 if we stopped because a reply is waiting to be sent, 0 if we need more input
+int process_input(conn *c) {
+	while(!c->closing) {
+		if(c->out_head) return 1;
+
+		if(c->state == CONN_NEW) {
+			if(rbuf_len(&c->in) == 0) return 0;
+			c->state = (unsigned char) rbuf_peek(&c->in)[0] == PROTO_MAGIC ? CONN_MSG : CONN_CMD;
+		}
+		else if(c->state == CONN_MSG) {
+			if(!msg_process(c)) return 0;
+		}
+		else if(c->state == CONN_BATCH) {
+			if(!msg_batch_file(c)) return 0;
+		}
+		else if(c->state == CONN_CMD) {
+			frame_view cmd;
+
+			if(!rbuf_frame(&c->in, &cmd)) {
+				if(rbuf_len(&c->in) >= BUFSIZE) {
+					fprintf(stderr, "command too big\n");
+					c->closing = 1;
+				}
+				return 0;
+			}
+
+			if(strcmp(cmd.ptr, "exit")==0 || parse_command(c, cmd.ptr) < 0)
+				c->closing = 1;
+		}
+		else if(c->state == CONN_PUT_HDR) {
+			int chunk, chunk_size;
+			if(rbuf_len(&c->in) < 2*sizeof(int)) return 0;
+
+			rbuf_take(&c->in, &chunk, sizeof(int));
+			rbuf_take(&c->in, &chunk_size, sizeof(int));
+
+			if(chunk_size < 0 || put_begin(c, chunk, chunk_size) < 0) {
+				c->closing = 1;
+				return 0;
+			}
+		}
+		else {
+			if(rbuf_len(&c->in) == 0) return 0;
+			put_write(c);
+		}
+	}
+	return 0;
 }
 
-void parse_command(int sock, char *buffer, char *dfs) {
-	char *command, *file;
-	command = strtok(buffer, " \r\n");
+//the first line of a command is "<command> [filename]", any further lines are "<header> <value>"
+//returns -1 if the connection should be dropped
+int parse_command(conn *c, char *buffer) {
+	char *command, *file, *headers;
+
+	//split off the header lines so they don't end up in the filename
+	headers = strstr(buffer, "\r\n");
+	if(headers != NULL) {
+		*headers = '\0';
+		headers += 2;
+	}
+
+	uint64_t start = now_ns();
+	out_seg *before = c->out_tail;
+	command = strtok(buffer, " ");
 	if(command==NULL) {
-		perror("Malformed command");
-		return;
+		fprintf(stderr, "Malformed command\n");
+		return -1;
+	}
+	else if(strcasecmp(command, "list")==0) {
+		stat_add(&shard->count[OP_LIST], 1);
+		list(c, find_header(headers, "prefix"), find_header(headers, "after"), find_header(headers, "limit"));
+		stat_tag(c, OP_LIST, start, before);
 	}
-	else if(strcasecmp(command, "list")==0)
-		list(sock, dfs);
 	else if(strcasecmp(command, "put")==0) {
-		file = strtok(NULL, "\r\n");
-		put(sock, dfs, file);
+		file = strtok(NULL, "");
+		if(file==NULL) return -1;
+		stat_add(&shard->count[OP_PUT], 1);
+		char *chunk_count = find_header(headers, "chunks");
+		put(c, config.dfs, file, chunk_count ? atoi(chunk_count) : 0);
 	}
 	else if(strcasecmp(command, "get")==0) {
-		file = strtok(NULL, "\r\n");
-		get(sock, file, dfs);
+		file = strtok(NULL, "");
+		if(file==NULL) return -1;
+		stat_add(&shard->count[OP_GET], 1);
+		get(c, file, find_header(headers, "chunks"));
+		stat_tag(c, OP_GET, start, before);
+	}
+	else if(strcasecmp(command, "stat")==0) {
+		file = strtok(NULL, "");
+		if(file==NULL) return -1;
+		stat_add(&shard->count[OP_STAT], 1);
+		stat_file(c, file);
 	}
+	else if(strcasecmp(command, "sync")==0)
+		sync_puts(c);
+	return 0;
 }
 
-//this function receives one character at a time from a socket
-//and terminates at double carriage return
-int recv_cmd(int client_sock, char *buffer) {
-	char *ch_buf = buffer;
-	int rcv_ch;
-	int counter = 0;
-	
-	while((rcv_ch = recv(client_sock, ch_buf, 1, 0))) {
-		if(rcv_ch < 0) {
-			perror("receiving command");
-			return -1;
-		}
-		
-		counter++;
-		if(counter >= BUFSIZE) {
-			perror("command too big");
+//returns the value of the header line starting with key, or NULL if there isn't one
+//the value runs until the next \r\n (or the end of the command)
+char *find_header(char *headers, char *key) {
+	int key_len = strlen(key);
+
+	while(headers != NULL && *headers != '\0') {
+		if(strncasecmp(headers, key, key_len)==0 && headers[key_len]==' ')
+			return headers + key_len + 1;
+
+		headers = strstr(headers, "\r\n");
+		if(headers != NULL) headers += 2;
+	}
+	return NULL;
+}
+
+//handle the next v2 request if all of it we need is buffered
+//a put only needs its fixed fields, the contents are streamed to disk the same way as a text put
+//returns 1 if a request was handled, 0 if more input is needed (or the connection is closing)
+int msg_process(conn *c) {
+	msg_hdr hdr;
+	uint64_t need;
+	char *p = rbuf_peek(&c->in);
+	size_t have = rbuf_len(&c->in);
+
+	if(have < MSG_HDR_LEN) return 0;
+	if(msg_unpack(p, &hdr) < 0) {
+		fprintf(stderr, "Malformed message\n");
+		c->closing = 1;
+		return 0;
+	}
+
+	need = hdr.length;
+	if(hdr.opcode == OP_PUT_BATCH) need = 4;
+	else if(hdr.opcode == OP_PUT) {
+		if(have < MSG_HDR_LEN + 2) return 0;
+		need = 2 + get_u16(p + MSG_HDR_LEN) + 28;
+		if(need > hdr.length) need = hdr.length + 1;
+	}
+
+	//a request we can't make sense of leaves us not knowing where the next one starts
+	if(need > BUFSIZE || need > hdr.length) {
+		fprintf(stderr, "Malformed message\n");
+		c->closing = 1;
+		return 0;
+	}
+	if(have < MSG_HDR_LEN + need) return 0;
+
+	//the payload stays where it is in the buffer until the next fill, which can't happen while we handle it
+	p += MSG_HDR_LEN;
+	rbuf_consume(&c->in, MSG_HDR_LEN + need);
+	uint64_t start = now_ns();
+	out_seg *before = c->out_tail;
+	if(hdr.opcode < STAT_OPS) stat_add(&shard->bytes_in[hdr.opcode], MSG_HDR_LEN + hdr.length);
+
+	if(hdr.version != PROTO_VERSION) {
+		msg_reply(c, &hdr, STATUS_UNSUPPORTED, 0);
+		if(hdr.opcode == OP_PUT || hdr.opcode == OP_PUT_BATCH) c->closing = 1;
+		return 1;
+	}
+
+	switch(hdr.opcode) {
+	case OP_HELLO: msg_reply(c, &hdr, STATUS_OK, 0); break;
+	case OP_PUT: msg_put(c, &hdr, p); break;
+	case OP_PUT_BATCH: msg_put_batch(c, &hdr, p); break;
+	case OP_GET: msg_get(c, &hdr, p); break;
+	case OP_STAT: msg_stat(c, &hdr, p); break;
+	case OP_LIST: msg_list(c, &hdr, p); break;
+	case OP_HAS: msg_has(c, &hdr, p); break;
+	case OP_PUT_REF: msg_put_ref(c, &hdr, p); break;
+	case OP_SCRUB: msg_scrub(c, &hdr, p); break;
+	case OP_STATS: msg_stats(c, &hdr); break;
+	case OP_DROP: msg_drop(c, &hdr, p); break;
+	default: msg_reply(c, &hdr, STATUS_UNSUPPORTED, 0);
+	}
+	if(hdr.opcode == OP_GET || hdr.opcode == OP_LIST) stat_tag(c, hdr.opcode, start, before);
+	return 1;
+}
+
+//queue a reply header for the request hdr, length bytes of payload have to be queued after it
+void msg_reply(conn *c, msg_hdr *hdr, int status, uint64_t length) {
+	char buf[MSG_HDR_LEN];
+
+	if(hdr->opcode < STAT_OPS) {
+		stat_add(&shard->count[hdr->opcode], 1);
+		if(status != STATUS_OK) stat_add(&shard->errors[hdr->opcode], 1);
+		stat_add(&shard->bytes_out[hdr->opcode], MSG_HDR_LEN + length);
+	}
+	msg_pack(buf, hdr->opcode, status, hdr->id, length);
+	out_append(c, buf, MSG_HDR_LEN);
+}
+
+//pull a length-prefixed string out of a request payload into name, which must hold BUFSIZE bytes
+//returns a pointer just past it, or NULL if it runs past end or is empty
+char *msg_string(char *p, char *end, char *name) {
+	if(end - p < 2) return NULL;
+	int len = get_u16(p);
+	p += 2;
+	if(len == 0 || len >= BUFSIZE || end - p < len) return NULL;
+	memcpy(name, p, len);
+	name[len] = '\0';
+	return p + len;
+}
+
+//the segment new reply bytes should go into, a file or cached region or a timed reply always ends a segment
+out_seg *out_tail_seg(conn *c) {
+	if(c->out_tail && c->out_tail->fd < 0 && c->out_tail->cached == NULL && !c->out_tail->stat_op) return c->out_tail;
+
+	out_seg *seg = calloc(1, sizeof(out_seg));
+	if(seg == NULL) {
+		perror("malloc for reply");
+		return NULL;
+	}
+	seg->fd = -1;
+
+	if(c->out_tail) c->out_tail->next = seg;
+	else c->out_head = seg;
+	c->out_tail = seg;
+	return seg;
+}
+
+//queue bytes to be sent once the socket is writable
+int out_append(conn *c, const char *data, size_t len) {
+	out_seg *seg = out_tail_seg(c);
+	if(seg == NULL) return -1;
+
+	if(seg->len + len > seg->cap) {
+		size_t cap = seg->cap ? seg->cap : BUFSIZE;
+		while(cap < seg->len + len) cap *= 2;
+
+		char *buf = realloc(seg->buf, cap);
+		if(buf == NULL) {
+			perror("growing reply buffer");
 			return -1;
 		}
-		
-		if(counter >= 4 && strcmp(ch_buf - 3, "\r\n\r\n")==0) {
-			return 0;
-		}
-		else
-			ch_buf++;
+		seg->buf = buf;
+		seg->cap = cap;
 	}
-	return 1;
+	memcpy(seg->buf + seg->len, data, len);
+	seg->len += len;
+	return 0;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//queue len bytes of fd starting at off, the reply takes ownership of fd
+int out_file(conn *c, int fd, off_t off, long long len) {
+	out_seg *seg = out_tail_seg(c);
+	if(seg == NULL) {
+		close(fd);
+		return -1;
+	}
+	seg->fd = fd;
+	seg->off = off;
+	seg->remaining = len;
+	return 0;
+}
 
-void list(int sock, char *dfs) {
-	struct dirent *d, *c;
-	DIR *dh, *ch;
-	char buf[BUFSIZE];
-	char subdir[BUFSIZE];
-	int lines = 0;
-	
-	bzero(buf, BUFSIZE);
-	
-	//buffer will have one line per file with all the chunk numbers stored
-	//i.e. each line looks like "filename chunk # ... chunk #\r\n"
-	
-	dh = opendir(dfs);
-	if(!dh) perror("opening directory");
-	
-	//for each element in current directory, add to buffer in a line
-	//skip '.' and '..'
-	while((d = readdir(dh)) != NULL) {
-		if(d->d_name[0] == '.') continue;
-		strncat(buf, d->d_name, BUFSIZE - strlen(buf));
-		
-		//subdir refers to each subdirectory, as files are represented by subdirectories in the DFS
-		bzero(subdir, BUFSIZE);
-		strncpy(subdir, dfs, BUFSIZE - strlen(subdir));
-		strncat(subdir, "/", BUFSIZE - strlen(subdir));
-		strncat(subdir, d->d_name, BUFSIZE - strlen(subdir));
-		
-		ch = opendir(subdir);
-		if(!ch) perror("opening subdirectory");
-		
-		while((c = readdir(ch)) != NULL) {
-			if(c->d_name[0]=='.') continue;
-			
-			strcat(buf, " ");
-			strcat(buf, c->d_name);
-		}
-		
-		strcat(buf, "\r\n\r\n");
-		lines++;
+//queue len bytes of a cached chunk starting at off, the reply takes over our reference to it
+int out_cached(conn *c, cache_entry *e, off_t off, long long len) {
+	out_seg *seg = out_tail_seg(c);
+	if(seg == NULL) {
+		cache_release(e);
+		return -1;
 	}
-	
-	//first we send the length of the buffer with list info, then the buffer
-	socket_write(sock, (char *)&lines, sizeof(int));
-	socket_write(sock, buf, strlen(buf));
+	seg->cached = e;
+	seg->off = off;
+	seg->remaining = len;
+	return 0;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void out_pop(conn *c) {
+	out_seg *seg = c->out_head;
 
-//put stores files in directory given by dir_dfs
-//file is stored as  a directory with same name
-//containing files associated with chunks, named the chunk number
-void put(int sock, char *dir_dfs, char *dir_filename) {
-	FILE *fp;
-	int chunk, chunk_size;
-	int bytes_recvd = 0;
-	
-	//send chunk number and chunk size
-	if(recv(sock, &chunk, sizeof(int), 0) < (ssize_t) sizeof(int)) perror("receving chunk num");
-	if(recv(sock, &chunk_size, sizeof(int), 0) < (ssize_t) sizeof(int)) perror("receiving chunk size");
-	
-	char contents[chunk_size];
-	char file_path[BUFSIZE];
-	bzero(file_path, BUFSIZE);
-	
-	strcpy(file_path, dir_dfs);
-	strcat(file_path, "/");
-	strcat(file_path, dir_filename);
-	
-	mkdir(file_path, 0700);
-	
-	char chunk_toa[10];
-	bzero(chunk_toa, 10);
-	sprintf(chunk_toa, "%d", chunk);
-	
-	strcat(file_path, "/");
-	strcat(file_path, chunk_toa);
-	
-	//hacky way to make sure full amount of content is received
-	while((bytes_recvd += recv(sock, contents + bytes_recvd, chunk_size - bytes_recvd, 0)) < chunk_size);
-	
-	fp = fopen(file_path, "w");
-	
-	if(fwrite(contents, chunk_size, 1, fp) < 1) perror("writing file");
-	
-	fclose(fp);
+	c->out_head = seg->next;
+	if(c->out_head == NULL) c->out_tail = NULL;
+	if(seg->fd >= 0) close(seg->fd);
+	if(seg->cached) cache_release(seg->cached);
+	free(seg->buf);
+	free(seg);
+}
+
+//send as much of the queued reply as the socket will take
+//buffered bytes that have file contents behind them go out with MSG_MORE so a chunk header shares a segment with its first data
+//returns 1 once everything is sent, 0 if the socket is full, -1 if the connection is broken
+int out_flush(conn *c) {
+	while(c->out_head) {
+		out_seg *seg = c->out_head;
+		ssize_t n;
+
+		if(seg->sent < seg->len) {
+			int more = ((seg->fd >= 0 || seg->cached) && seg->remaining > 0) || seg->next != NULL;
+			n = send(c->sock, seg->buf + seg->sent, seg->len - seg->sent, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+			if(n >= 0) seg->sent += n;
+		}
+		else if(seg->fd >= 0 && seg->remaining > 0) {
+			size_t count = seg->remaining > (1 << 30) ? (1 << 30) : seg->remaining;
+			uint64_t start = seg->stat_op ? now_ns() : 0;
+			n = sendfile(c->sock, seg->fd, &seg->off, count);
+			if(seg->stat_op) seg->stat_disk += now_ns() - start;
+
+			//the file got shorter under us, the client would be left waiting for bytes that never come
+			if(n == 0) {
+				fprintf(stderr, "chunk file truncated while sending\n");
+				return -1;
+			}
+			if(n > 0) seg->remaining -= n;
+		}
+		else if(seg->cached && seg->remaining > 0) {
+			size_t count = seg->remaining > (1 << 30) ? (1 << 30) : seg->remaining;
+			n = send(c->sock, seg->cached->data + seg->off, count, MSG_NOSIGNAL | (seg->next ? MSG_MORE : 0));
+			if(n > 0) {
+				seg->off += n;
+				seg->remaining -= n;
+			}
+		}
+		else {
+			if(seg->stat_last) stat_latency(seg->stat_op, now_ns() - seg->stat_start, seg->stat_disk);
+			else if(seg->stat_op && seg->next) seg->next->stat_disk += seg->stat_disk;
+			out_pop(c);
+			continue;
+		}
+
+		if(n > 0) stat_add(&shard->sock_out, n);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if(errno == EINTR) continue;
+			return -1;
+		}
+	}
+	return 1;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void get(int sock, char *filename, char *dfs) {
-	struct dirent *d;
-	DIR *dh;
-	FILE *fp;
-	int max_path_l = strlen(filename) + strlen(dfs) + 20;
-	char dir_path[max_path_l];
-	char chunk_path[max_path_l];
-	int chunk, chunk_size;
-	
-	strcpy(dir_path, dfs);
-	strcat(dir_path, "/");
-	strcat(dir_path, filename);
-	
-	dh = opendir(dir_path);
+//buffer will have one line per file with all the chunk numbers stored
+//i.e. each line looks like "filename chunk # ... chunk #\r\n\r\n"
+//if we know how many chunks the file was split into, that goes on a "chunks <n>" line after the chunk numbers
+//
+//the optional headers narrow the listing: "prefix <p>" only lists files starting with p,
+//"limit <n>" lists at most n files and "after <cursor>" resumes where a previous page stopped
+//a paged reply (one with a limit) has the cursor for the next page, or -1, right after the line count
+void list(conn *c, char *prefix, char *after, char *limit) {
+	int lines = 0, next = -1;
+	int start = after ? atoi(after) : 0;
+	int max_lines = limit ? atoi(limit) : -1;
+	int prefix_len = 0;
+	char *prefix_end;
+
+	if(prefix != NULL) {
+		prefix_end = strstr(prefix, "\r\n");
+		prefix_len = prefix_end ? prefix_end - prefix : (int) strlen(prefix);
+	}
+	if(start < 0) start = 0;
+
+	//header goes first, it's filled in once we know how many lines there are
+	out_seg *seg = out_tail_seg(c);
+	if(seg == NULL) return;
+	size_t header_at = seg->len;
+	out_append(c, (char *)&lines, sizeof(int));
+	if(limit) out_append(c, (char *)&next, sizeof(int));
+
+	pthread_rwlock_rdlock(&meta.lock);
+	for(int i = start; i < meta.num_entries; i++) {
+		file_entry *f = &meta.entries[i];
+		char num[32];
+
+		if(prefix_len && strncmp(f->name, prefix, prefix_len) != 0) continue;
+		if(max_lines >= 0 && lines == max_lines) {
+			next = i;
+			break;
+		}
+
+		out_append(c, f->name, strlen(f->name));
+		for(int j = 0; j < f->num_chunks; j++) {
+			if(f->chunks[j].gen != f->gen) continue;
+			int len = sprintf(num, " %d", f->chunks[j].chunk);
+			out_append(c, num, len);
+		}
+		if(f->count > 0) {
+			int len = sprintf(num, "\r\nchunks %d", f->count);
+			out_append(c, num, len);
+		}
+		out_append(c, "\r\n\r\n", 4);
+		lines++;
+	}
+	pthread_rwlock_unlock(&meta.lock);
+
+	memcpy(seg->buf + header_at, &lines, sizeof(int));
+	if(limit) memcpy(seg->buf + header_at + sizeof(int), &next, sizeof(int));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//put stores files in directory given by dir_dfs
+//file is stored as  a directory with same name
+//containing files associated with chunks, named the chunk number
+//the chunk header and contents arrive later, so this only remembers where they go
+//chunk_count is the number of chunks the whole file was split into, 0 if the client didn't say
+void put(conn *c, char *dir_dfs, char *dir_filename, int chunk_count) {
+	free(c->put_path);
+	c->put_path = malloc(strlen(dir_dfs) + strlen(dir_filename) + 2);
+	if(c->put_path == NULL) {
+		perror("malloc for put path");
+		c->closing = 1;
+		return;
+	}
+
+	strcpy(c->put_path, dir_dfs);
+	strcat(c->put_path, "/");
+	strcat(c->put_path, dir_filename);
+	c->put_name = c->put_path + strlen(dir_dfs) + 1;
+
+	c->put_count = chunk_count;
+	c->put_v2 = 0;
+	c->put_check = 0;
+	c->put_raw = 0;
+	c->put_gen = 0;
+	c->state = CONN_PUT_HDR;
+}
+
+//called once the chunk header has arrived, opens a temporary file for the contents,
+//or with -s reserves a record for them in the active segment and writes its (uncommitted) header
+//if the chunk can't be stored the contents are still read and thrown away, and the failure is reported afterwards
+//returns -1 if the connection should be dropped
+int put_begin(conn *c, int chunk, long long chunk_size) {
+	c->put_chunk = chunk;
+	c->put_size = chunk_size;
+	c->put_remaining = chunk_size;
+	c->put_error = 0;
+	c->put_corrupt = 0;
+	c->put_off = 0;
+	c->put_crc = 0;
+	c->put_start = now_ns();
+	c->put_disk = 0;
+	chash_init(&c->put_hash);
+	c->state = CONN_PUT_BODY;
+
+	//the hash and crc aren't known until the contents are in, so there's a gap for them (and the raw length and generation)
+	//after the name
+	if(config.segments) {
+		int flags = SEG_HASHED | SEG_CRC | (c->put_raw ? SEG_LZ : 0) | (c->put_gen ? SEG_GEN : 0);
+		int name_len = strlen(c->put_name), sums_len = seg_sums_len(flags);
+		char hdr[SEG_HDR_LEN + name_len];
+
+		c->put_seg = -1;
+		c->put_fd = store_reserve(SEG_HDR_LEN + name_len + sums_len + chunk_size, &c->put_seg, &c->put_rec);
+		c->put_off = c->put_rec + SEG_HDR_LEN + name_len + sums_len;
+
+		put_u32(hdr, SEG_MAGIC);
+		hdr[4] = 0;
+		hdr[5] = flags;
+		put_u16(hdr + 6, name_len);
+		put_u32(hdr + 8, chunk);
+		put_u32(hdr + 12, c->put_count);
+		put_u64(hdr + 16, chunk_size);
+		memcpy(hdr + SEG_HDR_LEN, c->put_name, name_len);
+		if(c->put_fd < 0 || pwrite(c->put_fd, hdr, sizeof(hdr), c->put_rec) != (ssize_t) sizeof(hdr)) {
+			perror("writing segment record");
+			c->put_error = 1;
+		}
+		if(ring && !c->put_error && ring->num_free_files > 0 &&
+		   uring_update_file(&ring->ring, ring->free_files[ring->num_free_files - 1], c->put_fd) == 0)
+			c->put_file = ring->free_files[--ring->num_free_files];
+
+		if(chunk_size == 0) put_finish(c);
+		return 0;
+	}
+
+	c->put_tmp = malloc(strlen(c->put_path) + 20);
+	if(c->put_tmp == NULL) {
+		perror("malloc for put path");
+		return -1;
+	}
+
+	mkdir(c->put_path, 0700);
+
+	//a leading '.' keeps partial chunks out of list and get
+	sprintf(c->put_tmp, "%s/.%d.part", c->put_path, chunk);
+	c->put_fd = open(c->put_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(c->put_fd < 0) {
+		perror("opening chunk file");
+		c->put_error = 1;
+	}
+	if(ring && !c->put_error && ring->num_free_files > 0 &&
+	   uring_update_file(&ring->ring, ring->free_files[ring->num_free_files - 1], c->put_fd) == 0)
+		c->put_file = ring->free_files[--ring->num_free_files];
+
+	if(chunk_size == 0) put_finish(c);
+	return 0;
+}
+
+//write whatever part of the chunk is buffered straight to disk, at put_off in the temporary file or segment
+//(or with -u, queue the writes on the loop's ring)
+//if the disk fails we keep consuming the chunk so the next command still lines up, then drop it
+void put_write(conn *c) {
+	size_t n = rbuf_len(&c->in);
+	if((long long) n > c->put_remaining) n = c->put_remaining;
+
+	char *data = rbuf_peek(&c->in);
+	size_t written = 0;
+	uint64_t start = now_ns();
+	if(ring && !c->put_error) {
+		ring_write(c, data, n);
+		written = n;
+	}
+	while(!c->put_error && written < n) {
+		ssize_t w = pwrite(c->put_fd, data + written, n - written, c->put_off + written);
+		if(w < 0) {
+			if(errno == EINTR) continue;
+			perror("writing file");
+			c->put_error = 1;
+			break;
+		}
+		written += w;
+	}
+	c->put_disk += now_ns() - start;
+
+	if(!c->put_error) {
+		chash_update(&c->put_hash, data, n);
+		c->put_crc = crc32c(c->put_crc, data, n);
+	}
+	rbuf_consume(&c->in, n);
+	c->put_off += n;
+	c->put_remaining -= n;
+	if(c->put_remaining == 0) put_finish(c);
+}
+
+//called once all of a chunk's contents have been received
+void put_finish(conn *c) {
+	char file_path[strlen(c->put_path) + 20];
+	char body_tmp[strlen(config.dfs) + 64];
+	int name_len = strlen(c->put_name);
+	chunk_info ci = { .chunk = c->put_chunk, .seg = c->put_seg, .size = c->put_size, .off = c->put_rec,
+	                  .flags = SEG_HASHED | SEG_CRC | (c->put_raw ? SEG_LZ : 0) | (c->put_gen ? SEG_GEN : 0),
+	                  .crc = c->put_crc, .raw = c->put_raw, .gen = c->put_gen };
+	char sums[CHASH_LEN + 20];
+	int sums_len, changed = 0, have_body_tmp = 0;
+	uint64_t start = now_ns();
+
+	ring_settle(c);
+
+	//contents that were damaged on the way are never stored, the client sends them again
+	if(!c->put_error && c->put_check && ci.crc != c->put_expect) {
+		fprintf(stderr, "Checksum mismatch on chunk %d of %s\n", c->put_chunk, c->put_name);
+		c->put_error = 1;
+		c->put_corrupt = 1;
+	}
+
+	//a put that's older than one we already hold chunks of lost to it, its chunks mustn't replace the newer ones
+	if(!c->put_error && meta_stale(c->put_name, c->put_gen)) {
+		fprintf(stderr, "Chunk %d of %s is from an older put than the file\n", c->put_chunk, c->put_name);
+		c->put_error = 1;
+	}
+
+	chash_final(&c->put_hash, ci.hash);
+	sums_len = seg_sums(sums, &ci);
+	sprintf(file_path, "%s/%d", c->put_path, c->put_chunk);
+	if(c->put_tmp == NULL) {
+		//a segment record only counts once it's committed, which must come after its hash, crc and contents
+		if(!c->put_error && pwrite(c->put_fd, sums, sums_len, c->put_rec + SEG_HDR_LEN + name_len) != sums_len) {
+			perror("writing segment record");
+			c->put_error = 1;
+		}
+		if(!c->put_error && pwrite(c->put_fd, "\1", 1, c->put_rec + 4) != 1) {
+			perror("committing segment record");
+			c->put_error = 1;
+		}
+	}
+	else {
+		//without the attributes the crc is still in the index, only a rescan loses it,
+		//but a rescan can't tell compressed contents from any others, so that one has to stick
+		if(!c->put_error) fsetxattr(c->put_fd, CRC_XATTR, sums + CHASH_LEN, 4, 0);
+		if(!c->put_error && c->put_raw && fsetxattr(c->put_fd, LZ_XATTR, sums + CHASH_LEN + 4, 8, 0) < 0) {
+			perror("marking chunk compressed");
+			c->put_error = 1;
+		}
+		if(c->put_fd >= 0 && close(c->put_fd) < 0) {
+			perror("closing chunk file");
+			c->put_error = 1;
+		}
+
+		//a second link to the contents, which becomes <dfs>/.cas/<hash> if nothing else we hold has them
+		sprintf(body_tmp, "%s/.cas/.%p.part", config.dfs, (void *) c);
+		if(!c->put_error) have_body_tmp = link(c->put_tmp, body_tmp) == 0;
+
+		if(c->put_error)
+			unlink(c->put_tmp);
+		else if(rename(c->put_tmp, file_path) < 0) {
+			perror("renaming chunk file");
+			c->put_error = 1;
+		}
+	}
+
+	if(!c->put_error) {
+		changed = meta_record(c->put_name, &ci, c->put_count, have_body_tmp ? body_tmp : NULL);
+		if(changed < 0) c->put_error = 1;
+	}
+	if(have_body_tmp) unlink(body_tmp);
+
+	if(c->put_error) {
+		c->put_failures++;
+		if(c->put_seg >= 0) store_dead(c->put_seg, chunk_len(c->put_name, &ci));
+	}
+	//the .chunks file lets a rescan recover the count and generation, it's only rewritten when they change
+	//segment records carry them themselves
+	else if(changed > 0 && c->put_tmp != NULL)
+		write_chunk_count(c->put_path, c->put_count, c->put_gen);
+
+	if(c->put_seg >= 0) store_done(c->put_seg);
+	c->put_seg = -1;
+	c->put_fd = -1;
+	free(c->put_tmp);
+	c->put_tmp = NULL;
+	stat_latency(OP_PUT, now_ns() - c->put_start, c->put_disk + now_ns() - start);
+
+	//v2 puts are answered one by one, batches once every file is in, and text puts wait for sync
+	if(c->batch_files > 0) {
+		if(c->put_error) {
+			if(c->batch_num_failed == c->batch_cap_failed) {
+				int cap = c->batch_cap_failed ? 2*c->batch_cap_failed : 16;
+				uint32_t *failed = realloc(c->batch_failed, cap * sizeof(uint32_t));
+				if(failed == NULL) {
+					perror("malloc for batch");
+					c->closing = 1;
+					return;
+				}
+				c->batch_failed = failed;
+				c->batch_cap_failed = cap;
+			}
+			c->batch_failed[c->batch_num_failed++] = c->batch_done;
+		}
+		c->batch_done++;
+		c->state = CONN_BATCH;
+		if(c->batch_done == c->batch_files) msg_batch_reply(c);
+	}
+	else if(c->put_v2) {
+		msg_hdr hdr = { .opcode = OP_PUT, .id = c->put_id };
+		msg_reply(c, &hdr, c->put_corrupt ? STATUS_BAD_CHECKSUM : c->put_error ? STATUS_IO_ERROR : STATUS_OK, 0);
+		c->state = CONN_MSG;
+	}
+	else
+		c->state = CONN_CMD;
+}
+
+//throw away a partially received chunk
+void put_abort(conn *c) {
+	ring_settle(c);
+	if(c->put_tmp == NULL) {
+		if(c->put_seg >= 0) {
+			int flags = SEG_HASHED | SEG_CRC | (c->put_raw ? SEG_LZ : 0) | (c->put_gen ? SEG_GEN : 0);
+			store_dead(c->put_seg, SEG_HDR_LEN + strlen(c->put_name) + seg_sums_len(flags) + c->put_size);
+			store_done(c->put_seg);
+		}
+		c->put_seg = -1;
+		c->put_fd = -1;
+		return;
+	}
+
+	if(c->put_fd >= 0) close(c->put_fd);
+	c->put_fd = -1;
+	unlink(c->put_tmp);
+	free(c->put_tmp);
+	c->put_tmp = NULL;
+
+	//only succeeds if this was the file's first chunk
+	rmdir(c->put_path);
+}
+
+//commands on a connection run in order, so by the time we see sync every earlier put has been stored
+//reply with the number of chunks that failed since the last sync, 0 means everything made it
+void sync_puts(conn *c) {
+	out_append(c, (char *)&c->put_failures, sizeof(int));
+	c->put_failures = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//only the shard's own loop writes to it, so this is a plain add that a report can still read whole
+void stat_add(uint64_t *count, uint64_t n) {
+	__atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+//which histograms an opcode has, -1 if it has none
+int stat_timed(int opcode) {
+	if(opcode == OP_LIST) return STAT_LIST;
+	if(opcode == OP_PUT) return STAT_PUT;
+	if(opcode == OP_GET) return STAT_GET;
+	return -1;
+}
+
+//count one request of a timed opcode that took total nanoseconds, disk of them on disk
+void stat_latency(int opcode, uint64_t total, uint64_t disk) {
+	uint64_t parts[STAT_PARTS] = { total, disk, total > disk ? total - disk : 0 };
+	int timed = stat_timed(opcode);
+
+	if(shard == NULL || timed < 0) return;
+	for(int i = 0; i < STAT_PARTS; i++) {
+		uint64_t us = parts[i] / 1000;
+		int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+		if(bucket >= STAT_BUCKETS) bucket = STAT_BUCKETS - 1;
+		stat_add(&shard->hist[timed][i][bucket], 1);
+	}
+}
+
+//mark the segments of the reply just queued (the ones after before), so its latency is recorded once the last is sent
+//the time it took to build counts as disk time, and so does the time sendfile spends reading out any of its segments
+void stat_tag(conn *c, int opcode, uint64_t start, out_seg *before) {
+	out_seg *seg = before ? before->next : c->out_head;
+
+	//a reply that went entirely into the buffer of the segment before it is timed with that segment
+	if(seg == NULL) seg = before;
+	if(seg == NULL || seg->stat_last) return;
+	for(; seg != c->out_tail; seg = seg->next) seg->stat_op = opcode;
+	seg->stat_op = opcode;
+	seg->stat_last = 1;
+	seg->stat_start = start;
+	seg->stat_disk = now_ns() - start;
+}
+
+//the report, a line per count and per histogram:
+//	uptime <seconds>, connections <open>, threads <event loops>, bytes_in/bytes_out <through our sockets>
+//	cache budget <bytes> bytes <cached> entries <chunks cached> hits <n> misses <n> bypassed <n> evictions <n> hit_rate <0-1>,
+//	with -m
+//	op <name> count <n> errors <n> bytes_in <n> bytes_out <n>, for each opcode that's been used
+//	latency <op> <total|disk|network> p50 <us> p99 <us> p999 <us> buckets <us>:<count> ...,
+//	where a percentile is the upper end of the bucket it falls in and a bucket holds latencies under its us
+//returns the report's length
+int stats_format(char *buf, int cap) {
+	static const char *op_names[STAT_OPS] = { [OP_HELLO] = "hello", [OP_PUT] = "put", [OP_GET] = "get", [OP_STAT] = "stat",
+		[OP_LIST] = "list", [OP_PUT_BATCH] = "put_batch", [OP_HAS] = "has", [OP_PUT_REF] = "put_ref", [OP_SCRUB] = "scrub",
+		[OP_STATS] = "stats", [OP_DROP] = "drop" };
+	static const char *timed_names[STAT_TIMED] = { "list", "put", "get" };
+	static const char *part_names[STAT_PARTS] = { "total", "disk", "network" };
+	stat_shard sum;
+	int len = 0;
+
+	memset(&sum, 0, sizeof(sum));
+	for(int s = 0; s < stats.num_shards; s++) {
+		uint64_t *from = (uint64_t *) &stats.shards[s], *to = (uint64_t *) &sum;
+		for(size_t i = 0; i < sizeof(stat_shard) / sizeof(uint64_t); i++)
+			to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	}
+
+	len += snprintf(buf + len, cap - len, "uptime %ld\nconnections %d\nthreads %d\nbytes_in %llu\nbytes_out %llu\n",
+	                (long)(time(NULL) - stats.started), __atomic_load_n(&active_conns, __ATOMIC_RELAXED), config.threads,
+	                (unsigned long long) sum.sock_in, (unsigned long long) sum.sock_out);
+	if(cache.shards != NULL) {
+		long long bytes = 0;
+		int entries = 0;
+		uint64_t evictions = 0, lookups = sum.cache_hits + sum.cache_misses;
+		for(int i = 0; i < CACHE_SHARDS; i++) {
+			pthread_mutex_lock(&cache.shards[i].lock);
+			bytes += cache.shards[i].bytes;
+			entries += cache.shards[i].entries;
+			evictions += cache.shards[i].evictions;
+			pthread_mutex_unlock(&cache.shards[i].lock);
+		}
+		len += snprintf(buf + len, cap - len,
+		                "cache budget %lld bytes %lld entries %d hits %llu misses %llu bypassed %llu evictions %llu hit_rate %.3f\n",
+		                config.cache_bytes, bytes, entries, (unsigned long long) sum.cache_hits,
+		                (unsigned long long) sum.cache_misses, (unsigned long long) sum.cache_bypassed,
+		                (unsigned long long) evictions, lookups ? (double) sum.cache_hits / lookups : 0.0);
+	}
+	for(int op = 0; op < STAT_OPS && len < cap; op++) {
+		if(sum.count[op] == 0 || op_names[op] == NULL) continue;
+		len += snprintf(buf + len, cap - len, "op %s count %llu errors %llu bytes_in %llu bytes_out %llu\n", op_names[op],
+		                (unsigned long long) sum.count[op], (unsigned long long) sum.errors[op],
+		                (unsigned long long) sum.bytes_in[op], (unsigned long long) sum.bytes_out[op]);
+	}
+
+	for(int t = 0; t < STAT_TIMED && len < cap; t++) {
+		for(int part = 0; part < STAT_PARTS && len < cap; part++) {
+			uint64_t *hist = sum.hist[t][part], total = 0, seen = 0;
+			uint64_t pct[3] = { 0, 0, 0 };
+			for(int b = 0; b < STAT_BUCKETS; b++) total += hist[b];
+			if(total == 0) continue;
+
+			for(int b = 0; b < STAT_BUCKETS; b++) {
+				seen += hist[b];
+				if(!pct[0] && seen * 100 >= total * 50) pct[0] = 1ULL << b;
+				if(!pct[1] && seen * 100 >= total * 99) pct[1] = 1ULL << b;
+				if(!pct[2] && seen * 1000 >= total * 999) pct[2] = 1ULL << b;
+			}
+			len += snprintf(buf + len, cap - len, "latency %s %s p50 %llu p99 %llu p999 %llu buckets", timed_names[t], part_names[part],
+			                (unsigned long long) pct[0], (unsigned long long) pct[1], (unsigned long long) pct[2]);
+			for(int b = 0; b < STAT_BUCKETS && len < cap; b++)
+				if(hist[b]) len += snprintf(buf + len, cap - len, " %llu:%llu", 1ULL << b, (unsigned long long) hist[b]);
+			if(len < cap) len += snprintf(buf + len, cap - len, "\n");
+		}
+	}
+	return len < cap ? len : cap - 1;
+}
+
+void msg_stats(conn *c, msg_hdr *hdr) {
+	char buf[STATS_BUFSIZE];
+	int len = stats_format(buf, sizeof(buf));
+
+	msg_reply(c, hdr, STATUS_OK, len);
+	out_append(c, buf, len);
+}
+
+//write the report to everyone who connects to the admin port, one at a time
+void *admin_thread(void *args) {
+	int listen_sock = (int)(long) args;
+	char buf[STATS_BUFSIZE];
+
+	while(1) {
+		int sock = accept(listen_sock, NULL, NULL);
+		if(sock < 0) {
+			if(errno != EINTR) perror("accepting admin connection");
+			continue;
+		}
+		int len = stats_format(buf, sizeof(buf));
+		for(int sent = 0, n; sent < len; sent += n)
+			if((n = send(sock, buf + sent, len - sent, MSG_NOSIGNAL)) <= 0) break;
+		close(sock);
+	}
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int cache_init() {
+	cache.shards = calloc(CACHE_SHARDS, sizeof(cache_shard));
+	if(cache.shards == NULL) {
+		perror("malloc for chunk cache");
+		return -1;
+	}
+	for(int i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_init(&cache.shards[i].lock, NULL);
+	}
+	cache.budget = config.cache_bytes / CACHE_SHARDS;
+	cache.max_entry = cache.budget / 2;
+	return 0;
+}
+
+//open a chunk to send, like open_chunk, except that with the cache a chunk it has comes back in hit instead
+//(with off 0 and no fd), and a chunk it doesn't have is read into it if it's small enough
+//returns the chunk's fd, or -1 with hit set if it's cached, or -1 with hit NULL if we don't have it
+//a get that misses on a chunk another get is reading in gets the chunk's fd, waiting for that read would hold up
+//every connection on its event loop
+int cache_open(char *name, int chunk, long long *size, off_t *off, cache_entry **hit) {
+	*hit = NULL;
+	if(cache.shards == NULL) return open_chunk(name, chunk, size, off, NULL);
+
+	unsigned long h = cache_hash(name, chunk);
+	cache_shard *s = &cache.shards[h % CACHE_SHARDS];
+	cache_entry *e;
+
+	pthread_mutex_lock(&s->lock);
+	e = cache_find(s, name, chunk, h);
+	if(e && e->loading) {
+		pthread_mutex_unlock(&s->lock);
+		stat_add(&shard->cache_misses, 1);
+		stat_add(&shard->cache_bypassed, 1);
+		return open_chunk(name, chunk, size, off, NULL);
+	}
+	if(e) {
+		e->refs++;
+		if(e != s->head) {
+			e->prev->next = e->next;
+			if(e->next) e->next->prev = e->prev;
+			else s->tail = e->prev;
+			e->prev = NULL;
+			e->next = s->head;
+			s->head->prev = e;
+			s->head = e;
+		}
+		pthread_mutex_unlock(&s->lock);
+		stat_add(&shard->cache_hits, 1);
+		*hit = e;
+		*size = e->size;
+		*off = 0;
+		return -1;
+	}
+
+	//anyone else after this chunk finds the placeholder and reads it from its file until we've read it in
+	e = calloc(1, sizeof(cache_entry));
+	if(e) e->name = strdup(name);
+	if(e && e->name) {
+		e->chunk = chunk;
+		e->shard = h % CACHE_SHARDS;
+		e->refs = 2;
+		e->loading = 1;
+		e->hnext = s->buckets[h / CACHE_SHARDS % CACHE_BUCKETS];
+		s->buckets[h / CACHE_SHARDS % CACHE_BUCKETS] = e;
+	}
+	else if(e) {
+		free(e);
+		e = NULL;
+	}
+	pthread_mutex_unlock(&s->lock);
+	stat_add(&shard->cache_misses, 1);
+
+	int fd = open_chunk(name, chunk, size, off, NULL);
+	if(e == NULL) return fd;
+
+	char *data = NULL;
+	long long done = 0;
+	if(fd >= 0 && *size <= cache.max_entry && (data = malloc(*size > 0 ? *size : 1)) != NULL) {
+		while(done < *size) {
+			ssize_t n = pread(fd, data + done, *size - done, *off + done);
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) break;
+			done += n;
+		}
+	}
+
+	pthread_mutex_lock(&s->lock);
+	e->loading = 0;
+
+	//put may have stored the chunk again while we were reading it, then what we read mustn't stay
+	if(data == NULL || done < *size || e->dead) {
+		free(data);
+		if(!e->dead) cache_drop(s, e);
+		cache_unref(e);
+		pthread_mutex_unlock(&s->lock);
+		return fd;
+	}
+
+	e->data = data;
+	e->size = *size;
+	e->next = s->head;
+	if(s->head) s->head->prev = e;
+	else s->tail = e;
+	s->head = e;
+	s->bytes += e->size;
+	s->entries++;
+	while(s->bytes > cache.budget && s->tail != e) {
+		cache_drop(s, s->tail);
+		s->evictions++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	close(fd);
+	*hit = e;
+	*off = 0;
+	return -1;
+}
+
+//the entry for chunk of name in shard s, h being its cache_hash, or NULL
+cache_entry *cache_find(cache_shard *s, char *name, int chunk, unsigned long h) {
+	cache_entry *e = s->buckets[h / CACHE_SHARDS % CACHE_BUCKETS];
+
+	while(e && (e->chunk != chunk || strcmp(e->name, name) != 0)) e = e->hnext;
+	return e;
+}
+
+//take an entry out of the cache, it's freed once nothing's sending from it any more
+//caller holds s->lock
+void cache_drop(cache_shard *s, cache_entry *e) {
+	cache_entry **p = &s->buckets[cache_hash(e->name, e->chunk) / CACHE_SHARDS % CACHE_BUCKETS];
+
+	while(*p != e) p = &(*p)->hnext;
+	*p = e->hnext;
+	if(!e->loading && e->data) {
+		if(e->prev) e->prev->next = e->next;
+		else s->head = e->next;
+		if(e->next) e->next->prev = e->prev;
+		else s->tail = e->prev;
+		s->bytes -= e->size;
+		s->entries--;
+	}
+	e->dead = 1;
+	cache_unref(e);
+}
+
+//caller holds the lock of the entry's shard
+void cache_unref(cache_entry *e) {
+	if(--e->refs > 0) return;
+	free(e->data);
+	free(e->name);
+	free(e);
+}
+
+//done sending from a cached chunk
+void cache_release(cache_entry *e) {
+	cache_shard *s = &cache.shards[e->shard];
+
+	pthread_mutex_lock(&s->lock);
+	cache_unref(e);
+	pthread_mutex_unlock(&s->lock);
+}
+
+//drop chunk of name from the cache, if it's there or being read in
+//called with meta.lock held, which is fine since nothing holds a shard's lock while waiting on meta.lock
+void cache_forget(char *name, int chunk) {
+	if(cache.shards == NULL) return;
+
+	unsigned long h = cache_hash(name, chunk);
+	cache_shard *s = &cache.shards[h % CACHE_SHARDS];
+
+	pthread_mutex_lock(&s->lock);
+	cache_entry *e = cache_find(s, name, chunk, h);
+	if(e) cache_drop(s, e);
+	pthread_mutex_unlock(&s->lock);
+}
+
+unsigned long cache_hash(char *name, int chunk) {
+	return name_hash(name) ^ ((unsigned long) chunk * 0x9e3779b97f4a7c15UL);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//set up the calling event loop's ring, returns NULL (and the loop writes with pwrite) if it can't be had
+//buffers that can't be registered are still used, as plain writes, and so are files that can't be
+disk_ring *ring_open() {
+	disk_ring *r = calloc(1, sizeof(disk_ring));
+	if(r == NULL) {
+		perror("malloc for io_uring");
+		return NULL;
+	}
+	if(uring_init(&r->ring, RING_BUFS) < 0) {
+		perror("setting up io_uring");
+		free(r);
+		return NULL;
+	}
+	if(posix_memalign((void **) &r->bufs, 4096, (size_t) RING_BUFS * RING_BUFSIZE) != 0) {
+		perror("malloc for io_uring buffers");
+		uring_exit(&r->ring);
+		free(r);
+		return NULL;
+	}
+
+	struct iovec iov[RING_BUFS];
+	for(int i = 0; i < RING_BUFS; i++) {
+		iov[i].iov_base = r->bufs + (size_t) i * RING_BUFSIZE;
+		iov[i].iov_len = RING_BUFSIZE;
+		r->free_bufs[r->num_free_bufs++] = i;
+	}
+	r->fixed_bufs = uring_register_buffers(&r->ring, iov, RING_BUFS) == 0;
+	if(uring_register_files(&r->ring, RING_FILES) == 0)
+		for(int i = 0; i < RING_FILES; i++) r->free_files[r->num_free_files++] = i;
+	return r;
+}
+
+//queue writes of n bytes of data at put_off in the chunk being put, and submit them
+//waits for earlier writes to finish when every buffer is in use, so a fast client can only get RING_BUFS ahead of the disk
+void ring_write(conn *c, char *data, size_t n) {
+	long long off = c->put_off;
+
+	while(n > 0) {
+		if(ring->num_free_bufs == 0) ring_reap(1);
+		if(c->put_error) return;
+
+		int b = ring->free_bufs[--ring->num_free_bufs];
+		unsigned len = n < RING_BUFSIZE ? n : RING_BUFSIZE;
+		char *buf = ring->bufs + (size_t) b * RING_BUFSIZE;
+		memcpy(buf, data, len);
+
+		//there's an entry for every buffer, so one is always free once a buffer is
+		struct io_uring_sqe *sqe = uring_sqe(&ring->ring);
+		sqe->opcode = ring->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = c->put_file >= 0 ? c->put_file : c->put_fd;
+		if(c->put_file >= 0) sqe->flags = IOSQE_FIXED_FILE;
+		sqe->off = off;
+		sqe->addr = (uint64_t)(uintptr_t) buf;
+		sqe->len = len;
+		sqe->buf_index = b;
+		sqe->user_data = b;
+		ring->owner[b] = c;
+		ring->len[b] = len;
+		c->put_inflight++;
+
+		data += len;
+		off += len;
+		n -= len;
+	}
+	ring_reap(0);
+}
+
+//submit whatever's queued, wait for at least wait writes to finish, then take in every finished one
+//a write that failed fails its chunk
+void ring_reap(unsigned wait) {
+	struct io_uring_cqe *cqe;
+
+	if(uring_submit(&ring->ring, wait) < 0) {
+		//nothing we queued will complete, so every chunk with writes in flight is lost
+		perror("submitting to io_uring");
+		for(int b = 0; b < RING_BUFS; b++) {
+			if(ring->owner[b] == NULL) continue;
+			ring->owner[b]->put_error = 1;
+			ring->owner[b]->put_inflight--;
+			ring->owner[b] = NULL;
+			ring->free_bufs[ring->num_free_bufs++] = b;
+		}
+		return;
+	}
+	while((cqe = uring_cqe(&ring->ring)) != NULL) {
+		int b = cqe->user_data;
+		conn *c = ring->owner[b];
+
+		if(cqe->res != (int) ring->len[b]) {
+			errno = cqe->res < 0 ? -cqe->res : ENOSPC;
+			perror("writing file");
+			c->put_error = 1;
+		}
+		c->put_inflight--;
+		ring->owner[b] = NULL;
+		ring->free_bufs[ring->num_free_bufs++] = b;
+		uring_seen(&ring->ring);
+	}
+}
+
+//wait for every write of c's chunk and give back its place in the file table, before the chunk is finished or dropped
+void ring_settle(conn *c) {
+	if(ring == NULL) return;
+	while(c->put_inflight > 0) ring_reap(1);
+	if(c->put_file >= 0) {
+		uring_update_file(&ring->ring, c->put_file, -1);
+		ring->free_files[ring->num_free_files++] = c->put_file;
+		c->put_file = -1;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//with no chunk list, send every chunk we have of the file
+//with a chunk list ("chunks 0 2"), send exactly those chunks in that order, with a chunk num of -1 for any we don't have
+//chunks are sent as they're stored, text clients never compress so they never get back compressed ones of their own
+void get(conn *c, char *filename, char *chunk_list) {
+	int chunk;
+
+	if(chunk_list != NULL) {
+		char *end;
+		chunk = strtol(chunk_list, &end, 10);
+		while(end != chunk_list) {
+			if(get_chunk(c, filename, chunk) < 0) {
+				int missing = -1;
+				out_append(c, (char *)&missing, sizeof(int));
+			}
+			chunk_list = end;
+			chunk = strtol(chunk_list, &end, 10);
+		}
+		return;
+	}
+
+	//copy the chunk list out of the index so we aren't holding the lock while opening files
+	pthread_rwlock_rdlock(&meta.lock);
+	file_entry *f = meta_lookup(filename);
+	int num_chunks = f ? f->num_chunks : 0;
+	int chunks[num_chunks > 0 ? num_chunks : 1];
+	for(int i = 0; i < num_chunks; i++)
+		chunks[i] = f->chunks[i].chunk;
+	pthread_rwlock_unlock(&meta.lock);
+
+	if(num_chunks == 0) {
+		//if server doesn't have file, send chunk num of -1 as sentinel value to let client know
+		chunk = -1;
+		out_append(c, (char *)&chunk, sizeof(int));
+		return;
+	};
+
+	for(int i = 0; i < num_chunks; i++)
+		get_chunk(c, filename, chunks[i]);
+}
+
+//queue one chunk's header and contents, returns -1 if we don't have it
+int get_chunk(conn *c, char *filename, int chunk) {
+	long long size;
+	off_t off;
+	int chunk_size, fd;
+	cache_entry *hit;
+
+	fd = cache_open(filename, chunk, &size, &off, &hit);
+	if(fd < 0 && hit == NULL) return -1;
+	chunk_size = size;
+
+	//header is buffered, the contents are sent from the file (or the cache) when the socket is ready
+	out_append(c, (char *)&chunk, sizeof(int));
+	out_append(c, (char *)&chunk_size, sizeof(int));
+	if(hit) out_cached(c, hit, 0, chunk_size);
+	else out_file(c, fd, off, chunk_size);
+	return 0;
+}
+
+//open a stored chunk and find where its contents start and how big they are, returns -1 if we don't have it
+//a chunk in a segment comes back as a dup of the segment's fd, which stays readable even if the segment is compacted away
+//a chunk stored by reference is read from the contents it points at
+//info (if not NULL) gets a copy of what the index says about the chunk
+int open_chunk(char *filename, int chunk, long long *size, off_t *off, chunk_info *info) {
+	struct stat st;
+	char path[strlen(config.dfs) + strlen(filename) + 2*CHASH_LEN + 20];
+	int fd = -1, seg = -1, found = 0;
+	long long data = 0;
+
+	sprintf(path, "%s/%s/%d", config.dfs, filename, chunk);
+
+	pthread_rwlock_rdlock(&meta.lock);
+	file_entry *f = meta_lookup(filename);
+	chunk_info *ci = f ? meta_chunk(f, chunk) : NULL;
+	if(ci) {
+		found = 1;
+		if(info) *info = *ci;
+		seg = ci->seg;
+		data = chunk_data(filename, ci);
+		if(ci->flags & SEG_REF) {
+			cas_body *b = cas_lookup(ci->hash);
+			found = b != NULL;
+			if(b) {
+				seg = b->seg;
+				data = b->off + b->len - b->size;
+				if(seg < 0) cas_path(path, b->hash);
+			}
+		}
+	}
+	if(found && seg >= 0) {
+		//the index can't move the contents while we hold the read lock, so their segment is still open
+		pthread_mutex_lock(&store.lock);
+		if(seg < store.num_segs && store.segs[seg].fd >= 0)
+			fd = dup(store.segs[seg].fd);
+		pthread_mutex_unlock(&store.lock);
+	}
+	if(found) *size = ci->size;
+	pthread_rwlock_unlock(&meta.lock);
+
+	if(!found) return -1;
+	if(seg >= 0) {
+		*off = data;
+		return fd;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) < 0) {
+		perror("reading chunk size");
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	*off = 0;
+	return fd;
+}
+
+//tell the client which chunks of a file we have and how big they are, without sending any contents
+//reply is the number of chunks we have, how many the file was split into (0 if we don't know),
+//then a chunk num and chunk size for each
+void stat_file(conn *c, char *filename) {
+	int count = 0, total = 0;
+
+	pthread_rwlock_rdlock(&meta.lock);
+	file_entry *f = meta_lookup(filename);
+	if(f) {
+		count = meta_current(f);
+		total = f->count;
+	}
+
+	out_append(c, (char *)&count, sizeof(int));
+	out_append(c, (char *)&total, sizeof(int));
+	for(int i = 0; count > 0 && i < f->num_chunks; i++) {
+		if(f->chunks[i].gen != f->gen) continue;
+		int chunk = f->chunks[i].chunk, chunk_size = f->chunks[i].size;
+		out_append(c, (char *)&chunk, sizeof(int));
+		out_append(c, (char *)&chunk_size, sizeof(int));
+	}
+	pthread_rwlock_unlock(&meta.lock);
+}
+
+//the number of chunks a file was split into is kept in <file>/.chunks, followed by the generation of the put
+//files stored by older clients don't have one, returns 0 for those, and gen gets 0 if there's no generation
+int read_chunk_count(char *dir_path, long long *gen) {
+	char path[strlen(dir_path) + 10];
+	char buf[40];
+	int fd, n, count = 0;
+
+	*gen = 0;
+	sprintf(path, "%s/.chunks", dir_path);
+	fd = open(path, O_RDONLY);
+	if(fd < 0) return 0;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0) return 0;
+	buf[n] = '\0';
+	sscanf(buf, "%d %lld", &count, gen);
+	return count;
+}
+
+void write_chunk_count(char *dir_path, int count, long long gen) {
+	char path[strlen(dir_path) + 10];
+	char tmp[strlen(dir_path) + 32];
+	char buf[40];
+	int fd, n;
+
+	sprintf(path, "%s/.chunks", dir_path);
+	sprintf(tmp, "%s/.chunks.%ld", dir_path, (long) pthread_self());
+	n = sprintf(buf, "%d %lld\n", count, gen);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0) {
+		perror("opening chunk count");
+		return;
+	}
+	if(write(fd, buf, n) != n) perror("writing chunk count");
+	close(fd);
+	if(rename(tmp, path) < 0) perror("renaming chunk count");
+}
+
+//v2 request handlers, p is the request payload as laid out in proto.h
+
+void msg_put(conn *c, msg_hdr *hdr, char *p) {
+	char name[BUFSIZE];
+	char *end = p + hdr->length;
+	char *fields = msg_string(p, end, name);
+
+	//the contents are still on their way, so a bad put can't be skipped
+	if(fields == NULL) {
+		fprintf(stderr, "Malformed put\n");
+		c->closing = 1;
+		return;
+	}
+
+	put(c, config.dfs, name, get_u32(fields + 4));
+	if(c->closing) return;
+	c->put_v2 = 1;
+	c->put_id = hdr->id;
+	c->put_check = 1;
+	c->put_expect = get_u32(fields + 8);
+	c->put_raw = get_u64(fields + 12);
+	c->put_gen = get_u64(fields + 20);
+	if(put_begin(c, get_u32(fields), hdr->length - (fields + 28 - p)) < 0)
+		c->closing = 1;
+}
+
+//a batch is a u32 file count, then for each file s name, u32 chunk, u32 chunks in the file, u64 size, u32 crc32c,
+//u64 length once decompressed (0 if it isn't compressed), u64 generation and the contents
+//the files are stored one at a time as they stream in, and the whole batch gets one reply
+void msg_put_batch(conn *c, msg_hdr *hdr, char *p) {
+	c->batch_files = get_u32(p);
+	c->batch_done = 0;
+	c->batch_remaining = hdr->length - 4;
+	c->batch_id = hdr->id;
+	c->batch_num_failed = 0;
+	c->state = CONN_BATCH;
+
+	if(c->batch_files == 0) msg_batch_reply(c);
+}
+
+//start on the next file of a batch once its fixed fields are buffered
+//returns 1 if it was started, 0 if more input is needed (or the connection is closing)
+int msg_batch_file(conn *c) {
+	char name[BUFSIZE];
+	char *p = rbuf_peek(&c->in);
+	size_t have = rbuf_len(&c->in);
+
+	if(have < 2) return 0;
+	uint64_t need = 2 + get_u16(p) + 36;
+	if(need > BUFSIZE || need > c->batch_remaining) {
+		fprintf(stderr, "Malformed batch\n");
+		c->closing = 1;
+		return 0;
+	}
+	if(have < need) return 0;
+
+	char *fields = msg_string(p, p + need, name);
+	uint64_t size = fields ? get_u64(fields + 8) : 0;
+	if(fields == NULL || size > c->batch_remaining - need) {
+		fprintf(stderr, "Malformed batch\n");
+		c->closing = 1;
+		return 0;
+	}
+	rbuf_consume(&c->in, need);
+	c->batch_remaining -= need + size;
+
+	put(c, config.dfs, name, get_u32(fields + 4));
+	if(c->closing) return 0;
+	c->put_check = 1;
+	c->put_expect = get_u32(fields + 16);
+	c->put_raw = get_u64(fields + 20);
+	c->put_gen = get_u64(fields + 28);
+	if(put_begin(c, get_u32(fields), size) < 0) {
+		c->closing = 1;
+		return 0;
+	}
+	return 1;
+}
+
+//reply is u32 files that failed, then the position in the batch of each
+void msg_batch_reply(conn *c) {
+	msg_hdr hdr = { .opcode = OP_PUT_BATCH, .id = c->batch_id };
+	char buf[4];
+
+	//the files have to account for the whole payload, or we can't tell where the next request starts
+	if(c->batch_remaining != 0) {
+		fprintf(stderr, "Malformed batch\n");
+		c->closing = 1;
+		return;
+	}
+
+	msg_reply(c, &hdr, c->batch_num_failed ? STATUS_IO_ERROR : STATUS_OK, 4 + 4*c->batch_num_failed);
+	put_u32(buf, c->batch_num_failed);
+	out_append(c, buf, 4);
+	for(int i = 0; i < c->batch_num_failed; i++) {
+		put_u32(buf, c->batch_failed[i]);
+		out_append(c, buf, 4);
+	}
+
+	c->batch_files = 0;
+	c->state = CONN_MSG;
+}
+
+//with a range only that part of the chunk is sent, cut short where the chunk ends,
+//it's still a region of the file or segment so it goes out with sendfile from that offset (or of the cached copy)
+void msg_get(conn *c, msg_hdr *hdr, char *p) {
+	char name[BUFSIZE];
+	char *end = p + hdr->length;
+	char *fields = msg_string(p, end, name);
+	long long size;
+	off_t off;
+	cache_entry *hit;
+
+	if(fields == NULL || (end - fields != 4 && end - fields != 20)) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+
+	int fd = cache_open(name, get_u32(fields), &size, &off, &hit);
+	if(fd < 0 && hit == NULL) {
+		msg_reply(c, hdr, STATUS_NOT_FOUND, 0);
+		return;
+	}
+	if(end - fields == 20) {
+		uint64_t from = get_u64(fields + 4), len = get_u64(fields + 12);
+		if(from > (uint64_t) size) from = size;
+		if(len > size - from) len = size - from;
+		off += from;
+		size = len;
+	}
+	msg_reply(c, hdr, STATUS_OK, size);
+	if(hit) out_cached(c, hit, off, size);
+	else out_file(c, fd, off, size);
+}
+
+void msg_stat(conn *c, msg_hdr *hdr, char *p) {
+	char name[BUFSIZE], buf[28];
+
+	if(msg_string(p, p + hdr->length, name) == NULL) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&meta.lock);
+	file_entry *f = meta_lookup(name);
+	int count = f ? meta_current(f) : 0;
+
+	msg_reply(c, hdr, STATUS_OK, 16 + 28*count);
+	put_u32(buf, count);
+	put_u32(buf + 4, f ? f->count : 0);
+	put_u64(buf + 8, f ? f->gen : 0);
+	out_append(c, buf, 16);
+	for(int i = 0; count > 0 && i < f->num_chunks; i++) {
+		if(f->chunks[i].gen != f->gen) continue;
+		put_u32(buf, f->chunks[i].chunk);
+		put_u64(buf + 4, f->chunks[i].size);
+		put_u32(buf + 12, f->chunks[i].crc);
+		put_u32(buf + 16, (f->chunks[i].flags & SEG_CRC) != 0);
+		put_u64(buf + 20, f->chunks[i].flags & SEG_LZ ? f->chunks[i].raw : 0);
+		out_append(c, buf, 28);
+	}
+	pthread_rwlock_unlock(&meta.lock);
+}
+
+//reply is a byte per hash, only contents a OP_PUT_REF can point at count
+//a server without -s can only link to contents in .cas, not ones in segments
+void msg_has(conn *c, msg_hdr *hdr, char *p) {
+	uint32_t count = hdr->length >= 4 ? get_u32(p) : 0;
+	char held[HAS_MAX];
+
+	if(hdr->length < 4 || count > HAS_MAX || hdr->length != 4 + (uint64_t) count*CHASH_LEN) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&meta.lock);
+	for(uint32_t i = 0; i < count; i++) {
+		cas_body *b = cas_lookup((unsigned char *) p + 4 + i*CHASH_LEN);
+		held[i] = b != NULL && (config.segments || b->seg < 0);
+	}
+	pthread_rwlock_unlock(&meta.lock);
+
+	msg_reply(c, hdr, STATUS_OK, count);
+	out_append(c, held, count);
+}
+
+//store a chunk as a reference to contents we already hold
+//the contents are pinned while we work so an overwrite elsewhere can't drop them from under us
+//with -s the chunk gets a SEG_REF record, otherwise its file is another hard link to <dfs>/.cas/<hash>
+//the client's crc and raw length are taken as they are, contents with the same hash have the same ones
+void msg_put_ref(conn *c, msg_hdr *hdr, char *p) {
+	char name[BUFSIZE];
+	char *end = p + hdr->length;
+	char *fields = msg_string(p, end, name);
+	cas_body body;
+
+	if(fields == NULL || end - fields != 8 + CHASH_LEN + 20) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+
+	int name_len = strlen(name), count = get_u32(fields + 4), status = STATUS_OK;
+	chunk_info ci = { .chunk = get_u32(fields), .seg = -1, .flags = SEG_HASHED | SEG_CRC, .crc = get_u32(fields + 8 + CHASH_LEN),
+	                  .raw = get_u64(fields + 12 + CHASH_LEN), .gen = get_u64(fields + 20 + CHASH_LEN) };
+	memcpy(ci.hash, fields + 8, CHASH_LEN);
+	if(ci.raw) ci.flags |= SEG_LZ;
+	if(ci.gen) ci.flags |= SEG_GEN;
+
+	//like a put, a reference from an older put than the file mustn't replace a newer chunk
+	if(meta_stale(name, ci.gen)) {
+		msg_reply(c, hdr, STATUS_IO_ERROR, 0);
+		return;
+	}
+	if(cas_pin(ci.hash, &body) < 0 || (!config.segments && body.seg >= 0)) {
+		if(body.used) cas_unpin(ci.hash);
+		msg_reply(c, hdr, STATUS_NOT_FOUND, 0);
+		return;
+	}
+	ci.size = body.size;
+
+	if(config.segments) {
+		char rec[SEG_HDR_LEN + name_len + CHASH_LEN + 20];
+		int rec_len = SEG_HDR_LEN + name_len + seg_sums_len(ci.flags);
+
+		ci.flags |= SEG_REF;
+		int fd = store_reserve(rec_len, &ci.seg, &ci.off);
+		put_u32(rec, SEG_MAGIC);
+		rec[4] = 0;
+		rec[5] = ci.flags;
+		put_u16(rec + 6, name_len);
+		put_u32(rec + 8, ci.chunk);
+		put_u32(rec + 12, count);
+		put_u64(rec + 16, ci.size);
+		memcpy(rec + SEG_HDR_LEN, name, name_len);
+		seg_sums(rec + SEG_HDR_LEN + name_len, &ci);
+		if(fd < 0 || pwrite(fd, rec, rec_len, ci.off) != rec_len || pwrite(fd, "\1", 1, ci.off + 4) != 1) {
+			perror("writing segment record");
+			status = STATUS_IO_ERROR;
+		}
+	}
+	else {
+		char dir_path[strlen(config.dfs) + name_len + 2];
+		char body_path[strlen(config.dfs) + 2*CHASH_LEN + 10];
+		char tmp[sizeof(dir_path) + 20], file_path[sizeof(dir_path) + 20];
+
+		sprintf(dir_path, "%s/%s", config.dfs, name);
+		sprintf(tmp, "%s/.%d.ref", dir_path, ci.chunk);
+		sprintf(file_path, "%s/%d", dir_path, ci.chunk);
+		cas_path(body_path, ci.hash);
+
+		mkdir(dir_path, 0700);
+		unlink(tmp);
+		if(link(body_path, tmp) < 0 || rename(tmp, file_path) < 0) {
+			perror("linking chunk file");
+			unlink(tmp);
+			status = STATUS_IO_ERROR;
+		}
+	}
+
+	int changed = -1;
+	if(status == STATUS_OK) changed = meta_record(name, &ci, count, NULL);
+	if(changed < 0) status = STATUS_IO_ERROR;
+	if(changed < 0 && ci.seg >= 0) store_dead(ci.seg, chunk_len(name, &ci));
+	if(changed > 0 && !config.segments) {
+		char dir_path[strlen(config.dfs) + name_len + 2];
+		sprintf(dir_path, "%s/%s", config.dfs, name);
+		write_chunk_count(dir_path, count, ci.gen);
+	}
+	if(ci.seg >= 0) store_done(ci.seg);
+	cas_unpin(ci.hash);
+
+	msg_reply(c, hdr, status, 0);
+}
+
+//a put is done, so whatever we still hold of older versions of the file goes
+//if the put stored none of its chunks here the file keeps its generation and count, so stat and list tell clients
+//a newer file is out there rather than offering them our chunks of the old one
+void msg_drop(conn *c, msg_hdr *hdr, char *p) {
+	char name[BUFSIZE];
+	char *end = p + hdr->length;
+	char *fields = msg_string(p, end, name);
+
+	if(fields == NULL || end - fields != 12) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+
+	int count = get_u32(fields);
+	long long gen = get_u64(fields + 4);
+	if(meta_retire(name, count, gen) > 0 && !config.segments) {
+		char dir_path[strlen(config.dfs) + strlen(name) + 2];
+		sprintf(dir_path, "%s/%s", config.dfs, name);
+		write_chunk_count(dir_path, count, gen);
+	}
+	msg_reply(c, hdr, STATUS_OK, 0);
+}
+
+//same listing as the text list, the header is patched once we know how long the reply is
+void msg_list(conn *c, msg_hdr *hdr, char *p) {
+	char *end = p + hdr->length;
+	char prefix[BUFSIZE], buf[MSG_HDR_LEN];
+	int prefix_len = 0, lines = 0, next = -1;
+
+	if(end - p < 10) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+	uint32_t start = get_u32(p), limit = get_u32(p + 4);
+	if(get_u16(p + 8) > 0) {
+		if(msg_string(p + 8, end, prefix) == NULL) {
+			msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+			return;
+		}
+		prefix_len = strlen(prefix);
+	}
+
+	out_seg *seg = out_tail_seg(c);
+	if(seg == NULL) return;
+	size_t header_at = seg->len;
+	msg_reply(c, hdr, STATUS_OK, 0);
+	out_append(c, buf, 8);
+
+	pthread_rwlock_rdlock(&meta.lock);
+	for(uint32_t i = start; i < (uint32_t) meta.num_entries; i++) {
+		file_entry *f = &meta.entries[i];
+		int name_len = strlen(f->name);
+
+		if(prefix_len && strncmp(f->name, prefix, prefix_len) != 0) continue;
+		if(limit > 0 && (uint32_t) lines == limit) {
+			next = i;
+			break;
+		}
+
+		put_u16(buf, name_len);
+		out_append(c, buf, 2);
+		out_append(c, f->name, name_len);
+		put_u32(buf, f->count);
+		put_u64(buf + 4, f->gen);
+		put_u32(buf + 12, meta_current(f));
+		out_append(c, buf, 16);
+		for(int j = 0; j < f->num_chunks; j++) {
+			if(f->chunks[j].gen != f->gen) continue;
+			put_u32(buf, f->chunks[j].chunk);
+			out_append(c, buf, 4);
+		}
+		lines++;
+	}
+	pthread_rwlock_unlock(&meta.lock);
+
+	msg_pack(seg->buf + header_at, hdr->opcode, STATUS_OK, hdr->id, seg->len - header_at - MSG_HDR_LEN);
+	stat_add(&shard->bytes_out[OP_LIST], seg->len - header_at - MSG_HDR_LEN);
+	put_u32(seg->buf + header_at + MSG_HDR_LEN, lines);
+	put_u32(seg->buf + header_at + MSG_HDR_LEN + 4, next);
+}
+
+//start a scrub if asked to and one isn't running already, and say how the current (or last) one is going
+void msg_scrub(conn *c, msg_hdr *hdr, char *p) {
+	char buf[20];
+	pthread_t runner;
+	int running;
+
+	if(hdr->length != 4) {
+		msg_reply(c, hdr, STATUS_BAD_REQUEST, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&scrub.lock);
+	if(!scrub.running && get_u32(p)) {
+		scrub.checked = scrub.failed = 0;
+		scrub.running = pthread_create(&runner, NULL, scrub_thread, NULL) == 0;
+		if(scrub.running) pthread_detach(runner);
+		else perror("starting scrub");
+	}
+	put_u32(buf, scrub.running);
+	put_u64(buf + 4, scrub.checked);
+	put_u64(buf + 12, scrub.failed);
+	running = scrub.running;
+	pthread_mutex_unlock(&scrub.lock);
+
+	msg_reply(c, hdr, running || !get_u32(p) ? STATUS_OK : STATUS_IO_ERROR, sizeof(buf));
+	out_append(c, buf, sizeof(buf));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//read back every chunk we hold a crc for and drop the ones that don't match it any more,
+//so the copies on other servers are the ones clients read and the next put of the file replaces ours
+//files are copied out of the index one at a time, puts and gets carry on while we read
+//gets are sent with sendfile and never pass through us, this is what catches contents that rot on disk
+void *scrub_thread(void *args) {
+	char *buf = malloc(SCRUB_BUFSIZE);
+	(void) args;
+
+	if(buf == NULL) perror("malloc for scrub");
+	for(int i = 0; buf != NULL; i++) {
+		pthread_rwlock_rdlock(&meta.lock);
+		if(i >= meta.num_entries) {
+			pthread_rwlock_unlock(&meta.lock);
+			break;
+		}
+		file_entry *f = &meta.entries[i];
+		char *name = strdup(f->name);
+		int num_chunks = f->num_chunks;
+		int *chunks = malloc((num_chunks + 1) * sizeof(int));
+		for(int j = 0; chunks != NULL && j < num_chunks; j++)
+			chunks[j] = f->chunks[j].chunk;
+		pthread_rwlock_unlock(&meta.lock);
+
+		for(int j = 0; name != NULL && chunks != NULL && j < num_chunks; j++) {
+			int ok = scrub_chunk(name, chunks[j], buf);
+			if(ok < 0) continue;
+
+			pthread_mutex_lock(&scrub.lock);
+			scrub.checked++;
+			if(!ok) scrub.failed++;
+			pthread_mutex_unlock(&scrub.lock);
+		}
+		free(name);
+		free(chunks);
+	}
+	free(buf);
+
+	pthread_mutex_lock(&scrub.lock);
+	fprintf(stderr, "Scrub checked %llu chunks, %llu failed\n", (unsigned long long) scrub.checked, (unsigned long long) scrub.failed);
+	scrub.running = 0;
+	pthread_mutex_unlock(&scrub.lock);
+	return NULL;
+}
+
+//check one chunk against its crc, buf holds SCRUB_BUFSIZE bytes
+//returns 1 if it's fine, 0 if it failed and was dropped, -1 if it's gone or was stored without a crc
+int scrub_chunk(char *name, int chunk, char *buf) {
+	chunk_info ci;
+	long long size, done = 0;
+	off_t off;
+	uint32_t crc = 0;
+
+	int fd = open_chunk(name, chunk, &size, &off, &ci);
+	if(fd < 0) return -1;
+	if(!(ci.flags & SEG_CRC)) {
+		close(fd);
+		return -1;
+	}
+
+	while(done < size) {
+		ssize_t n = pread(fd, buf, size - done < SCRUB_BUFSIZE ? size - done : SCRUB_BUFSIZE, off + done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) break;
+		crc = crc32c(crc, buf, n);
+		done += n;
+	}
+	close(fd);
+	if(size == ci.size && done == size && crc == ci.crc) return 1;
+
+	fprintf(stderr, "Chunk %d of %s failed its checksum, dropping it\n", chunk, name);
+	meta_remove(name, &ci);
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//FNV-1a, only used to place filenames in the index
+unsigned long name_hash(char *str) {
+	unsigned long hash = 14695981039346656037UL;
+	while(*str)
+		hash = (hash ^ (unsigned char)*str++) * 1099511628211UL;
+	return hash;
+}
+
+//caller holds meta.lock
+file_entry *meta_lookup(char *name) {
+	if(meta.num_slots == 0) return NULL;
+
+	unsigned long mask = meta.num_slots - 1;
+	for(unsigned long i = name_hash(name) & mask; meta.slots[i] != 0; i = (i + 1) & mask) {
+		file_entry *f = &meta.entries[meta.slots[i] - 1];
+		if(strcmp(f->name, name)==0) return f;
+	}
+	return NULL;
+}
+
+//add a file with no chunks yet, caller holds meta.lock for writing and has checked it isn't there
+//the table is kept at most half full, doubling when it gets there
+file_entry *meta_insert(char *name) {
+	if(meta.num_entries == meta.cap_entries) {
+		int cap = meta.cap_entries ? 2*meta.cap_entries : 1024;
+		file_entry *entries = realloc(meta.entries, cap * sizeof(file_entry));
+		if(entries == NULL) return NULL;
+		meta.entries = entries;
+		meta.cap_entries = cap;
+	}
+
+	if(2*(meta.num_entries + 1) > meta.num_slots) {
+		int num_slots = meta.num_slots ? 2*meta.num_slots : 2048;
+		int *slots = calloc(num_slots, sizeof(int));
+		if(slots == NULL) return NULL;
+
+		for(int e = 0; e < meta.num_entries; e++) {
+			unsigned long i = name_hash(meta.entries[e].name) & (num_slots - 1);
+			while(slots[i] != 0) i = (i + 1) & (num_slots - 1);
+			slots[i] = e + 1;
+		}
+		free(meta.slots);
+		meta.slots = slots;
+		meta.num_slots = num_slots;
+	}
+
+	file_entry *f = &meta.entries[meta.num_entries];
+	memset(f, 0, sizeof(file_entry));
+	f->name = strdup(name);
+	if(f->name == NULL) return NULL;
+
+	unsigned long i = name_hash(name) & (meta.num_slots - 1);
+	while(meta.slots[i] != 0) i = (i + 1) & (meta.num_slots - 1);
+	meta.slots[i] = ++meta.num_entries;
+	return f;
+}
+
+//find chunk in f's chunk list, meta.lock must be held
+chunk_info *meta_chunk(file_entry *f, int chunk) {
+	if(chunk < 0 || chunk >= f->cap_slot || f->slot[chunk] == 0) return NULL;
+	return &f->chunks[f->slot[chunk] - 1];
+}
+
+//where a chunk's contents start in its segment record
+long long chunk_data(char *name, chunk_info *ci) {
+	return ci->off + SEG_HDR_LEN + strlen(name) + seg_sums_len(ci->flags);
+}
+
+//how long a chunk's segment record is
+long long chunk_len(char *name, chunk_info *ci) {
+	return chunk_data(name, ci) - ci->off + (ci->flags & SEG_REF ? 0 : ci->size);
+}
+
+//note that chunk ci->chunk of name is now stored as ci says, and append the change to the journal once the journal is open
+//count of 0 leaves the file's chunk count alone
+//body_tmp is a spare link to the contents of a chunk stored in a file, which becomes their body if we don't have one yet
+//returns 1 if the file's chunk count or generation changed, 0 if not, -1 on error
+int meta_record(char *name, chunk_info *ci, int count, char *body_tmp) {
+	pthread_rwlock_wrlock(&meta.lock);
+	int changed = meta_update(name, ci, count, body_tmp);
+	pthread_rwlock_unlock(&meta.lock);
+	return changed;
+}
+
+//meta_record for a caller holding meta.lock for writing
+int meta_update(char *name, chunk_info *ci, int count, char *body_tmp) {
+	int changed = 0;
+
+	file_entry *f = meta_lookup(name);
+	if(f == NULL) f = meta_insert(name);
+	if(f == NULL) {
+		perror("adding file to index");
+		return -1;
+	}
+
+	//a chunk of an older put than we hold can't be stored at all without mixing the two (while loading it's one
+	//we still held when we stopped, which comes back as it was)
+	//the first chunk of a newer one makes every chunk we hold of older ones stale, and those past its last chunk
+	//won't be replaced, so they go now, the client drops the rest once the put is done (meta_retire)
+	if(ci->gen > 0 && ci->gen < f->gen && !meta.loading) {
+		errno = ESTALE;
+		return -1;
+	}
+	if(ci->gen > f->gen) {
+		for(int i = f->num_chunks - 1; i >= 0; i--)
+			if(count > 0 && f->chunks[i].chunk >= count_chunks(count)) meta_drop(name, f, &f->chunks[i]);
+		f->gen = ci->gen;
+		changed = 1;
+	}
+
+	chunk_info *cur = meta_chunk(f, ci->chunk);
+	if(cur == NULL) {
+		if(ci->chunk < 0 || ci->chunk > COUNT_MAX) {
+			errno = EINVAL;
+			perror("adding chunk to index");
+			return -1;
+		}
+		if(ci->chunk >= f->cap_slot) {
+			int cap = 2*f->cap_slot > ci->chunk ? 2*f->cap_slot : ci->chunk + 4;
+			int *slot = realloc(f->slot, cap * sizeof(int));
+			if(slot == NULL) {
+				perror("adding chunk to index");
+				return -1;
+			}
+			memset(slot + f->cap_slot, 0, (cap - f->cap_slot) * sizeof(int));
+			f->slot = slot;
+			f->cap_slot = cap;
+		}
+		if(f->num_chunks == f->cap_chunks) {
+			int cap = f->cap_chunks ? 2*f->cap_chunks : 4;
+			chunk_info *chunks = realloc(f->chunks, cap * sizeof(chunk_info));
+			if(chunks == NULL) {
+				perror("adding chunk to index");
+				return -1;
+			}
+			f->chunks = chunks;
+			f->cap_chunks = cap;
+		}
+		cur = &f->chunks[f->num_chunks++];
+		cur->size = -1;
+		f->slot[ci->chunk] = f->num_chunks;
+	}
+	chunk_info old = *cur;
+	*cur = *ci;
+
+	//the first chunk with some contents provides their body, a segment record as it is or a file linked into .cas
+	if(ci->flags & SEG_HASHED) {
+		cas_body *b = cas_lookup(ci->hash);
+		if(b == NULL && (ci->seg >= 0 ? !(ci->flags & SEG_REF) : meta.loading || body_tmp != NULL)) {
+			char path[strlen(config.dfs) + 2*CHASH_LEN + 10];
+			cas_path(path, ci->hash);
+			if(ci->seg >= 0 || meta.loading || rename(body_tmp, path) == 0)
+				b = cas_insert(ci->hash);
+			if(b) {
+				b->seg = ci->seg;
+				b->off = ci->off;
+				b->len = ci->seg >= 0 ? chunk_len(name, ci) : 0;
+				b->size = ci->size;
+			}
+		}
+		if(b) b->refs++;
+	}
+	if(old.size >= 0) meta_release(name, &old, cur);
+
+	//gets from now on have to see what was just stored, not a cached copy of what it replaced
+	cache_forget(name, ci->chunk);
+
+	if(count > 0 && f->count != count) {
+		f->count = count;
+		changed = 1;
+	}
+
+	if(meta.journal_fd >= 0) {
+		char record[strlen(name) + 192];
+		meta_journal(record, meta_format(record, name, cur, count));
+	}
+	return changed;
+}
+
+//a chunk of name has been replaced, old is what it was and cur what it is now
+//drop old's reference to its contents, and free its record or file unless something else still needs them
+//meta.lock held for writing
+void meta_release(char *name, chunk_info *old, chunk_info *cur) {
+	int body_seg = -2;
+	long long body_off = 0;
+
+	if(old->flags & SEG_HASHED) {
+		cas_body *b = cas_lookup(old->hash);
+		if(b) {
+			body_seg = b->seg;
+			body_off = b->off;
+			if(--b->refs == 0) cas_drop(b);
+		}
+	}
+
+	//a record that's also the body of its contents goes with the body
+	if(old->seg >= 0 && !(old->seg == body_seg && old->off == body_off))
+		store_dead(old->seg, chunk_len(name, old));
+	else if(old->seg < 0 && cur->seg >= 0 && !meta.loading) {
+		char path[strlen(config.dfs) + strlen(name) + 20];
+		sprintf(path, "%s/%s/%d", config.dfs, name, old->chunk);
+		unlink(path);
+	}
+}
+
+//drop a chunk that failed a scrub, if the index still has it stored as ci says
+//replaying the journal drops chunk ci->chunk of name whatever it is
+//returns 1 if it was dropped
+int meta_remove(char *name, chunk_info *ci) {
+	char record[strlen(name) + 32];
+	int dropped = 0;
+
+	pthread_rwlock_wrlock(&meta.lock);
+	file_entry *f = meta_lookup(name);
+	chunk_info *cur = f ? meta_chunk(f, ci->chunk) : NULL;
+	if(cur && (meta.loading || (cur->seg == ci->seg && cur->off == ci->off && cur->flags == ci->flags && cur->crc == ci->crc))) {
+		int chunk = cur->chunk;
+		meta_drop(name, f, cur);
+		dropped = 1;
+		meta_journal(record, sprintf(record, "x %d %s\n", chunk, name));
+	}
+	pthread_rwlock_unlock(&meta.lock);
+	return dropped;
+}
+
+//take chunk cur out of file f, which may move another chunk of f into its place
+//its file is removed, or its segment record un-committed so a rescan doesn't bring it back (only the index changes while loading)
+//meta.lock held for writing
+void meta_drop(char *name, file_entry *f, chunk_info *cur) {
+	chunk_info none = { .seg = -1 };
+	chunk_info old = *cur;
+
+	*cur = f->chunks[--f->num_chunks];
+	f->slot[old.chunk] = 0;
+	if(cur < f->chunks + f->num_chunks) f->slot[cur->chunk] = cur - f->chunks + 1;
+	meta_release(name, &old, &none);
+	cache_forget(name, old.chunk);
+
+	if(!meta.loading && old.seg >= 0) {
+		pthread_mutex_lock(&store.lock);
+		if(old.seg < store.num_segs && store.segs[old.seg].fd >= 0 && pwrite(store.segs[old.seg].fd, "\0", 1, old.off + 4) != 1)
+			perror("dropping segment record");
+		pthread_mutex_unlock(&store.lock);
+	}
+	else if(!meta.loading) {
+		char path[strlen(config.dfs) + strlen(name) + 20];
+		sprintf(path, "%s/%s/%d", config.dfs, name, old.chunk);
+		unlink(path);
+	}
+}
+
+//a put of generation gen of name that's count chunks is done, drop every chunk we hold of older puts,
+//and take on its generation and count if it stored none of its chunks here, files we hold nothing of aren't added
+//(unless we're loading the index, which only has records of them for files it kept)
+//journaled as "d <gen> <count> <filename>", returns 1 if the generation or count changed
+int meta_retire(char *name, int count, long long gen) {
+	char record[strlen(name) + 64];
+	int changed = 0, dropped = 0;
+
+	pthread_rwlock_wrlock(&meta.lock);
+	file_entry *f = meta_lookup(name);
+
+	//while replaying, a file we hold nothing of is still added, the index keeps it for its generation (see meta_write_snapshot)
+	if(f == NULL && meta.loading) f = meta_insert(name);
+	for(int i = f ? f->num_chunks - 1 : -1; i >= 0; i--) {
+		if(f->chunks[i].gen >= gen) continue;
+		meta_drop(name, f, &f->chunks[i]);
+		dropped = 1;
+	}
+	if(f && gen > f->gen) {
+		f->gen = gen;
+		f->count = count;
+		changed = 1;
+	}
+	if(changed || dropped) meta_journal(record, sprintf(record, "d %lld %d %s\n", gen, count, name));
+	pthread_rwlock_unlock(&meta.lock);
+	return changed;
+}
+
+//how many of f's chunks are from its newest put, the ones stat and list tell clients about, meta.lock held
+int meta_current(file_entry *f) {
+	int n = 0;
+	for(int i = 0; i < f->num_chunks; i++)
+		n += f->chunks[i].gen == f->gen;
+	return n;
+}
+
+//returns 1 if we hold chunks of a newer put of name than generation gen, which a put of gen mustn't replace
+//(a put that doesn't say what generation it is never is)
+int meta_stale(char *name, long long gen) {
+	pthread_rwlock_rdlock(&meta.lock);
+	file_entry *f = meta_lookup(name);
+	int stale = f && gen > 0 && gen < f->gen;
+	pthread_rwlock_unlock(&meta.lock);
+	return stale;
+}
+
+//point whatever the compactor found at from_off in segment from_seg at its copy in to_seg:
+//the chunk of name, if it's still stored there, and the body of the contents with hash (NULL if none), if it's still there
+//returns a bit for each that moved, 1 for the chunk and 2 for the body
+int meta_move(char *name, int chunk, unsigned char *hash, int from_seg, long long from_off, int to_seg, long long to_off) {
+	char record[strlen(name) + 192];
+	int moved = 0;
+
+	pthread_rwlock_wrlock(&meta.lock);
+	file_entry *f = meta_lookup(name);
+	chunk_info *ci = f ? meta_chunk(f, chunk) : NULL;
+	if(ci && ci->seg == from_seg && ci->off == from_off) {
+		ci->seg = to_seg;
+		ci->off = to_off;
+		moved |= 1;
+		meta_journal(record, meta_format(record, name, ci, 0));
+	}
+
+	cas_body *b = hash ? cas_lookup(hash) : NULL;
+	if(b && b->seg == from_seg && b->off == from_off) {
+		b->seg = to_seg;
+		b->off = to_off;
+		moved |= 2;
+		meta_journal(record, meta_format_body(record, b));
+	}
+	pthread_rwlock_unlock(&meta.lock);
+	return moved;
+}
+
+//returns 1 if any chunk or contents in the index are still stored in segment seg
+int meta_uses_segment(int seg) {
+	int used = 0;
+
+	pthread_rwlock_rdlock(&meta.lock);
+	for(int i = 0; i < meta.num_entries && !used; i++)
+		for(int j = 0; j < meta.entries[i].num_chunks && !used; j++)
+			used = meta.entries[i].chunks[j].seg == seg;
+	for(int i = 0; i < meta.cap_bodies && !used; i++)
+		used = meta.bodies[i].used && meta.bodies[i].seg == seg;
+	pthread_rwlock_unlock(&meta.lock);
+	return used;
+}
+
+//records are "<chunk> <size> <count> <filename>" for a chunk in its own file stored before we hashed,
+//"s <segment> <offset> <chunk> <size> <count> <filename>" for one in a segment stored before we hashed,
+//"h <hash> <segment> <offset> <flags> <chunk> <size> <count> <filename>" for one with a hash (segment -1 for a file),
+//and "b <hash> <segment> <offset> <length> <size>" for where contents shared by chunks are (segment -1 for .cas)
+//a chunk record starts with "c <crc32c> " if we know the crc of its contents,
+//then "z <length> " if they're compressed, with their length once decompressed,
+//then "g <generation> " if the put that stored it had one
+//"x <chunk> <filename>" drops a chunk that failed a scrub, and "d <generation> <count> <filename>" every chunk of a file
+//older than a put that stored nothing here (see meta_retire)
+//returns the length of the record written into buf, which needs room for the name and 192 more bytes
+int meta_format(char *buf, char *name, chunk_info *ci, int count) {
+	char hex[2*CHASH_LEN + 1];
+	int len = 0;
+
+	if(ci->flags & SEG_CRC) len = sprintf(buf, "c %08x ", ci->crc);
+	if(ci->flags & SEG_LZ) len += sprintf(buf + len, "z %lld ", ci->raw);
+	if(ci->flags & SEG_GEN) len += sprintf(buf + len, "g %lld ", ci->gen);
+	if(ci->flags & SEG_HASHED) {
+		chash_hex(ci->hash, hex);
+		return len + sprintf(buf + len, "h %s %d %lld %d %d %lld %d %s\n", hex, ci->seg, ci->off, ci->flags, ci->chunk, ci->size, count, name);
+	}
+	if(ci->seg >= 0)
+		return len + sprintf(buf + len, "s %d %lld %d %lld %d %s\n", ci->seg, ci->off, ci->chunk, ci->size, count, name);
+	return len + sprintf(buf + len, "%d %lld %d %s\n", ci->chunk, ci->size, count, name);
+}
+
+int meta_format_body(char *buf, cas_body *b) {
+	char hex[2*CHASH_LEN + 1];
+	chash_hex(b->hash, hex);
+	return sprintf(buf, "b %s %d %lld %lld %lld\n", hex, b->seg, b->off, b->len, b->size);
+}
+
+//append a record to the journal, if it's open
+//one write per record so concurrent appends don't interleave, and callers hold meta.lock for writing so that
+//the journal sees the changes to a chunk in the same order as the index
+void meta_journal(char *record, int len) {
+	if(meta.journal_fd >= 0 && write(meta.journal_fd, record, len) != len)
+		perror("writing journal");
+}
+
+//wait until everything appended to the journal so far is on disk, returns -1 if it couldn't be
+int meta_sync(void) {
+	if(meta.journal_fd >= 0 && fdatasync(meta.journal_fd) < 0) {
+		perror("syncing journal");
+		return -1;
+	}
+	return 0;
+}
+
+//say where contents with b->hash are, adding them with no references if we didn't know about them
+void meta_set_body(cas_body *b) {
+	pthread_rwlock_wrlock(&meta.lock);
+	cas_body *cur = cas_lookup(b->hash);
+	if(cur == NULL) cur = cas_insert(b->hash);
+	if(cur) {
+		cur->seg = b->seg;
+		cur->off = b->off;
+		cur->len = b->len;
+		cur->size = b->size;
+	}
+	pthread_rwlock_unlock(&meta.lock);
+}
+
+//drop the contents nothing points at any more, which a rescan leaves behind
+void meta_prune_bodies(void) {
+	pthread_rwlock_wrlock(&meta.lock);
+	for(int i = 0; i < meta.cap_bodies; i++) {
+		//removing shifts a later entry into this slot, so look at it again
+		while(meta.bodies[i].used && meta.bodies[i].refs == 0)
+			cas_drop(&meta.bodies[i]);
+	}
+	pthread_rwlock_unlock(&meta.lock);
+}
+
+//replay a snapshot or journal, returns -1 if it doesn't exist
+int meta_read_records(char *path) {
+	FILE *fp = fopen(path, "r");
+	char line[BUFSIZE];
+
+	if(fp == NULL) return -1;
+
+	while(fgets(line, BUFSIZE, fp) != NULL) {
+		chunk_info ci = { .seg = -1 };
+		char hex[2*CHASH_LEN + 1];
+		char *rec = line;
+		int count, name_at = 0, fields, crc_at = 0, raw_at = 0, gen_at = 0;
+
+		//a torn last line from a crash mid-append is just dropped
+		char *nl = strchr(line, '\n');
+		if(nl == NULL) break;
+		*nl = '\0';
+
+		if(line[0] == 'b') {
+			cas_body b;
+			if(sscanf(line, "b %32s %d %lld %lld %lld", hex, &b.seg, &b.off, &b.len, &b.size) == 5 && chash_parse(hex, b.hash) == 0)
+				meta_set_body(&b);
+			continue;
+		}
+
+		if(line[0] == 'x') {
+			if(sscanf(line, "x %d %n", &ci.chunk, &name_at) == 1 && name_at > 0 && line[name_at] != '\0')
+				meta_remove(line + name_at, &ci);
+			continue;
+		}
+
+		if(line[0] == 'd') {
+			if(sscanf(line, "d %lld %d %n", &ci.gen, &count, &name_at) == 2 && name_at > 0 && line[name_at] != '\0')
+				meta_retire(line + name_at, count, ci.gen);
+			continue;
+		}
+
+		if(line[0] == 'c') {
+			if(sscanf(line, "c %x %n", &ci.crc, &crc_at) != 1 || crc_at == 0) continue;
+			rec += crc_at;
+		}
+		if(rec[0] == 'z') {
+			if(sscanf(rec, "z %lld %n", &ci.raw, &raw_at) != 1 || raw_at == 0) continue;
+			rec += raw_at;
+		}
+		if(rec[0] == 'g') {
+			if(sscanf(rec, "g %lld %n", &ci.gen, &gen_at) != 1 || gen_at == 0) continue;
+			rec += gen_at;
+		}
+
+		if(rec[0] == 'h') {
+			fields = sscanf(rec, "h %32s %d %lld %d %d %lld %d %n", hex, &ci.seg, &ci.off, &ci.flags, &ci.chunk, &ci.size, &count, &name_at) - 4;
+			if(fields == 3 && chash_parse(hex, ci.hash) < 0) continue;
+		}
+		else if(rec[0] == 's')
+			fields = sscanf(rec, "s %d %lld %d %lld %d %n", &ci.seg, &ci.off, &ci.chunk, &ci.size, &count, &name_at) - 2;
+		else
+			fields = sscanf(rec, "%d %lld %d %n", &ci.chunk, &ci.size, &count, &name_at);
+		if(fields < 3 || rec[name_at] == '\0')
+			continue;
+		if(crc_at) ci.flags |= SEG_CRC;
+		if(raw_at) ci.flags |= SEG_LZ;
+		if(gen_at) ci.flags |= SEG_GEN;
+		meta_record(rec + name_at, &ci, count, NULL);
+	}
+	fclose(fp);
+	return 0;
+}
+
+int cas_inode_cmp(const void *a, const void *b) {
+	ino_t x = ((cas_inode *) a)->ino, y = ((cas_inode *) b)->ino;
+	return x < y ? -1 : x > y;
+}
+
+//rebuild the index by walking the storage directories, for first start or -r
+//chunk files that are hard links to something in .cas get its hash
+void meta_scan(char *dfs) {
+	struct dirent *d, *ch_d;
+	struct stat st;
+	DIR *dh, *ch;
+	cas_inode *inodes = NULL;
+	int num_inodes = 0, cap_inodes = 0;
+
+	char cas_dir[strlen(dfs) + 10];
+	sprintf(cas_dir, "%s/.cas", dfs);
+	if((dh = opendir(cas_dir)) != NULL) {
+		while((d = readdir(dh)) != NULL) {
+			unsigned char hash[CHASH_LEN];
+			if(strlen(d->d_name) != 2*CHASH_LEN || chash_parse(d->d_name, hash) < 0) continue;
+			if(fstatat(dirfd(dh), d->d_name, &st, 0) < 0) continue;
+
+			if(num_inodes == cap_inodes) {
+				cap_inodes = cap_inodes ? 2*cap_inodes : 256;
+				cas_inode *grown = realloc(inodes, cap_inodes * sizeof(cas_inode));
+				if(grown == NULL) break;
+				inodes = grown;
+			}
+			inodes[num_inodes].ino = st.st_ino;
+			memcpy(inodes[num_inodes++].hash, hash, CHASH_LEN);
+		}
+		closedir(dh);
+		qsort(inodes, num_inodes, sizeof(cas_inode), cas_inode_cmp);
+	}
+
+	dh = opendir(dfs);
 	if(!dh) {
-		//if server doesn't have file, send chunk num of -1 as sentinel value to let client know
-		chunk = -1;
-		socket_write(sock, (char *)&chunk, sizeof(int));
+		perror("opening directory");
+		free(inodes);
 		return;
-	};
-	
-	//for each element in current directory, add to buffer in a line
-	//skip '.' and '..', as well as the server binary listing
+	}
+
 	while((d = readdir(dh)) != NULL) {
 		if(d->d_name[0] == '.') continue;
-		strcpy(chunk_path, dir_path);
-		strcat(chunk_path, "/");
-		strcat(chunk_path, d->d_name);
-		
-		chunk = atoi(d->d_name);
-		
-		fp = fopen(chunk_path, "r");
-		
-		fseek(fp, 0, SEEK_END);
-		chunk_size = ftell(fp);
-		fseek(fp, 0, SEEK_SET);
-		
-		socket_write(sock, (char *)&chunk, sizeof(int));
-		socket_write(sock, (char *)&chunk_size, sizeof(int));
-		
-		char contents[chunk_size];
-		if(fread(contents, chunk_size, 1, fp) < 1) perror("reading file");
-		socket_write(sock, contents, chunk_size);
-		
+
+		//subdir refers to each subdirectory, as files are represented by subdirectories in the DFS
+		char subdir[strlen(dfs) + strlen(d->d_name) + 2];
+		sprintf(subdir, "%s/%s", dfs, d->d_name);
+
+		ch = opendir(subdir);
+		if(!ch) continue;
+
+		long long gen;
+		int count = read_chunk_count(subdir, &gen);
+		while((ch_d = readdir(ch)) != NULL) {
+			if(ch_d->d_name[0]=='.') continue;
+			if(fstatat(dirfd(ch), ch_d->d_name, &st, 0) < 0) continue;
+
+			chunk_info ci = { .chunk = atoi(ch_d->d_name), .seg = -1, .size = st.st_size, .flags = gen ? SEG_GEN : 0, .gen = gen };
+			cas_inode key = { .ino = st.st_ino };
+			cas_inode *linked = num_inodes ? bsearch(&key, inodes, num_inodes, sizeof(cas_inode), cas_inode_cmp) : NULL;
+			if(linked) {
+				ci.flags |= SEG_HASHED;
+				memcpy(ci.hash, linked->hash, CHASH_LEN);
+			}
+
+			char sum[8], path[strlen(subdir) + strlen(ch_d->d_name) + 2];
+			sprintf(path, "%s/%s", subdir, ch_d->d_name);
+			if(getxattr(path, CRC_XATTR, sum, 4) == 4) {
+				ci.flags |= SEG_CRC;
+				ci.crc = get_u32(sum);
+			}
+			if(getxattr(path, LZ_XATTR, sum, 8) == 8) {
+				ci.flags |= SEG_LZ;
+				ci.raw = get_u64(sum);
+			}
+			meta_record(d->d_name, &ci, count, NULL);
+		}
+		closedir(ch);
+	}
+	closedir(dh);
+	free(inodes);
+}
+
+//write every record to <dfs>/.index, atomically replacing the old snapshot
+//bodies go first so the chunks after them find their contents
+int meta_write_snapshot(char *dfs) {
+	char path[strlen(dfs) + 20], tmp[strlen(dfs) + 20];
+	FILE *fp;
+
+	sprintf(path, "%s/.index", dfs);
+	sprintf(tmp, "%s/.index.tmp", dfs);
+
+	fp = fopen(tmp, "w");
+	if(fp == NULL) {
+		perror("opening index snapshot");
+		return -1;
+	}
+
+	for(int i = 0; i < meta.cap_bodies; i++) {
+		char record[128];
+		if(meta.bodies[i].used)
+			fwrite(record, 1, meta_format_body(record, &meta.bodies[i]), fp);
+	}
+
+	for(int i = 0; i < meta.num_entries; i++) {
+		file_entry *f = &meta.entries[i];
+		char record[strlen(f->name) + 192];
+		for(int j = 0; j < f->num_chunks; j++)
+			fwrite(record, 1, meta_format(record, f->name, &f->chunks[j], f->count), fp);
+
+		//a file we hold nothing of only stays in the index for its generation
+		if(f->num_chunks == 0 && f->gen > 0)
+			fwrite(record, 1, sprintf(record, "d %lld %d %s\n", f->gen, f->count, f->name), fp);
+	}
+
+	if(fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		perror("writing index snapshot");
 		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return rename(tmp, path);
+}
+
+//add every committed record in the segments, in the order they were written so later puts of a chunk win
+//contents are found first, since a chunk stored by reference can come before its body was last moved by compaction,
+//and SEG_BODY records only hold contents for others
+void meta_scan_segments(void) {
+	char hdr[SEG_HDR_LEN], name[BUFSIZE];
+	chunk_info ci;
+
+	for(int pass = 0; pass < 2; pass++) {
+		for(int i = 0; i < store.num_segs; i++) {
+			long long off = 0, len;
+			if(store.segs[i].fd < 0) continue;
+
+			while((len = seg_record(store.segs[i].fd, off, store.segs[i].end, hdr, name, &ci)) > 0) {
+				int flags = ci.flags;
+				ci.seg = i;
+				ci.flags &= SEG_HASHED | SEG_REF | SEG_CRC | SEG_LZ | SEG_GEN;
+
+				if(hdr[4] && pass == 0 && (flags & SEG_HASHED) && !(flags & SEG_REF)) {
+					cas_body b = { .seg = i, .off = off, .len = len, .size = ci.size };
+					memcpy(b.hash, ci.hash, CHASH_LEN);
+					pthread_rwlock_rdlock(&meta.lock);
+					int known = cas_lookup(ci.hash) != NULL;
+					pthread_rwlock_unlock(&meta.lock);
+					if(!known) meta_set_body(&b);
+				}
+				else if(hdr[4] && pass == 1 && !(flags & SEG_BODY))
+					meta_record(name, &ci, get_u32(hdr + 12), NULL);
+				off += len;
+			}
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//content hashes are already spread well, so their first bytes pick the slot
+unsigned long cas_slot(unsigned char *hash) {
+	return get_u64((char *) hash);
+}
+
+//caller holds meta.lock
+cas_body *cas_lookup(unsigned char *hash) {
+	if(meta.cap_bodies == 0) return NULL;
+
+	unsigned long mask = meta.cap_bodies - 1;
+	for(unsigned long i = cas_slot(hash) & mask; meta.bodies[i].used; i = (i + 1) & mask)
+		if(memcmp(meta.bodies[i].hash, hash, CHASH_LEN)==0) return &meta.bodies[i];
+	return NULL;
+}
+
+//add contents with no references yet, caller holds meta.lock for writing and has checked they aren't there
+//like the file table it's kept at most half full
+cas_body *cas_insert(unsigned char *hash) {
+	if(2*(meta.num_bodies + 1) > meta.cap_bodies) {
+		int cap = meta.cap_bodies ? 2*meta.cap_bodies : 1024;
+		cas_body *bodies = calloc(cap, sizeof(cas_body));
+		if(bodies == NULL) return NULL;
+
+		for(int j = 0; j < meta.cap_bodies; j++) {
+			if(!meta.bodies[j].used) continue;
+			unsigned long i = cas_slot(meta.bodies[j].hash) & (cap - 1);
+			while(bodies[i].used) i = (i + 1) & (cap - 1);
+			bodies[i] = meta.bodies[j];
+		}
+		free(meta.bodies);
+		meta.bodies = bodies;
+		meta.cap_bodies = cap;
+	}
+
+	unsigned long mask = meta.cap_bodies - 1, i = cas_slot(hash) & mask;
+	while(meta.bodies[i].used) i = (i + 1) & mask;
+	memset(&meta.bodies[i], 0, sizeof(cas_body));
+	meta.bodies[i].used = 1;
+	memcpy(meta.bodies[i].hash, hash, CHASH_LEN);
+	meta.num_bodies++;
+	return &meta.bodies[i];
+}
+
+//take b out of the table, moving back any later entries that would no longer be found past the hole
+void cas_remove(cas_body *b) {
+	unsigned long mask = meta.cap_bodies - 1, i = b - meta.bodies, j = i;
+
+	meta.bodies[i].used = 0;
+	meta.num_bodies--;
+	while(1) {
+		j = (j + 1) & mask;
+		if(!meta.bodies[j].used) return;
+
+		//the entry at j can fill the hole unless its home slot is cyclically in (i, j]
+		unsigned long home = cas_slot(meta.bodies[j].hash) & mask;
+		if(i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+			meta.bodies[i] = meta.bodies[j];
+			meta.bodies[j].used = 0;
+			i = j;
+		}
+	}
+}
+
+//nothing refers to b's contents any more, so free them, meta.lock held for writing
+//a rescan keeps them until it's done, a record further on may still refer to them
+void cas_drop(cas_body *b) {
+	if(meta.loading == 2) return;
+
+	if(b->seg >= 0)
+		store_dead(b->seg, b->len);
+	else if(!meta.loading) {
+		char path[strlen(config.dfs) + 2*CHASH_LEN + 10];
+		cas_path(path, b->hash);
+		unlink(path);
+	}
+	cas_remove(b);
+}
+
+//take a reference to the contents with hash so they can't be dropped, and copy out what we know about them
+//returns -1 (with body->used 0) if we don't hold them
+int cas_pin(unsigned char *hash, cas_body *body) {
+	pthread_rwlock_wrlock(&meta.lock);
+	cas_body *b = cas_lookup(hash);
+	if(b) {
+		b->refs++;
+		*body = *b;
+	}
+	else
+		body->used = 0;
+	pthread_rwlock_unlock(&meta.lock);
+	return b ? 0 : -1;
+}
+
+void cas_unpin(unsigned char *hash) {
+	pthread_rwlock_wrlock(&meta.lock);
+	cas_body *b = cas_lookup(hash);
+	if(b && --b->refs == 0) cas_drop(b);
+	pthread_rwlock_unlock(&meta.lock);
+}
+
+void cas_path(char *path, unsigned char *hash) {
+	char hex[2*CHASH_LEN + 1];
+	chash_hex(hash, hex);
+	sprintf(path, "%s/.cas/%s", config.dfs, hex);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//load the snapshot and replay the journal (or walk the directories if there's no snapshot),
+//then fold everything into a new snapshot and start an empty journal
+int meta_load(char *dfs) {
+	char path[strlen(dfs) + 20];
+
+	pthread_rwlock_init(&meta.lock, NULL);
+	meta.journal_fd = -1;
+
+	sprintf(path, "%s/.cas", dfs);
+	mkdir(path, 0700);
+
+	//loading is 1 while replaying, 2 while rescanning
+	sprintf(path, "%s/.index", dfs);
+	meta.loading = 1;
+	if(config.rescan || meta_read_records(path) < 0) {
+		meta.loading = 2;
+		meta_scan(dfs);
+		meta_scan_segments();
+	}
+	else {
+		sprintf(path, "%s/.journal", dfs);
+		meta_read_records(path);
+	}
+	meta.loading = 0;
+	meta_prune_bodies();
+
+	if(meta_write_snapshot(dfs) < 0) return -1;
+
+	sprintf(path, "%s/.journal", dfs);
+	meta.journal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+	if(meta.journal_fd < 0) {
+		perror("opening journal");
+		return -1;
+	}
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//open the segments in <dfs>/.seg, before the index is loaded so a rescan can read them
+//returns -1 on error
+int store_open(char *dfs) {
+	struct dirent *d;
+	DIR *dh;
+
+	pthread_mutex_init(&store.lock, NULL);
+	pthread_cond_init(&store.wake, NULL);
+	store.active = -1;
+
+	store.path = malloc(strlen(dfs) + 6);
+	if(store.path == NULL) {
+		perror("malloc for segment path");
+		return -1;
+	}
+	sprintf(store.path, "%s/.seg", dfs);
+	if(config.segments) mkdir(store.path, 0700);
+
+	dh = opendir(store.path);
+	if(!dh) {
+		//without -s there don't have to be any segments
+		if(!config.segments) return 0;
+		perror("opening segment directory");
+		return -1;
+	}
+
+	while((d = readdir(dh)) != NULL) {
+		char *end;
+		long n = strtol(d->d_name, &end, 10);
+		if(end == d->d_name || strcmp(end, ".seg") != 0 || n < 0 || n > 1000000000) continue;
+		if(store_add(n, 0) < 0) {
+			closedir(dh);
+			return -1;
+		}
+	}
+	closedir(dh);
+	return 0;
+}
+
+//once the index is loaded, work out how much of each segment is dead and start the compactor
+//with -s a fresh active segment is started, the last one may end in a record torn by a crash so it's never appended to again
+//returns -1 on error
+int store_start(void) {
+	long long *live = calloc(store.num_segs + 1, sizeof(long long));
+	pthread_t compactor;
+
+	if(live == NULL) {
+		perror("malloc for segment sizes");
+		return -1;
+	}
+	//a chunk's record that's also the body of its contents is only counted once
+	pthread_rwlock_rdlock(&meta.lock);
+	for(int i = 0; i < meta.cap_bodies; i++) {
+		cas_body *b = &meta.bodies[i];
+		if(b->used && b->seg >= 0 && b->seg < store.num_segs) live[b->seg] += b->len;
+	}
+	for(int i = 0; i < meta.num_entries; i++) {
+		file_entry *f = &meta.entries[i];
+		for(int j = 0; j < f->num_chunks; j++) {
+			chunk_info *ci = &f->chunks[j];
+			cas_body *b = ci->flags & SEG_HASHED ? cas_lookup(ci->hash) : NULL;
+			if(ci->seg < 0 || ci->seg >= store.num_segs || (b && b->seg == ci->seg && b->off == ci->off)) continue;
+			live[ci->seg] += chunk_len(f->name, ci);
+		}
+	}
+	pthread_rwlock_unlock(&meta.lock);
+
+	for(int i = 0; i < store.num_segs; i++)
+		store.segs[i].dead = store.segs[i].end - live[i];
+	free(live);
+
+	if(config.segments && store_new_segment() < 0) return -1;
+	if(store.num_segs == 0) return 0;
+
+	if(pthread_create(&compactor, NULL, compactor_thread, NULL) != 0) {
+		perror("starting compactor");
+		return -1;
+	}
+	pthread_detach(compactor);
+	return 0;
+}
+
+//open segment n, creating it (empty) if create is set, and add it to the table
+//store.lock must be held once the server is running
+//returns -1 on error
+int store_add(int n, int create) {
+	char path[strlen(store.path) + 20];
+	struct stat st;
+	int fd;
+
+	if(n >= store.num_segs) {
+		segment *segs = realloc(store.segs, (n + 1) * sizeof(segment));
+		if(segs == NULL) {
+			perror("malloc for segment table");
+			return -1;
+		}
+		for(int i = store.num_segs; i <= n; i++)
+			segs[i] = (segment) { .fd = -1 };
+		store.segs = segs;
+		store.num_segs = n + 1;
+	}
+
+	seg_path(path, n);
+	fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0666);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror("opening segment");
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+	store.segs[n] = (segment) { .fd = fd, .end = st.st_size };
+	return 0;
+}
+
+//seal the active segment and start the next one, store.lock must be held once the server is running
+//returns -1 on error, the old segment stays active in that case
+int store_new_segment(void) {
+	int n = store.num_segs;
+
+	if(store_add(n, 1) < 0) return -1;
+	store.active = n;
+	pthread_cond_signal(&store.wake);
+	return 0;
+}
+
+//reserve len bytes at the end of the active segment for a record, starting a new segment if this one is full
+//the segment can't be compacted until store_done is called for it
+//returns the segment's fd and sets seg and off to where the record goes, or returns -1 if there's nowhere to put it
+int store_reserve(long long len, int *seg, long long *off) {
+	int fd = -1;
+
+	pthread_mutex_lock(&store.lock);
+	//without -s there's only an active segment once the compactor needs somewhere to copy to
+	if(store.active < 0) store_new_segment();
+
+	if(store.active >= 0) {
+		segment *s = &store.segs[store.active];
+		if(s->end > 0 && s->end + len > SEGMENT_MAX && store_new_segment() == 0)
+			s = &store.segs[store.active];
+
+		*seg = store.active;
+		*off = s->end;
+		s->end += len;
+		s->writers++;
+		fd = s->fd;
+	}
+	pthread_mutex_unlock(&store.lock);
+	return fd;
+}
+
+//done writing a record reserved with store_reserve
+void store_done(int seg) {
+	pthread_mutex_lock(&store.lock);
+	store.segs[seg].writers--;
+	pthread_cond_signal(&store.wake);
+	pthread_mutex_unlock(&store.lock);
+}
+
+//len bytes of segment seg are no longer referenced by the index
+void store_dead(int seg, long long len) {
+	pthread_mutex_lock(&store.lock);
+	if(seg < store.num_segs && store.segs[seg].fd >= 0) {
+		store.segs[seg].dead += len;
+		pthread_cond_signal(&store.wake);
+	}
+	pthread_mutex_unlock(&store.lock);
+}
+
+//a sealed segment nobody is writing to that's at least half dead (or empty), store.lock must be held
+//returns -1 if there isn't one
+int store_victim(void) {
+	for(int i = 0; i < store.num_segs; i++) {
+		segment *s = &store.segs[i];
+		if(i != store.active && s->fd >= 0 && s->writers == 0 && 2*s->dead >= s->end)
+			return i;
+	}
+	return -1;
+}
+
+void *compactor_thread(void *args) {
+	(void) args;
+
+	while(1) {
+		int victim;
+
+		pthread_mutex_lock(&store.lock);
+		while((victim = store_victim()) < 0)
+			pthread_cond_wait(&store.wake, &store.lock);
+		pthread_mutex_unlock(&store.lock);
+
+		//on failure the segment is kept and left alone until more of it dies
+		if(compact_segment(victim) < 0) {
+			pthread_mutex_lock(&store.lock);
+			store.segs[victim].dead = 0;
+			pthread_mutex_unlock(&store.lock);
+		}
+	}
+	return NULL;
+}
+
+//copy the records of segment n that the index still points at (as a chunk or as the body of some contents)
+//to the active segment, then remove it
+//copies are only committed once the index points at them, so a rescan after a crash finds exactly one committed copy,
+//and one that's only still needed as a body is marked SEG_BODY so a rescan doesn't take it for a put of its chunk
+//returns -1 if the segment couldn't be emptied, it's kept in that case
+int compact_segment(int n) {
+	char hdr[SEG_HDR_LEN], name[BUFSIZE];
+	chunk_info rec;
+	char path[strlen(store.path) + 20];
+	long long off = 0, end, len;
+	int fd, first_to = -1;
+
+	pthread_mutex_lock(&store.lock);
+	fd = store.segs[n].fd;
+	end = store.segs[n].end;
+	pthread_mutex_unlock(&store.lock);
+
+	while((len = seg_record(fd, off, end, hdr, name, &rec)) > 0) {
+		int chunk = rec.chunk, flags = rec.flags, live = 0, moved;
+		unsigned char *hash = rec.hash;
+		int is_body = (flags & SEG_HASHED) && !(flags & SEG_REF);
+		int to, to_fd;
+		long long to_off;
+
+		if(hdr[4]) {
+			pthread_rwlock_rdlock(&meta.lock);
+			file_entry *f = meta_lookup(name);
+			chunk_info *ci = f && !(flags & SEG_BODY) ? meta_chunk(f, chunk) : NULL;
+			cas_body *b = is_body ? cas_lookup(hash) : NULL;
+			live = (ci && ci->seg == n && ci->off == off) || (b && b->seg == n && b->off == off);
+			pthread_rwlock_unlock(&meta.lock);
+		}
+
+		if(live) {
+			to_fd = store_reserve(len, &to, &to_off);
+			if(to_fd < 0) return -1;
+			if(first_to < 0) first_to = to;
+
+			hdr[4] = 0;
+			if(pwrite(to_fd, hdr, SEG_HDR_LEN, to_off) != SEG_HDR_LEN
+					|| copy_range(fd, off + SEG_HDR_LEN, to_fd, to_off + SEG_HDR_LEN, len - SEG_HDR_LEN) < 0) {
+				perror("copying segment record");
+				store_dead(to, len);
+				store_done(to);
+				return -1;
+			}
+
+			moved = meta_move(name, chunk, is_body ? hash : NULL, n, off, to, to_off);
+			hdr[4] = 1;
+			hdr[5] = flags | (moved & 1 ? 0 : SEG_BODY);
+			if(!moved)
+				store_dead(to, len);
+			else if(pwrite(to_fd, hdr + 4, 2, to_off + 4) != 2)
+				perror("committing segment record");
+			store_done(to);
+		}
+		off += len;
+	}
+
+	//the copies have to be on disk before the originals go
+	if(first_to >= 0) {
+		pthread_mutex_lock(&store.lock);
+		for(int i = first_to; i < store.num_segs; i++)
+			if(store.segs[i].fd >= 0) fdatasync(store.segs[i].fd);
+		pthread_mutex_unlock(&store.lock);
+	}
+
+	//and so do the journal records that point the index at them, or replaying it after a crash would point the index
+	//back at records that are gone
+	if(meta_sync() < 0) return -1;
+
+	//a record we couldn't walk past would leave chunks behind, so check nothing still points here
+	if(meta_uses_segment(n)) {
+		fprintf(stderr, "Couldn't compact segment %d\n", n);
+		return -1;
+	}
+
+	pthread_mutex_lock(&store.lock);
+	close(store.segs[n].fd);
+	store.segs[n] = (segment) { .fd = -1 };
+	pthread_mutex_unlock(&store.lock);
+
+	seg_path(path, n);
+	unlink(path);
+	return 0;
+}
+
+//read the header and filename of the record at off in a segment that's end bytes long,
+//and fill in ci from it as it is in the record (every flag, and seg left alone)
+//returns the record's length, or -1 if there isn't a whole record there (the end of the segment, or a torn write)
+long long seg_record(int fd, long long off, long long end, char *hdr, char *name, chunk_info *ci) {
+	if(off + SEG_HDR_LEN > end || pread(fd, hdr, SEG_HDR_LEN, off) != SEG_HDR_LEN) return -1;
+	if(get_u32(hdr) != SEG_MAGIC) return -1;
+
+	int flags = (unsigned char) hdr[5], name_len = get_u16(hdr + 6);
+	int hash_len = flags & SEG_HASHED ? CHASH_LEN : 0, crc_len = flags & SEG_CRC ? 4 : 0, raw_len = flags & SEG_LZ ? 8 : 0;
+	int sums_len = seg_sums_len(flags);
+	long long len = SEG_HDR_LEN + name_len + sums_len + (flags & SEG_REF ? 0 : (long long) get_u64(hdr + 16));
+	if(name_len == 0 || name_len >= BUFSIZE || len > end - off) return -1;
+
+	char buf[name_len + CHASH_LEN + 20];
+	if(pread(fd, buf, name_len + sums_len, off + SEG_HDR_LEN) != name_len + sums_len) return -1;
+	memcpy(name, buf, name_len);
+	name[name_len] = '\0';
+
+	ci->chunk = get_u32(hdr + 8);
+	ci->size = get_u64(hdr + 16);
+	ci->off = off;
+	ci->flags = flags;
+	memset(ci->hash, 0, CHASH_LEN);
+	memcpy(ci->hash, buf + name_len, hash_len);
+	ci->crc = crc_len ? get_u32(buf + name_len + hash_len) : 0;
+	ci->raw = raw_len ? (long long) get_u64(buf + name_len + hash_len + crc_len) : 0;
+	ci->gen = flags & SEG_GEN ? (long long) get_u64(buf + name_len + hash_len + crc_len + raw_len) : 0;
+	return len;
+}
+
+//pack what goes between a record's filename and its contents for ci's flags into buf, which needs CHASH_LEN + 20 bytes
+//returns how long it is
+int seg_sums(char *buf, chunk_info *ci) {
+	int len = 0;
+
+	if(ci->flags & SEG_HASHED) {
+		memcpy(buf, ci->hash, CHASH_LEN);
+		len += CHASH_LEN;
+	}
+	if(ci->flags & SEG_CRC) {
+		put_u32(buf + len, ci->crc);
+		len += 4;
+	}
+	if(ci->flags & SEG_LZ) {
+		put_u64(buf + len, ci->raw);
+		len += 8;
 	}
+	if(ci->flags & SEG_GEN) {
+		put_u64(buf + len, ci->gen);
+		len += 8;
+	}
+	return len;
+}
+
+int seg_sums_len(int flags) {
+	return (flags & SEG_HASHED ? CHASH_LEN : 0) + (flags & SEG_CRC ? 4 : 0) + (flags & SEG_LZ ? 8 : 0) + (flags & SEG_GEN ? 8 : 0);
+}
+
+//copy len bytes between files, in the kernel if it can
+//returns -1 on error
+int copy_range(int from, long long from_off, int to, long long to_off, long long len) {
+	char buf[FRAME_BUFSIZE];
+
+	while(len > 0) {
+		loff_t in = from_off, out = to_off;
+		ssize_t n = copy_file_range(from, &in, to, &out, len, 0);
+
+		//older kernels and some filesystems can't, so fall back to copying through a buffer
+		if(n < 0 && errno != EINTR) {
+			n = pread(from, buf, len < (long long) sizeof(buf) ? len : (long long) sizeof(buf), from_off);
+			if(n > 0 && pwrite(to, buf, n, to_off) != n) n = -1;
+		}
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(n == 0) {
+			errno = EIO;
+			return -1;
+		}
+		from_off += n;
+		to_off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void seg_path(char *path, int n) {
+	sprintf(path, "%s/%d.seg", store.path, n);
 }
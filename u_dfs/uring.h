@@ -0,0 +1,163 @@
+#ifndef URING_H
+#define URING_H
+
+//just enough io_uring for u_dfs, straight on the system calls so there's nothing to link against
+//a ring is a submission queue of operations for the kernel to start and a completion queue of their results,
+//both shared with the kernel through memory, so one uring_submit can start a whole batch of writes
+//and their results are read without another system call
+//buffers and files can be registered with the kernel up front, which saves it mapping them again on every operation
+//one thread per ring, there's no locking here
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned sq_entries, queued;
+} uring;
+
+static inline int uring_enter(uring *r, unsigned submit, unsigned wait, unsigned flags) {
+	return syscall(__NR_io_uring_enter, r->fd, submit, wait, flags, NULL, 0);
+}
+
+static inline int uring_register(uring *r, unsigned opcode, void *arg, unsigned n) {
+	return syscall(__NR_io_uring_register, r->fd, opcode, arg, n);
+}
+
+static void uring_exit(uring *r) {
+	if(r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+	if(r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_len);
+	if(r->sq_ring != NULL && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_len);
+	if(r->fd >= 0) close(r->fd);
+	r->fd = -1;
+}
+
+//set up a ring with room for entries operations at once
+//returns -1 with errno set if the kernel doesn't have io_uring (or won't let us use it)
+static int uring_init(uring *r, unsigned entries) {
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(uring));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0) return -1;
+
+	//newer kernels put both rings in one mapping
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ring == MAP_FAILED) goto fail;
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else {
+		r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_ring == MAP_FAILED) goto fail;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED) goto fail;
+
+	r->sq_head = (unsigned *)((char *) r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *) r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *) r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *) r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *) r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *) r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *) r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *) r->cq_ring + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	return 0;
+
+fail:
+	uring_exit(r);
+	return -1;
+}
+
+//the next free submission entry, cleared, or NULL if the queue is full until uring_submit
+static struct io_uring_sqe *uring_sqe(uring *r) {
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE), tail = *r->sq_tail + r->queued;
+
+	if(tail - head >= r->sq_entries) return NULL;
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[i] = i;
+	r->queued++;
+	return sqe;
+}
+
+//hand everything queued to the kernel and wait until at least wait operations have completed
+//returns -1 with errno set if that failed
+static int uring_submit(uring *r, unsigned wait) {
+	unsigned submit = r->queued;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+	r->queued = 0;
+	while(submit > 0 || wait > 0) {
+		int n = uring_enter(r, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(n == 0 && submit > 0) {
+			errno = EBUSY;
+			return -1;
+		}
+		submit -= n;
+		wait = 0;
+	}
+	return 0;
+}
+
+//the oldest completion we haven't looked at, or NULL if there are none, uring_seen moves past it
+static struct io_uring_cqe *uring_cqe(uring *r) {
+	unsigned head = *r->cq_head;
+
+	if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_seen(uring *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//register n buffers for IORING_OP_WRITE_FIXED (and the other fixed operations) to use by index
+static inline int uring_register_buffers(uring *r, struct iovec *bufs, unsigned n) {
+	return uring_register(r, IORING_REGISTER_BUFFERS, bufs, n);
+}
+
+//register a table of n files, all empty to start with, which operations with IOSQE_FIXED_FILE use by index
+static int uring_register_files(uring *r, unsigned n) {
+	int fds[n];
+
+	for(unsigned i = 0; i < n; i++) fds[i] = -1;
+	return uring_register(r, IORING_REGISTER_FILES, fds, n);
+}
+
+//put fd in slot of the file table, -1 empties it
+static int uring_update_file(uring *r, unsigned slot, int fd) {
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (uint64_t)(uintptr_t) &fd;
+	return uring_register(r, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+#endif